@@ -0,0 +1,317 @@
+#include "CompilationDatabaseJob.h"
+#include "HelperThreads.h"
+#include "RTags.h"
+#include "Server.h"
+#include <rct/Log.h>
+#include <rct/Mutex.h>
+#include <rct/StopWatch.h>
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Just enough JSON for compilation databases. The file is read in chunks so
+// big databases are never in memory as a whole
+class JSONReader
+{
+public:
+    JSONReader(FILE *f)
+        : mFile(f), mPos(0), mSize(0)
+    {}
+
+    int peek()
+    {
+        if (mPos == mSize) {
+            mSize = fread(mBuffer, 1, sizeof(mBuffer), mFile);
+            mPos = 0;
+            if (!mSize)
+                return -1;
+        }
+        return static_cast<unsigned char>(mBuffer[mPos]);
+    }
+    int get()
+    {
+        const int ch = peek();
+        if (ch != -1)
+            ++mPos;
+        return ch;
+    }
+    int skipWhitespace()
+    {
+        int ch;
+        while ((ch = peek()) != -1 && isspace(ch))
+            ++mPos;
+        return ch;
+    }
+    bool expect(char ch)
+    {
+        if (skipWhitespace() != ch)
+            return false;
+        ++mPos;
+        return true;
+    }
+    bool readString(String &out);
+    bool skipValue();
+private:
+    FILE *mFile;
+    char mBuffer[16384];
+    int mPos, mSize;
+};
+
+static inline void appendUtf8(String &out, unsigned code)
+{
+    if (code < 0x80) {
+        out.append(static_cast<char>(code));
+    } else if (code < 0x800) {
+        out.append(static_cast<char>(0xc0 | (code >> 6)));
+        out.append(static_cast<char>(0x80 | (code & 0x3f)));
+    } else {
+        out.append(static_cast<char>(0xe0 | (code >> 12)));
+        out.append(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+}
+
+bool JSONReader::readString(String &out)
+{
+    out.clear();
+    if (!expect('"'))
+        return false;
+    while (true) {
+        int ch = get();
+        switch (ch) {
+        case -1:
+            return false;
+        case '"':
+            return true;
+        case '\\':
+            ch = get();
+            switch (ch) {
+            case -1: return false;
+            case 'b': out.append('\b'); break;
+            case 'f': out.append('\f'); break;
+            case 'n': out.append('\n'); break;
+            case 'r': out.append('\r'); break;
+            case 't': out.append('\t'); break;
+            case 'u': {
+                char hex[5] = { 0 };
+                for (int i=0; i<4; ++i) {
+                    const int h = get();
+                    if (h == -1)
+                        return false;
+                    hex[i] = h;
+                }
+                appendUtf8(out, strtoul(hex, 0, 16));
+                break; }
+            default: // \" \\ and \/
+                out.append(static_cast<char>(ch));
+                break;
+            }
+            break;
+        default:
+            out.append(static_cast<char>(ch));
+            break;
+        }
+    }
+}
+
+bool JSONReader::skipValue()
+{
+    const int ch = skipWhitespace();
+    if (ch == '"') {
+        String dummy;
+        return readString(dummy);
+    } else if (ch == '{' || ch == '[') {
+        int depth = 0;
+        do {
+            const int c = skipWhitespace();
+            if (c == '"') {
+                String dummy;
+                if (!readString(dummy))
+                    return false;
+                continue;
+            }
+            get();
+            if (c == -1) {
+                return false;
+            } else if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                --depth;
+            }
+        } while (depth);
+        return true;
+    }
+    // numbers, true, false and null
+    bool ok = false;
+    int c;
+    while ((c = peek()) != -1 && c != ',' && c != '}' && c != ']' && !isspace(c)) {
+        get();
+        ok = true;
+    }
+    return ok;
+}
+
+// GccArguments wants one command line, it knows about quotes but not escapes
+static String joinArguments(const List<String> &args)
+{
+    String ret;
+    for (int i=0; i<args.size(); ++i) {
+        if (i)
+            ret.append(' ');
+        const String &arg = args.at(i);
+        if (arg.contains(' ') && !arg.contains('"')) {
+            ret.append('"');
+            ret.append(arg);
+            ret.append('"');
+        } else {
+            ret.append(arg);
+        }
+    }
+    return ret;
+}
+
+static bool readCommands(FILE *f, List<CompilationDatabaseJob::Command> &commands, int *duplicates)
+{
+    JSONReader reader(f);
+    if (!reader.expect('['))
+        return false;
+    if (reader.skipWhitespace() == ']')
+        return true;
+    Map<uint64_t, int> seen;
+    while (true) {
+        if (!reader.expect('{'))
+            return false;
+        CompilationDatabaseJob::Command command;
+        if (reader.skipWhitespace() != '}') {
+            while (true) {
+                String key;
+                if (!reader.readString(key) || !reader.expect(':'))
+                    return false;
+                if (key == "directory") {
+                    if (!reader.readString(command.directory))
+                        return false;
+                } else if (key == "command") {
+                    if (!reader.readString(command.command))
+                        return false;
+                } else if (key == "arguments") {
+                    if (!reader.expect('['))
+                        return false;
+                    List<String> args;
+                    if (reader.skipWhitespace() != ']') {
+                        do {
+                            String arg;
+                            if (!reader.readString(arg))
+                                return false;
+                            args.append(arg);
+                        } while (reader.expect(','));
+                    }
+                    if (!reader.expect(']'))
+                        return false;
+                    command.command = joinArguments(args);
+                } else if (!reader.skipValue()) {
+                    return false;
+                }
+                if (!reader.expect(','))
+                    break;
+            }
+        }
+        if (!reader.expect('}'))
+            return false;
+
+        if (!command.command.isEmpty()) {
+            if (!command.directory.endsWith('/'))
+                command.directory.append('/');
+            // build systems happily list the same command many times
+            const uint64_t key = RTags::hash(command.command, RTags::hash(command.directory));
+            const Map<uint64_t, int>::const_iterator it = seen.find(key);
+            if (it != seen.end() && commands.at(it->second).command == command.command
+                && commands.at(it->second).directory == command.directory) {
+                ++*duplicates;
+            } else {
+                seen[key] = commands.size();
+                commands.append(command);
+            }
+        }
+        if (!reader.expect(','))
+            break;
+    }
+    return reader.expect(']');
+}
+
+enum { ChunkSize = 64 };
+
+struct ParseState
+{
+    const List<CompilationDatabaseJob::Command> *commands;
+    List<GccArguments> *args;
+    List<char> *parsed;
+    Mutex mutex;
+    int next;
+};
+
+static void parseCommands(void *userData, int)
+{
+    ParseState *state = static_cast<ParseState*>(userData);
+    while (true) {
+        int from;
+        {
+            MutexLocker lock(&state->mutex);
+            from = state->next;
+            state->next += ChunkSize;
+        }
+        const int to = std::min<int>(from + ChunkSize, state->commands->size());
+        if (from >= to)
+            return;
+        for (int i=from; i<to; ++i) {
+            const CompilationDatabaseJob::Command &command = state->commands->at(i);
+            (*state->parsed)[i] = (*state->args)[i].parse(command.command, command.directory);
+        }
+    }
+}
+
+CompilationDatabaseJob::CompilationDatabaseJob(const Path &file, const List<String> &projects)
+    : mFile(file), mProjects(projects)
+{
+}
+
+void CompilationDatabaseJob::run()
+{
+    StopWatch watch;
+    List<GccArguments> ret;
+    int count, duplicates = 0;
+    {
+        List<Command> commands;
+        FILE *f = fopen(mFile.constData(), "r");
+        if (!f) {
+            error("Can't open %s", mFile.constData());
+            return;
+        }
+        const bool ok = readCommands(f, commands, &duplicates);
+        fclose(f);
+        if (!ok) {
+            error("Failed to parse %s", mFile.constData());
+            return;
+        }
+        count = commands.size();
+
+        List<GccArguments> args(count);
+        List<char> parsed(count, 0);
+        ParseState state;
+        state.commands = &commands;
+        state.args = &args;
+        state.parsed = &parsed;
+        state.next = 0;
+        const int threadCount = std::max(1, std::min(Server::instance()->options().threadCount, count / ChunkSize + 1));
+        HelperThreads::run(threadCount, parseCommands, &state);
+
+        ret.reserve(count);
+        for (int i=0; i<count; ++i) {
+            if (parsed.at(i))
+                ret.append(args.at(i));
+        }
+    }
+    error("Loaded %d compile commands from %s in %dms (%d duplicates, %d failed to parse)",
+          ret.size(), mFile.constData(), watch.elapsed(), duplicates, count - ret.size());
+    argsReady()(ret, mProjects);
+}
@@ -0,0 +1,29 @@
+#ifndef CompilationDatabaseJob_h
+#define CompilationDatabaseJob_h
+
+#include <rct/ThreadPool.h>
+#include <rct/Path.h>
+#include <rct/SignalSlot.h>
+#include "GccArguments.h"
+
+// Reads a compile_commands.json in one go and hands every distinct command
+// to the server at once instead of one CompileMessage per command
+class CompilationDatabaseJob : public ThreadPool::Job
+{
+public:
+    CompilationDatabaseJob(const Path &file, const List<String> &projects);
+    virtual void run();
+    signalslot::Signal2<const List<GccArguments> &, const List<String> &> &argsReady() { return mArgsReady; }
+
+    struct Command
+    {
+        Path directory;
+        String command;
+    };
+private:
+    const Path mFile;
+    const List<String> mProjects;
+    signalslot::Signal2<const List<GccArguments> &, const List<String> &> mArgsReady;
+};
+
+#endif
@@ -5,10 +5,13 @@
 #include "Project.h"
 #include <IndexerJobClang.h>
 #include "Server.h"
+#include "TokenIndex.h"
+#include <rct/Mutex.h>
+#include <algorithm>
 
 CompletionJob::CompletionJob(const shared_ptr<Project> &project, Type type)
     : Job(WriteBuffered|WriteUnfiltered|QuietJob, project), mIndex(0), mUnit(0),
-      mLine(-1), mColumn(-1), mPos(-1), mParseCount(-1), mType(type)
+      mLine(-1), mColumn(-1), mPos(-1), mParseCount(-1), mOffset(0), mMax(-1), mFilterPrefix(false), mType(type)
 {
 }
 
@@ -31,86 +34,105 @@ static inline bool isPartOfSymbol(char ch)
     return isalnum(ch) || ch == '_';
 }
 
+// The signature is only built for nodes that are written
 struct CompletionNode
 {
     String completion, signature;
     int priority, distance;
+    unsigned result; // index in CXCodeCompleteResults
 };
 
-static int compareCompletionNode(const void *left, const void *right)
+static String completionSignature(const CXCompletionString &string)
 {
-    const CompletionNode *l = reinterpret_cast<const CompletionNode*>(left);
-    const CompletionNode *r = reinterpret_cast<const CompletionNode*>(right);
-    if (l->priority != r->priority)
-        return l->priority < r->priority ? -1 : 1;
-    if ((l->distance != -1) != (r->distance != -1))
-        return l->distance != -1 ? -1 : 1;
-    if (l->distance != r->distance)
-        return l->distance > r->distance ? -1 : 1;
-    return strcmp(l->completion.constData(), r->completion.constData());
+    String signature;
+    signature.reserve(256);
+    const int chunkCount = clang_getNumCompletionChunks(string);
+    for (int j=0; j<chunkCount; ++j) {
+        const CXCompletionChunkKind chunkKind = clang_getCompletionChunkKind(string, j);
+        signature.append(RTags::eatString(clang_getCompletionChunkText(string, j)));
+        if (chunkKind == CXCompletionChunk_ResultType)
+            signature.append(' ');
+    }
+    signature.replace("\n", "");
+    return signature;
 }
 
-struct Token
+// Builds the signatures of the nodes in the range and returns them
+static List<CompletionNode> completionRange(List<CompletionNode> &nodes, CXCodeCompleteResults *results,
+                                            int offset, int max)
 {
-    Token(const char *bytes = 0, int size = 0)
-        : data(bytes), length(size)
-    {}
-
-    inline bool operator==(const Token &other) const
-    {
-        return length == other.length && !strncmp(data, other.data, length);
-    }
-    inline bool operator<(const Token &other) const
-    {
-        const int minLength = std::min(length, other.length);
-        if (minLength) {
-            const int cmp = strncmp(data, other.data, minLength);
-            if (cmp < 0)
-                return true;
-            if (cmp > 0)
-                return false;
-        }
-
-        return length > other.length;
+    const int end = max < 0 ? nodes.size() : std::min<int>(nodes.size(), offset + max);
+    List<CompletionNode> ret;
+    for (int i=std::max(0, offset); i<end; ++i) {
+        CompletionNode &node = nodes[i];
+        if (node.signature.isEmpty())
+            node.signature = completionSignature(results->Results[node.result].CompletionString);
+        ret.append(node);
     }
+    return ret;
+}
 
-    const char *data;
-    int length;
+// The last result set for each file. With CompletionMessage::FilterPrefix it
+// is narrowed to the identifier typed so far and typing more of it only
+// filters these, otherwise prefix is empty and the whole set is reused for
+// anything typed at the same position. clang is asked again when anything
+// else in the buffer or the arguments change.
+struct CompletionCacheEntry
+{
+    CompletionCacheEntry()
+        : context(0), lastUsed(0)
+    {}
+    uint64_t context;
+    String prefix;
+    List<CompletionNode> nodes;
+    // for the signatures of the rest, the results don't need the unit
+    shared_ptr<CXCodeCompleteResults> results;
+    uint64_t lastUsed;
+    TokenIndex tokens;
 };
 
-static inline bool symbolChar(char ch)
-{
-    switch (ch) {
-    case '_':
-    case '~':
-        return true;
-    default:
-        break;
-    }
-    return isalnum(ch);
-}
+static Mutex sCacheMutex;
+static Map<Path, CompletionCacheEntry> sCache;
+static uint64_t sCacheCounter = 0;
 
-static inline void addToken(const char *data, int pos, int len, Map<Token, int> &tokens)
+// Finds the identifier being completed. Returns 0 if the position isn't in
+// the buffer, otherwise a hash of everything around the identifier
+static uint64_t completionContext(const String &contents, int line, int column, int pos,
+                                  const List<String> &args, String &prefix, int &start, int &cursor)
 {
-    int &val = tokens[Token(data + pos, len)];
-    if (!val)
-        val = pos;
+    const char *data = contents.constData();
+    const int size = contents.size();
+    cursor = pos;
+    if (cursor < 0 || cursor > size) {
+        int lineStart = 0;
+        for (int l=1; l<line; ++l) {
+            const char *nl = static_cast<const char*>(memchr(data + lineStart, '\n', size - lineStart));
+            if (!nl)
+                return 0;
+            lineStart = nl - data + 1;
+        }
+        cursor = lineStart + column - 1;
+        if (column < 1 || cursor > size)
+            return 0;
+    }
+    start = cursor;
+    while (start > 0 && isPartOfSymbol(data[start - 1]))
+        --start;
+    prefix = String(data + start, cursor - start);
+    uint64_t ret = RTags::hash(data, start, RTags::hash(args));
+    ret = RTags::hash(data + cursor, size - cursor, ret);
+    return ret ? ret : 1;
 }
 
-static inline void tokenize(const char *data, int size, Map<Token, int> &tokens)
+static bool compareCompletionNode(const CompletionNode &l, const CompletionNode &r)
 {
-    int tokenEnd = -1;
-    for (int i=size - 1; i>=0; --i) {
-        if (symbolChar(data[i])) {
-            if (tokenEnd == -1)
-                tokenEnd = i;
-        } else if (tokenEnd != -1) {
-            addToken(data, i + 1, tokenEnd - i, tokens);
-            tokenEnd = -1;
-        }
-    }
-    if (tokenEnd != -1)
-        addToken(data, 0, tokenEnd + 1, tokens);
+    if (l.priority != r.priority)
+        return l.priority < r.priority;
+    if ((l.distance != -1) != (r.distance != -1))
+        return l.distance != -1;
+    if (l.distance != r.distance) // closer to the cursor first
+        return l.distance < r.distance;
+    return strcmp(l.completion.constData(), r.completion.constData()) < 0;
 }
 
 void CompletionJob::processDiagnostics(CXCodeCompleteResults* results)
@@ -136,9 +158,88 @@ void CompletionJob::processDiagnostics(CXCodeCompleteResults* results)
     log(RTags::CompilationError, "$");
 }
 
+void CompletionJob::writeNodes(const List<CompletionNode> &nodes)
+{
+    for (int i=0; i<nodes.size(); ++i) {
+        const CompletionNode &node = nodes.at(i);
+        if (!i && mType == Stream) {
+            write<128>("`%s %s", node.completion.constData(), node.signature.constData());
+        } else {
+            write<128>("%s %s", node.completion.constData(), node.signature.constData());
+        }
+    }
+}
+
+// Hands the unit back for the next completion in the file
+void CompletionJob::finish()
+{
+    if (mUnit) {
+        shared_ptr<Project> proj = project();
+        if (proj) {
+            proj->addToCache(mPath, mArgs, mIndex, mUnit, mParseCount);
+        } else {
+            clang_disposeTranslationUnit(mUnit);
+            clang_disposeIndex(mIndex);
+        }
+        mUnit = 0;
+        mIndex = 0;
+    }
+    mFinished(mPath);
+}
+
+void CompletionJob::clearCache(const Path &path)
+{
+    MutexLocker lock(&sCacheMutex);
+    sCache.remove(path);
+}
+
 void CompletionJob::execute()
 {
     StopWatch timer;
+    if (isAborted()) { // a newer request for the file came in while this one was queued
+        finish();
+        return;
+    }
+    String prefix;
+    int start = -1, cursor = -1;
+    const String contents = mUnsaved.isEmpty() ? mPath.readAll() : mUnsaved;
+    const uint64_t context = completionContext(contents, mLine, mColumn, mPos, mArgs, prefix, start, cursor);
+    if (context) {
+        List<CompletionNode> nodes;
+        bool found = false;
+        {
+            MutexLocker lock(&sCacheMutex);
+            Map<Path, CompletionCacheEntry>::iterator it = sCache.find(mPath);
+            if (it != sCache.end() && it->second.context == context
+                && (mFilterPrefix ? prefix.startsWith(it->second.prefix) : it->second.prefix.isEmpty())) {
+                CompletionCacheEntry &entry = it->second;
+                if (mFilterPrefix && prefix.size() != entry.prefix.size()) {
+                    int count = 0;
+                    for (int i=0; i<entry.nodes.size(); ++i) {
+                        if (entry.nodes.at(i).completion.startsWith(prefix)) {
+                            if (i != count)
+                                std::swap(entry.nodes[count], entry.nodes[i]);
+                            ++count;
+                        }
+                    }
+                    entry.nodes.resize(count);
+                    entry.prefix = prefix;
+                }
+                entry.lastUsed = ++sCacheCounter;
+                nodes = completionRange(entry.nodes, entry.results.get(), mOffset, mMax);
+                found = true;
+            }
+        }
+        if (found) {
+            writeNodes(nodes);
+            warning() << "Wrote" << nodes.size() << "cached completions for"
+                      << String::format<128>("%s:%d:%d", mPath.constData(), mLine, mColumn)
+                      << "in" << timer.elapsed() << "ms";
+            finish();
+            return;
+        }
+    }
+
     CXUnsavedFile unsavedFile = { mUnsaved.isEmpty() ? 0 : mPath.constData(),
                                   mUnsaved.isEmpty() ? 0 : mUnsaved.constData(),
                                   static_cast<unsigned long>(mUnsaved.size()) };
@@ -146,13 +247,27 @@ void CompletionJob::execute()
         assert(!mIndex);
         mIndex = clang_createIndex(0, 1);
         String clangLine;
-        RTags::parseTranslationUnit(mPath, mArgs, mUnit, mIndex, clangLine,
-                                    0, 0, &unsavedFile, 1);
+        PreambleCache &preambleCache = Server::instance()->preambleCache();
+        PreambleCache::Preamble preamble;
+        if (preambleCache.isEnabled()
+            && preambleCache.find(mPath, contents, mArgs, preamble)) {
+            List<String> args = mArgs;
+            args << "-include-pch" << preamble.pch;
+            RTags::parseTranslationUnit(mPath, args, mUnit, mIndex, clangLine,
+                                        0, 0, &unsavedFile, 1);
+            if (!mUnit)
+                preambleCache.remove(preamble.key);
+        }
+        if (!mUnit) {
+            RTags::parseTranslationUnit(mPath, mArgs, mUnit, mIndex, clangLine,
+                                        0, 0, &unsavedFile, 1);
+        }
         mParseCount = 1;
         if (!mUnit) {
             clang_disposeIndex(mIndex);
             mIndex = 0;
             error() << "Failed to parse" << mPath << "Can't complete";
+            mFinished(mPath);
             return;
         }
     }
@@ -162,6 +277,7 @@ void CompletionJob::execute()
         RTags::reparseTranslationUnit(mUnit, &unsavedFile, 1);
         if (!mUnit) {
             clang_disposeIndex(mIndex);
+            mIndex = 0;
             mFinished(mPath);
             return;
         } else {
@@ -169,21 +285,28 @@ void CompletionJob::execute()
         }
     }
 
+    if (isAborted()) {
+        finish();
+        return;
+    }
+
     CXCodeCompleteResults *results = clang_codeCompleteAt(mUnit, mPath.constData(), mLine, mColumn,
                                                           &unsavedFile, mUnsaved.isEmpty() ? 0 : 1,
                                                           CXCodeComplete_IncludeMacros
                                                           | CXCodeComplete_IncludeCodePatterns);
+    if (results && isAborted()) {
+        clang_disposeCodeCompleteResults(results);
+        results = 0;
+    }
     if (results) {
-        CompletionNode *nodes = new CompletionNode[results->NumResults];
+        List<CompletionNode> nodes(results->NumResults);
         int nodeCount = 0;
-        Map<Token, int> tokens;
-        if (!mUnsaved.isEmpty()) {
-            tokenize(mUnsaved.constData(), mUnsaved.size(), tokens);
-            // for (Map<Token, int>::const_iterator it = tokens.begin(); it != tokens.end(); ++it) {
-            //     error() << String(it->first.data, it->first.length) << it->second;
-            // }
-        }
+        bool aborted = false;
         for (unsigned i = 0; i < results->NumResults; ++i) {
+            if (!(i % 256) && i && isAborted()) {
+                aborted = true;
+                break;
+            }
             const CXCursorKind kind = results->Results[i].CursorKind;
             if (kind == CXCursor_Destructor)
                 continue;
@@ -199,22 +322,16 @@ void CompletionJob::execute()
 
             CompletionNode &node = nodes[nodeCount];
             node.priority = priority;
-            node.signature.reserve(256);
+            node.result = i;
             const int chunkCount = clang_getNumCompletionChunks(string);
-            bool ok = true;
+            bool ok = false;
             for (int j=0; j<chunkCount; ++j) {
-                const CXCompletionChunkKind chunkKind = clang_getCompletionChunkKind(string, j);
-                if (chunkKind == CXCompletionChunk_TypedText) {
+                if (clang_getCompletionChunkKind(string, j) == CXCompletionChunk_TypedText) {
                     node.completion = RTags::eatString(clang_getCompletionChunkText(string, j));
-                    if (node.completion.size() > 8 && node.completion.startsWith("operator") && !isPartOfSymbol(node.completion.at(8))) {
-                        ok = false;
-                        break;
-                    }
-                    node.signature.append(node.completion);
-                } else {
-                    node.signature.append(RTags::eatString(clang_getCompletionChunkText(string, j)));
-                    if (chunkKind == CXCompletionChunk_ResultType)
-                        node.signature.append(' ');
+                    ok = (!mFilterPrefix || node.completion.startsWith(prefix))
+                         && !(node.completion.size() > 8 && node.completion.startsWith("operator")
+                              && !isPartOfSymbol(node.completion.at(8)));
+                    break;
                 }
             }
 
@@ -224,55 +341,58 @@ void CompletionJob::execute()
                     --ws;
                 if (ws >= 0) {
                     node.completion.truncate(ws + 1);
-                    node.signature.replace("\n", "");
-                    node.distance = tokens.value(Token(node.completion.constData(), node.completion.size()), -1);
+                    node.distance = -1;
                     ++nodeCount;
                     continue;
                 }
             }
             node.completion.clear();
-            node.signature.clear();
         }
-        if (nodeCount) {
-            qsort(nodes, nodeCount, sizeof(CompletionNode), compareCompletionNode);
-            if (mType == Stream) {
-                write<128>("`%s %s", nodes[0].completion.constData(), nodes[0].signature.constData());
-            } else {
-                write<128>("%s %s", nodes[0].completion.constData(), nodes[0].signature.constData());
-            }
-            for (int i=1; i<nodeCount; ++i) {
-                write<128>("%s %s", nodes[i].completion.constData(), nodes[i].signature.constData());
-            }
+        nodes.resize(nodeCount);
+        if (aborted) {
+            nodeCount = 0;
+            nodes.clear();
         }
-
-        warning() << "Wrote" << nodeCount << "completions for"
-                  << String::format<128>("%s:%d:%d", mPath.constData(), mLine, mColumn)
-                  << "in" << timer.elapsed() << "ms" << mArgs;
-        // const unsigned diagnosticCount = clang_getNumDiagnostics(mUnit);
-        // for (unsigned i=0; i<diagnosticCount; ++i) {
-        //     CXDiagnostic diagnostic = clang_getDiagnostic(mUnit, i);
-        //     const CXDiagnosticSeverity severity = clang_getDiagnosticSeverity(diagnostic);
-        //     const String msg = RTags::eatString(clang_getDiagnosticSpelling(diagnostic));
-        //     CXFile file;
-        //     unsigned line, col;
-        //     clang_getSpellingLocation(clang_getDiagnosticLocation(diagnostic), &file, &line, &col, 0);
-
-        //     error() << i << diagnosticCount << severity << msg
-        //             << String::format<128>("%s:%d:%d", RTags::eatString(clang_getFileName(file)).constData(),
-        //                                    line, col);
-        //     clang_disposeDiagnostic(diagnostic);
-        // }
-
-        delete[] nodes;
+        if (nodeCount && context) {
+            MutexLocker lock(&sCacheMutex);
+            TokenIndex &tokens = sCache[mPath].tokens;
+            tokens.update(contents);
+            for (int i=0; i<nodeCount; ++i)
+                nodes[i].distance = tokens.distance(nodes.at(i).completion, cursor, start);
+        }
+        std::sort(nodes.begin(), nodes.end(), compareCompletionNode);
 
         //processDiagnostics(results);
 
-        clang_disposeCodeCompleteResults(results);
-        shared_ptr<Project> proj = project();
-        if (proj) {
-            // error() << "Adding to cache" << mParseCount << mPath;
-            proj->addToCache(mPath, mArgs, mIndex, mUnit, mParseCount);
+        shared_ptr<CXCodeCompleteResults> owner(results, clang_disposeCodeCompleteResults);
+        List<CompletionNode> range;
+        if (context && !aborted) {
+            MutexLocker lock(&sCacheMutex);
+            CompletionCacheEntry &entry = sCache[mPath];
+            entry.context = context;
+            entry.prefix = mFilterPrefix ? prefix : String();
+            entry.nodes.swap(nodes);
+            entry.results = owner;
+            entry.lastUsed = ++sCacheCounter;
+            range = completionRange(entry.nodes, results, mOffset, mMax);
+            while (sCache.size() > std::max(1, Server::instance()->options().completionCacheSize)) {
+                Map<Path, CompletionCacheEntry>::iterator oldest = sCache.begin();
+                for (Map<Path, CompletionCacheEntry>::iterator it = sCache.begin(); it != sCache.end(); ++it) {
+                    if (it->second.lastUsed < oldest->second.lastUsed)
+                        oldest = it;
+                }
+                sCache.erase(oldest);
+            }
+        } else if (!aborted) {
+            range = completionRange(nodes, results, mOffset, mMax);
         }
+        // stale results aren't written but still cached for the newer request
+        if (!isAborted())
+            writeNodes(range);
+
+        warning() << (aborted || isAborted() ? "Dropped" : "Wrote") << range.size() << "of" << nodeCount
+                  << "completions for" << String::format<128>("%s:%d:%d", mPath.constData(), mLine, mColumn)
+                  << "in" << timer.elapsed() << "ms" << mArgs;
     }
-    mFinished(mPath);
+    finish();
 }
@@ -8,6 +8,7 @@
 #include <rct/Event.h>
 #include <clang-c/Index.h>
 
+struct CompletionNode;
 class CompletionJob : public Job
 {
 public:
@@ -19,18 +20,29 @@ public:
     void init(CXIndex index, CXTranslationUnit unit, const Path &path, const List<String> &args,
               int line, int column, int pos, const String &unsaved, int parseCount);
 
+    // Only write the completions ranked offset to offset + max, max -1 for all
+    void setRange(int offset, int max) { mOffset = offset; mMax = max; }
+    // Only write completions that start with the identifier typed so far
+    void setFilterPrefix(bool filter) { mFilterPrefix = filter; }
+
     virtual void execute();
+    // Drops the results cached for path, its context doesn't cover the
+    // headers it includes
+    static void clearCache(const Path &path);
     signalslot::Signal1<Path> &finished() { return mFinished; }
     Type type() const { return mType; }
 private:
     void processDiagnostics(CXCodeCompleteResults* results);
+    void writeNodes(const List<CompletionNode> &nodes);
+    void finish();
 
 private:
     CXIndex mIndex;
     CXTranslationUnit mUnit;
     Path mPath;
     List<String> mArgs;
-    int mLine, mColumn, mPos, mParseCount;
+    int mLine, mColumn, mPos, mParseCount, mOffset, mMax;
+    bool mFilterPrefix;
     String mUnsaved;
     signalslot::Signal1<Path> mFinished;
     const Type mType;
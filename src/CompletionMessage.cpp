@@ -4,16 +4,17 @@
 
 
 CompletionMessage::CompletionMessage(unsigned flags, const Path &path, int line, int column, int pos)
-    : ClientMessage(MessageId), mFlags(flags), mPath(path), mLine(line), mColumn(column), mPos(pos)
+    : ClientMessage(MessageId), mFlags(flags), mPath(path), mLine(line), mColumn(column), mPos(pos),
+      mOffset(0), mMax(-1)
 {
 }
 
 void CompletionMessage::encode(Serializer &serializer) const
 {
-    serializer << mRaw << mFlags << mPath << mLine << mColumn << mPos << mContents << mProjects;
+    serializer << mRaw << mFlags << mPath << mLine << mColumn << mPos << mOffset << mMax << mContents << mProjects;
 }
 
 void CompletionMessage::decode(Deserializer &deserializer)
 {
-    deserializer >> mRaw >> mFlags >> mPath >> mLine >> mColumn >> mPos >> mContents >> mProjects;
+    deserializer >> mRaw >> mFlags >> mPath >> mLine >> mColumn >> mPos >> mOffset >> mMax >> mContents >> mProjects;
 }
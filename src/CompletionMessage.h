@@ -12,7 +12,9 @@ public:
 
     enum Flag {
         None = 0x0,
-        Stream = 0x1
+        Stream = 0x1,
+        WarmUp = 0x2, // only get a unit ready for completing in path
+        FilterPrefix = 0x4 // only completions that start with the identifier typed so far
     };
 
     CompletionMessage(unsigned flags = 0, const Path &path = Path(), int line = -1, int column = -1, int pos = -1);
@@ -22,6 +24,11 @@ public:
     int column() const { return mColumn; }
     int pos() const { return mPos; }
 
+    // Only the completions ranked offset to offset + max, max -1 for all of them
+    void setRange(int offset, int max) { mOffset = offset; mMax = max; }
+    int offset() const { return mOffset; }
+    int max() const { return mMax; }
+
     void setContents(const String &contents) { mContents = contents; }
     String contents() const { return mContents; }
 
@@ -33,7 +40,7 @@ public:
 private:
     unsigned mFlags;
     Path mPath;
-    int mLine, mColumn, mPos;
+    int mLine, mColumn, mPos, mOffset, mMax;
     String mContents;
     List<String> mProjects;
 };
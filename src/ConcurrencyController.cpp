@@ -0,0 +1,120 @@
+#include "ConcurrencyController.h"
+#include <rct/Log.h>
+#include <rct/MemoryMonitor.h>
+#include <rct/Rct.h>
+#include <algorithm>
+
+enum { MaxDecisions = 20 };
+
+ConcurrencyController::ConcurrencyController()
+    : mLimit(0), mMaxJobs(0), mRunning(0), mWaiting(0), mBudget(0), mExternal(false), mJobEstimate(0), mMemory(0)
+{
+}
+
+void ConcurrencyController::init(int limit, int maxJobs, int64_t budget, bool external)
+{
+    MutexLocker lock(&mMutex);
+    mMaxJobs = maxJobs;
+    mLimit = std::min(limit, maxJobs);
+    mBudget = budget;
+    mExternal = external;
+}
+
+void ConcurrencyController::setJobs(int limit, int maxJobs)
+{
+    MutexLocker lock(&mMutex);
+    mMaxJobs = maxJobs;
+    setLimit(std::min(limit, maxJobs), "job count changed");
+}
+
+bool ConcurrencyController::tryAcquire(int waiting)
+{
+    MutexLocker lock(&mMutex);
+    // Always let one job run, if we're over budget with nothing running the
+    // memory isn't theirs
+    if (mRunning && mRunning >= mLimit) {
+        mWaiting = waiting;
+        return false;
+    }
+    mWaiting = waiting - 1;
+    ++mRunning;
+    return true;
+}
+
+void ConcurrencyController::release(uint64_t memory, uint64_t peak)
+{
+    if (!peak) {
+        // Other jobs grow at the same time so this errs on the high side
+        const uint64_t now = MemoryMonitor::usage();
+        peak = now > memory ? now - memory : 0;
+    }
+    MutexLocker lock(&mMutex);
+    --mRunning;
+    mJobEstimate = mJobEstimate ? (mJobEstimate * 3 + peak) / 4 : peak;
+}
+
+uint64_t ConcurrencyController::memoryUsage() const
+{
+    uint64_t ret = MemoryMonitor::usage();
+    if (mExternal)
+        ret += mRunning * mJobEstimate;
+    return ret;
+}
+
+void ConcurrencyController::sample()
+{
+    MutexLocker lock(&mMutex);
+    if (!mBudget)
+        return;
+    mMemory = memoryUsage();
+    const int64_t available = mBudget - static_cast<int64_t>(mMemory);
+    if (available <= 0) {
+        // Let the running jobs finish, nothing else starts until we're
+        // under budget
+        const int limit = mRunning ? mRunning - 1 : 1;
+        if (limit < mLimit) {
+            setLimit(limit, String::format<128>("%.0fmb over budget with %d jobs running",
+                                                -available / (1024.0 * 1024.0), mRunning));
+        }
+        return;
+    }
+    int room = mMaxJobs;
+    if (mJobEstimate)
+        room = mRunning + static_cast<int>(available / static_cast<int64_t>(mJobEstimate));
+    if (room < mLimit) {
+        setLimit(std::max(room, 1), String::format<128>("%.0fmb left, jobs use about %.0fmb",
+                                                        available / (1024.0 * 1024.0),
+                                                        mJobEstimate / (1024.0 * 1024.0)));
+    } else if (room > mLimit && mLimit < mMaxJobs && mWaiting) {
+        setLimit(mLimit + 1, String::format<128>("%.0fmb left, jobs use about %.0fmb",
+                                                 available / (1024.0 * 1024.0),
+                                                 mJobEstimate / (1024.0 * 1024.0)));
+    }
+}
+
+void ConcurrencyController::setLimit(int limit, const String &reason)
+{
+    if (limit == mLimit)
+        return;
+    warning("Indexing with %d jobs: %s", limit, reason.constData());
+    const Decision decision = { Rct::monoMs(), limit, reason };
+    mDecisions.append(decision);
+    if (mDecisions.size() > MaxDecisions)
+        mDecisions.erase(mDecisions.begin());
+    mLimit = limit;
+}
+
+ConcurrencyController::Stats ConcurrencyController::stats() const
+{
+    MutexLocker lock(&mMutex);
+    Stats ret;
+    ret.limit = mLimit;
+    ret.maxJobs = mMaxJobs;
+    ret.running = mRunning;
+    ret.waiting = mWaiting;
+    ret.memory = mMemory;
+    ret.budget = mBudget;
+    ret.jobEstimate = mJobEstimate;
+    ret.decisions = mDecisions;
+    return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef ConcurrencyController_h
+#define ConcurrencyController_h
+
+#include <rct/List.h>
+#include <rct/Mutex.h>
+#include <rct/String.h>
+#include <stdint.h>
+
+// Decides how many indexer jobs may run at once so rdm stays within a memory
+// budget. The server holds on to indexer jobs until tryAcquire() lets them
+// into the thread pool, which is sized for the hardware. sample() is called
+// periodically and moves the limit down right away when we're over budget and
+// up one job at a time, as far as maxJobs, when there's room for another job
+// of the estimated size
+class ConcurrencyController
+{
+public:
+    ConcurrencyController();
+
+    // external means the jobs' memory isn't in our RSS, i.e. rdm --worker processes
+    void init(int limit, int maxJobs, int64_t budget, bool external);
+    bool isEnabled() const { return mBudget > 0; }
+    void setJobs(int limit, int maxJobs);
+
+    // Never blocks. waiting is the number of jobs held back, this one
+    // included. A job that got in calls release() when it's done, memory
+    // being our RSS when it started
+    bool tryAcquire(int waiting);
+    // peak is the memory the job reported using, 0 to measure it here
+    void release(uint64_t memory, uint64_t peak);
+    void sample();
+
+    struct Decision
+    {
+        uint64_t time;
+        int limit;
+        String reason;
+    };
+    struct Stats
+    {
+        Stats() : limit(0), maxJobs(0), running(0), waiting(0), memory(0), budget(0), jobEstimate(0) {}
+        int limit, maxJobs, running, waiting;
+        uint64_t memory, budget, jobEstimate;
+        List<Decision> decisions;
+    };
+    Stats stats() const;
+private:
+    uint64_t memoryUsage() const; // lock always held
+    void setLimit(int limit, const String &reason); // lock always held
+
+    int mLimit, mMaxJobs, mRunning, mWaiting;
+    int64_t mBudget;
+    bool mExternal;
+    uint64_t mJobEstimate, mMemory;
+    List<Decision> mDecisions;
+    mutable Mutex mMutex;
+};
+
+#endif
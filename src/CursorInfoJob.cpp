@@ -25,6 +25,12 @@ void CursorInfoJob::execute()
     if (it != map.end()) {
         write(it->first);
         write(it->second, ciFlags);
+        // see Server::DeclarationsFirst, references are missing until the full pass
+        if (project()->isDeclarationsOnly(location.fileId())) {
+            write("Index: declarations only");
+        } else if (const int pending = project()->secondPassCount()) {
+            write<64>("Index: full, %d files waiting for references", pending);
+        }
     } else {
         it = map.lower_bound(location);
         if (it == map.end())
@@ -3,6 +3,7 @@
 #include "Server.h"
 #include "Filter.h"
 #include "Project.h"
+#include <rct/Rct.h>
 
 FileManager::FileManager()
     : mLastReloadTime(0)
@@ -14,112 +15,286 @@ FileManager::FileManager()
 void FileManager::init(const shared_ptr<Project> &proj)
 {
     mProject = proj;
-    reload();
 }
 
-void FileManager::reload()
+void FileManager::reload(ReloadMode mode)
 {
+    shared_ptr<Project> project = mProject.lock();
+    assert(project);
     mLastReloadTime = Rct::monoMs();
+    DirectoryMap known;
+    if (mode == Incremental) {
+        MutexLocker lock(&mMutex);
+        known = mDirectories;
+    }
+    scan(project->path(), known);
+}
+
+void FileManager::restore(const DirectoryMap &directories)
+{
+    MutexLocker lock(&mMutex);
+    mDirectories = directories;
+    mPathIndex.clear();
     shared_ptr<Project> project = mProject.lock();
     assert(project);
-    shared_ptr<ScanJob> job(new ScanJob(project->path()));
-    job->finished().connectAsync(this, &FileManager::onRecurseJobFinished);
+    const FilesMap &map = project->files();
+    for (FilesMap::const_iterator it = map.begin(); it != map.end(); ++it)
+        updateIndex(project->path(), it->first, Set<String>(), it->second);
+}
+
+// Files under dir are indexed relative to the project root
+void FileManager::updateIndex(const Path &root, const Path &dir, const Set<String> &old, const Set<String> &files)
+{
+    if (!dir.startsWith(root))
+        return;
+    const String relative(dir.constData() + root.size(), dir.size() - root.size());
+    Set<String>::const_iterator o = old.begin();
+    Set<String>::const_iterator f = files.begin();
+    while (o != old.end() || f != files.end()) {
+        if (f == files.end() || (o != old.end() && *o < *f)) {
+            mPathIndex.remove(relative + *o++);
+        } else if (o == old.end() || *f < *o) {
+            mPathIndex.insert(relative + *f++);
+        } else {
+            ++o;
+            ++f;
+        }
+    }
+}
+
+DirectoryMap FileManager::directories() const
+{
+    MutexLocker lock(&mMutex);
+    return mDirectories;
+}
+
+// The scan state is only touched on the main thread, call without mMutex held
+void FileManager::scan(const Path &path, const DirectoryMap &known)
+{
+    shared_ptr<ScanJob> job(new ScanJob(path, known));
+    ++mScans[job->path()].count;
+    job->batch().connectAsync(this, &FileManager::onScanBatch);
+    job->finished().connectAsync(this, &FileManager::onScanFinished);
     Server::instance()->threadPool()->start(job);
 }
 
-void FileManager::onRecurseJobFinished(Set<Path> paths)
+void FileManager::onScanBatch(ScanBatch batch)
+{
+    MutexLocker lock(&mMutex);
+    shared_ptr<Project> project = mProject.lock();
+    if (!project)
+        return;
+    for (DirectoryMap::const_iterator it = batch.directories.begin(); it != batch.directories.end(); ++it) {
+        assert(!it->first.isEmpty());
+        if (isRemoved(project->path(), it->first))
+            continue;
+        // a scan of a parent may have read it before it was created
+        for (Map<Path, Scan>::iterator scan = mScans.begin(); scan != mScans.end(); ++scan) {
+            if (it->first.startsWith(scan->first))
+                scan->second.seen.insert(it->first);
+        }
+        // read before a change we heard about, read it again next time
+        mDirectories[it->first] = mChanges.contains(it->first) ? 0 : it->second;
+        watch(it->first);
+    }
+    FilesMap &map = project->files();
+    for (FilesMap::iterator it = batch.files.begin(); it != batch.files.end(); ++it) {
+        if (isRemoved(project->path(), it->first))
+            continue;
+        const Map<Path, Map<String, bool> >::const_iterator changes = mChanges.find(it->first);
+        if (changes != mChanges.end()) {
+            for (Map<String, bool>::const_iterator c = changes->second.begin(); c != changes->second.end(); ++c) {
+                if (c->second) {
+                    it->second.insert(c->first);
+                } else {
+                    it->second.remove(c->first);
+                }
+            }
+        }
+        updateIndex(project->path(), it->first, map.value(it->first), it->second);
+        if (it->second.isEmpty()) {
+            map.remove(it->first);
+        } else {
+            std::swap(map[it->first], it->second);
+        }
+    }
+}
+
+void FileManager::onScanFinished(Path path)
 {
     bool emitJS = false;
     {
-        MutexLocker lock(&mMutex); // ### is this needed now?
-        Set<Path> old;
-        std::swap(mJSFiles, old);
-
+        MutexLocker lock(&mMutex);
+        Map<Path, Scan>::iterator scan = mScans.find(path);
+        if (scan == mScans.end() || --scan->second.count)
+            return;
+        sweep(path, scan->second.seen);
+        mScans.erase(scan);
+        if (mScans.isEmpty()) {
+            mChanges.clear();
+            mDirectoryChanges.clear();
+        }
         shared_ptr<Project> project = mProject.lock();
-        assert(project);
-        FilesMap &map = project->files();
-        map.clear();
-        mWatcher.clear();
-        for (Set<Path>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
-            if (it->endsWith(".js"))
-                mJSFiles.insert(*it);
-            const Path parent = it->parentDir();
-            if (parent.isEmpty()) {
-                error() << "Got empty parent here" << *it;
-                continue;
+        if (!project)
+            return;
+        const FilesMap &map = project->files();
+        Set<Path> jsFiles;
+        for (FilesMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+            for (Set<String>::const_iterator file = it->second.begin(); file != it->second.end(); ++file) {
+                if (file->endsWith(".js"))
+                    jsFiles.insert(it->first + *file);
             }
-            assert(!parent.isEmpty());
-            Set<String> &dir = map[parent];
-            if (dir.isEmpty())
-                watch(parent);
-            dir.insert(it->fileName());
         }
         assert(!map.contains(""));
-        emitJS = old != mJSFiles;
+        emitJS = jsFiles != mJSFiles;
+        std::swap(mJSFiles, jsFiles);
+        debug() << "Scanned" << path << "with" << map.size() << "directories";
     }
     if (emitJS)
         mJSFilesChanged();
 }
 
+// Drops the directories under root that a scan of root didn't see
+void FileManager::sweep(const Path &root, const Set<Path> &seen)
+{
+    DirectoryMap::iterator it = mDirectories.lower_bound(root);
+    while (it != mDirectories.end() && it->first.startsWith(root)) {
+        if (seen.contains(it->first)) {
+            ++it;
+        } else {
+            if (mWatchedDirs.contains(it->first)) {
+                mWatchedDirs.remove(it->first);
+                mWatcher.unwatch(it->first);
+            }
+            mDirectories.erase(it++);
+        }
+    }
+    shared_ptr<Project> project = mProject.lock();
+    if (!project)
+        return;
+    FilesMap &map = project->files();
+    FilesMap::iterator dir = map.lower_bound(root);
+    while (dir != map.end() && dir->first.startsWith(root)) {
+        if (mDirectories.contains(dir->first)) {
+            ++dir;
+        } else {
+            updateIndex(project->path(), dir->first, dir->second, Set<String>());
+            map.erase(dir++);
+        }
+    }
+}
+
 void FileManager::onFileAdded(const Path &path)
 {
-    bool emitJS = false;
+    bool emitJS = false, directory = false;
     {
         MutexLocker lock(&mMutex);
         if (path.isEmpty()) {
             error("Got empty file added here");
             return;
         }
-        const Filter::Result res = Filter::filter(path);
-        switch (res) {
-        case Filter::Directory:
-            reload();
-            return;
-        case Filter::Filtered:
+        const Path parent = path.parentDir();
+        if (parent.isEmpty()) {
+            error() << "Got empty parent here" << path;
             return;
-        default:
-            break;
         }
-
-        shared_ptr<Project> project = mProject.lock();
-        assert(project);
-        FilesMap &map = project->files();
-        const Path parent = path.parentDir();
-        if (!parent.isEmpty()) {
-            Set<String> &dir = map[parent];
-            if (dir.isEmpty())
-                watch(parent);
-            dir.insert(path.fileName());
-            emitJS = path.endsWith(".js");
+        const Filter::Result res = Filter::filter(path);
+        if (res == Filter::Filtered)
+            return;
+        // the snapshot's mtime for the parent is stale now
+        DirectoryMap::iterator it = mDirectories.find(parent);
+        if (it != mDirectories.end())
+            it->second = 0;
+        if (res == Filter::Directory) {
+            directory = true;
+            recordChange(path, true, true);
         } else {
-            error() << "Got empty parent here" << path;
+            recordChange(path, true, false);
+            shared_ptr<Project> project = mProject.lock();
+            assert(project);
+            FilesMap &map = project->files();
+            Set<String> &files = map[parent];
+            const String fileName = path.fileName();
+            if (files.insert(fileName)) {
+                Set<String> added;
+                added.insert(fileName);
+                updateIndex(project->path(), parent, Set<String>(), added);
+            }
+            emitJS = path.endsWith(".js");
+            assert(!map.contains(Path()));
         }
-        assert(!map.contains(Path()));
     }
     if (emitJS)
         mJSFilesChanged();
+    if (directory)
+        scan(path, DirectoryMap());
 }
 
 void FileManager::onFileRemoved(const Path &path)
 {
     MutexLocker lock(&mMutex);
     shared_ptr<Project> project = mProject.lock();
-    FilesMap &map = project->files();
-    if (map.contains(path)) {
-        reload();
+    if (!project)
+        return;
+    Path dir = path;
+    if (!dir.endsWith('/'))
+        dir.append('/');
+    if (mDirectories.contains(dir)) {
+        recordChange(dir, false, true);
+        sweep(dir, Set<Path>());
         return;
     }
+    recordChange(path, false, false);
+    FilesMap &map = project->files();
     const Path parent = path.parentDir();
-    if (map.contains(parent)) {
-        Set<String> &dir = map[parent];
-        dir.remove(path.fileName());
-        if (dir.isEmpty()) {
-            mWatcher.unwatch(parent);
-            map.remove(parent);
+    DirectoryMap::iterator it = mDirectories.find(parent);
+    if (it != mDirectories.end())
+        it->second = 0;
+    FilesMap::iterator files = map.find(parent);
+    if (files != map.end()) {
+        const String fileName = path.fileName();
+        if (files->second.contains(fileName)) {
+            files->second.remove(fileName);
+            Set<String> removed;
+            removed.insert(fileName);
+            updateIndex(project->path(), parent, removed, Set<String>());
         }
+        if (files->second.isEmpty())
+            map.erase(files);
     }
 }
 
+// Only needed while something is scanning, lock always held
+void FileManager::recordChange(const Path &path, bool exists, bool directory)
+{
+    if (mScans.isEmpty())
+        return;
+    if (directory) {
+        Path dir = path;
+        if (!dir.endsWith('/'))
+            dir.append('/');
+        mDirectoryChanges[dir] = exists;
+    } else {
+        mChanges[path.parentDir()][path.fileName()] = exists;
+    }
+}
+
+// Whether dir or the closest directory above it that changed was removed
+bool FileManager::isRemoved(const Path &root, Path dir) const // lock always held
+{
+    if (mDirectoryChanges.isEmpty())
+        return false;
+    while (dir.size() >= root.size()) {
+        const Map<Path, bool>::const_iterator it = mDirectoryChanges.find(dir);
+        if (it != mDirectoryChanges.end())
+            return !it->second;
+        if (dir.size() == root.size())
+            break;
+        dir = dir.parentDir();
+    }
+    return false;
+}
+
 static inline bool startsWith(const Path &left, const Path &right)
 {
     assert(!left.isEmpty());
@@ -148,7 +323,8 @@ Set<Path> FileManager::jsFiles() const
 void FileManager::watch(const Path &path)
 {
     if (!(Server::instance()->options().options & Server::NoFileManagerWatch)
-        && !path.contains("/.git/") && !path.contains("/.svn/") && !path.contains("/.cvs/")) {
+        && !path.contains("/.git/") && !path.contains("/.svn/") && !path.contains("/.cvs/")
+        && mWatchedDirs.insert(path)) {
         mWatcher.watch(path);
     }
 }
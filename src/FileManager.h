@@ -7,6 +7,9 @@
 #include <rct/Mutex.h>
 #include <rct/EventReceiver.h>
 #include "Location.h"
+#include "PathIndex.h"
+#include "RTags.h"
+#include "ScanJob.h"
 
 class Project;
 class FileManager : public EventReceiver
@@ -14,23 +17,55 @@ class FileManager : public EventReceiver
 public:
     FileManager();
     void init(const shared_ptr<Project> &proj);
-    void reload();
+    enum ReloadMode {
+        Incremental, // only rescan directories whose mtime changed
+        Full
+    };
+    void reload(ReloadMode mode = Incremental);
+    // mtimes of the directories in files(), saved with the project
+    void restore(const DirectoryMap &directories);
+    DirectoryMap directories() const;
     uint64_t lastReloadTime() const { return mLastReloadTime; }
+    const PathIndex &pathIndex() const { return mPathIndex; }
     void onFileAdded(const Path &path);
     void onFileRemoved(const Path &path);
-    void onRecurseJobFinished(Set<Path> mPaths);
+    void onScanBatch(ScanBatch batch);
+    void onScanFinished(Path path);
     bool contains(const Path &path) const;
-    void clearFileSystemWatcher() { mWatcher.clear(); }
+    void clearFileSystemWatcher() { mWatcher.clear(); mWatchedDirs.clear(); }
     Set<Path> watchedPaths() const { return mWatcher.watchedPaths(); }
     Set<Path> jsFiles() const;
     signalslot::Signal0 &jsFilesChanged() { return mJSFilesChanged; }
 private:
     void watch(const Path &path);
+    void scan(const Path &path, const DirectoryMap &known);
+    void sweep(const Path &root, const Set<Path> &seen);
+    void updateIndex(const Path &root, const Path &dir, const Set<String> &old, const Set<String> &files);
+    void recordChange(const Path &path, bool exists, bool directory);
+    bool isRemoved(const Path &root, Path dir) const;
     FileSystemWatcher mWatcher;
     weak_ptr<Project> mProject;
     signalslot::Signal0 mJSFilesChanged;
     Set<Path> mJSFiles;
+    DirectoryMap mDirectories;
+    Set<Path> mWatchedDirs;
+    PathIndex mPathIndex;
     uint64_t mLastReloadTime;
+    struct Scan
+    {
+        Scan() : count(0) {}
+        int count;
+        // directories under the root that are still there, by this scan or
+        // any other one that ran meanwhile. The others are dropped when the
+        // last scan of the root finishes
+        Set<Path> seen;
+    };
+    Map<Path, Scan> mScans;
+    // What the watcher reported while scans were running. A batch can hold
+    // a directory that was read before that, these are applied over it.
+    // directory -> file name -> exists, and directory -> exists
+    Map<Path, Map<String, bool> > mChanges;
+    Map<Path, bool> mDirectoryChanges;
     mutable Mutex mMutex;
 };
 
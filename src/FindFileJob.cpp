@@ -5,6 +5,15 @@
 #include "FileManager.h"
 #include "Project.h"
 
+static inline bool startsWith(const String &str, const String &prefix, String::CaseSensitivity cs)
+{
+    if (str.size() < prefix.size())
+        return false;
+    if (cs == String::CaseInsensitive)
+        return !strncasecmp(str.constData(), prefix.constData(), prefix.size());
+    return !strncmp(str.constData(), prefix.constData(), prefix.size());
+}
+
 FindFileJob::FindFileJob(const QueryMessage &query, const shared_ptr<Project> &project)
     : Job(query, WriteBuffered|QuietJob, project)
 {
@@ -46,15 +55,51 @@ void FindFileJob::execute()
         out.append(srcRoot);
         assert(srcRoot.endsWith('/'));
     }
+    const bool preferExact = queryFlags() & QueryMessage::FindFilePreferExact;
+    if (mode == Pattern) {
+        // the trigram index only has to verify the paths that contain all
+        // of the pattern's trigrams
+        unsigned flags = PathIndex::None;
+        if (cs == String::CaseInsensitive)
+            flags |= PathIndex::CaseInsensitive;
+        String pattern = mPattern;
+        bool anchored = false;
+        if (queryFlags() & QueryMessage::AbsolutePath) {
+            // the index only has paths relative to srcRoot while the walk
+            // matches srcRoot + path. Patterns that start with srcRoot match
+            // at the start of the relative path, anything else
+            // may match across srcRoot and needs the walk
+            if (pattern.size() > srcRoot.size() && startsWith(pattern, srcRoot, cs)) {
+                pattern = pattern.mid(srcRoot.size());
+                anchored = true;
+            } else {
+                pattern.clear();
+            }
+        }
+        if (preferExact && !anchored) // an anchored pattern is never a file name
+            flags |= PathIndex::PreferExact;
+        List<String> paths;
+        if (!pattern.isEmpty() && proj->fileManager->pathIndex().find(pattern, flags, paths)) {
+            for (List<String>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+                if (anchored && !startsWith(*it, pattern, cs))
+                    continue;
+                out.append(*it);
+                if (!write(out))
+                    return;
+                out.chop(it->size());
+            }
+            return;
+        }
+    }
     const FilesMap& dirs = proj->files();
     FilesMap::const_iterator dirit = dirs.begin();
     bool foundExact = false;
     const int patternSize = mPattern.size();
     List<String> matches;
-    const bool preferExact = queryFlags() & QueryMessage::FindFilePreferExact;
     while (dirit != dirs.end()) {
         const Path &dir = dirit->first;
         if (dir.size() < srcRoot.size()) {
+            ++dirit;
             continue;
         } else {
             out.append(dir.constData() + srcRoot.size(), dir.size() - srcRoot.size());
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <rct/String.h>
+#include <rct/Serializer.h>
 
 struct FixIt
 {
@@ -23,4 +24,16 @@ struct FixIt
     String text;
 };
 
+template <> inline Serializer &operator<<(Serializer &s, const FixIt &f)
+{
+    s << f.start << f.end << f.text;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, FixIt &f)
+{
+    s >> f.start >> f.end >> f.text;
+    return s;
+}
+
 #endif
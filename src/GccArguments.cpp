@@ -1,5 +1,6 @@
 #include "GccArguments.h"
 #include <rct/Log.h>
+#include <rct/Mutex.h>
 #include "RTags.h"
 #include <rct/Process.h>
 #include "Server.h"
@@ -87,7 +88,53 @@ static inline String trim(const char *start, int size)
     return String(start, size);
 }
 
+// Builds send the same lines for the same files every time so successful
+// parses are kept around, least recently used ones go first
+enum { ParseCacheSize = 1024 };
+struct ParseCacheEntry
+{
+    String args;
+    Path base;
+    GccArguments result;
+    uint64_t lastUsed;
+};
+static Mutex sParseCacheMutex;
+static Map<uint64_t, ParseCacheEntry> sParseCache;
+static uint64_t sParseCacheCounter = 0;
+
 bool GccArguments::parse(String args, const Path &base)
+{
+    const uint64_t key = RTags::hash(args, RTags::hash(base));
+    {
+        MutexLocker lock(&sParseCacheMutex);
+        Map<uint64_t, ParseCacheEntry>::iterator it = sParseCache.find(key);
+        if (it != sParseCache.end() && it->second.args == args && it->second.base == base) {
+            it->second.lastUsed = ++sParseCacheCounter;
+            *this = it->second.result;
+            return true;
+        }
+    }
+    if (!parseArgs(args, base))
+        return false;
+
+    MutexLocker lock(&sParseCacheMutex);
+    if (sParseCache.size() >= ParseCacheSize && !sParseCache.contains(key)) {
+        Map<uint64_t, ParseCacheEntry>::iterator oldest = sParseCache.begin();
+        for (Map<uint64_t, ParseCacheEntry>::iterator it = sParseCache.begin(); it != sParseCache.end(); ++it) {
+            if (it->second.lastUsed < oldest->second.lastUsed)
+                oldest = it;
+        }
+        sParseCache.erase(oldest);
+    }
+    ParseCacheEntry &entry = sParseCache[key];
+    entry.args = args;
+    entry.base = base;
+    entry.result = *this;
+    entry.lastUsed = ++sParseCacheCounter;
+    return true;
+}
+
+bool GccArguments::parseArgs(String args, const Path &base)
 {
     mLang = NoLang;
     mClangArgs.clear();
@@ -241,6 +288,9 @@ bool GccArguments::parse(String args, const Path &base)
         return false;
     }
 
+    // compile commands are parsed on several threads
+    static Mutex mutex;
+    MutexLocker lock(&mutex);
     static Map<Path, Path> resolvedFromPath;
     Path &compiler = resolvedFromPath[split.front()];
     if (compiler.isEmpty()) {
@@ -26,6 +26,8 @@ public:
     Path compiler() const;
     Path projectRoot() const;
 private:
+    bool parseArgs(String args, const Path &base);
+
     List<String> mClangArgs;
     List<Path> mInputFiles, mUnresolvedInputFiles;
     Path mBase, mCompiler;
@@ -0,0 +1,78 @@
+#include "HelperThreads.h"
+#include <rct/List.h>
+#include <rct/Log.h>
+#include <rct/Mutex.h>
+#include <rct/ThreadPool.h>
+#include <pthread.h>
+
+static Mutex sMutex;
+static int sHelpers = 0;
+
+static bool reserveHelper()
+{
+    MutexLocker lock(&sMutex);
+    if (sHelpers >= ThreadPool::idealThreadCount())
+        return false;
+    ++sHelpers;
+    return true;
+}
+
+static void releaseHelper()
+{
+    MutexLocker lock(&sMutex);
+    --sHelpers;
+}
+
+struct Helper
+{
+    HelperThreads::Function function;
+    void *userData;
+    int index;
+};
+
+static void *helperThread(void *userData)
+{
+    Helper *helper = static_cast<Helper*>(userData);
+    helper->function(helper->userData, helper->index);
+    return 0;
+}
+
+int HelperThreads::run(int count, Function function, void *userData, int stackSize)
+{
+    List<Helper> helpers(count);
+    List<pthread_t> handles(count);
+    List<bool> started(count, false);
+    int threads = 1;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stackSize > 0)
+        pthread_attr_setstacksize(&attr, stackSize);
+    for (int i=0; i<count; ++i) {
+        const Helper helper = { function, userData, i };
+        helpers[i] = helper;
+        if (i && reserveHelper()) {
+            const int ret = pthread_create(&handles[i], &attr, helperThread, &helpers[i]);
+            if (ret) {
+                warning("Can't create helper thread %d", ret);
+                releaseHelper();
+            } else {
+                started[i] = true;
+                ++threads;
+            }
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    if (count)
+        function(userData, 0);
+    for (int i=1; i<count; ++i) {
+        if (started.at(i)) {
+            pthread_join(handles.at(i), 0);
+            releaseHelper();
+        } else {
+            function(userData, i);
+        }
+    }
+    return threads;
+}
@@ -0,0 +1,22 @@
+#ifndef HelperThreads_h
+#define HelperThreads_h
+
+// Splits a job that's already running in a thread pool over a few more
+// threads. There's one budget of helper threads for all of rdm, about one
+// per core, so a burst of such jobs doesn't spawn threads without limit.
+class HelperThreads
+{
+public:
+    typedef void (*Function)(void *userData, int index);
+
+    // Calls function(userData, index) for each index from 0 to count - 1
+    // and returns when all of them have returned. 0 runs in the calling
+    // thread, the rest in helper threads while the budget lasts and after
+    // 0 in the calling thread when it doesn't. Returns the number of
+    // threads that were used
+    static int run(int count, Function function, void *userData, int stackSize = 0);
+private:
+    HelperThreads();
+};
+
+#endif
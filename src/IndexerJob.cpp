@@ -1,6 +1,8 @@
 #include "IndexerJob.h"
+#include <rct/MemoryMonitor.h>
 #include <rct/StopWatch.h>
 #include "Project.h"
+#include "Server.h"
 
 // #define TIMINGS_ENABLED
 #ifdef TIMINGS_ENABLED
@@ -61,14 +63,14 @@ public:
 IndexerJob::IndexerJob(const shared_ptr<Project> &project, Type type, const SourceInformation &sourceInformation)
     : Job(0, project), mType(type), mSourceInformation(sourceInformation),
       mFileId(Location::insertFile(sourceInformation.sourceFile)), mTimer(StopWatch::Microsecond), mParseTime(0),
-      mStarted(false)
+      mPeakMemory(0), mThrottled(false), mStarted(false)
 {}
 
 IndexerJob::IndexerJob(const QueryMessage &msg, const shared_ptr<Project> &project,
                        const SourceInformation &sourceInformation)
     : Job(msg, WriteUnfiltered|WriteBuffered|QuietJob, project), mType(Dump), mSourceInformation(sourceInformation),
       mFileId(Location::insertFile(sourceInformation.sourceFile)), mTimer(StopWatch::Microsecond), mParseTime(0),
-      mStarted(false)
+      mPeakMemory(0), mThrottled(false), mStarted(false)
 {
 }
 
@@ -131,18 +133,47 @@ bool IndexerJob::abortIfStarted()
     return aborted();
 }
 
+void IndexerJob::hashVisitedFiles()
+{
+    for (Set<uint32_t>::const_iterator it = mVisitedFiles.begin(); it != mVisitedFiles.end(); ++it) {
+        const Path path = Location::path(*it);
+        // If the file was touched after we started parsing we can't know
+        // which version we indexed
+        mData->hashes[*it] = path.lastModified() < mParseTime ? RTags::hash(fileContents(*it)) : 0;
+    }
+    mFileContents.clear();
+}
+
+const String &IndexerJob::fileContents(uint32_t fileId)
+{
+    Map<uint32_t, String>::iterator it = mFileContents.find(fileId);
+    if (it == mFileContents.end()) {
+        const Path path = Location::path(fileId);
+        const Map<Path, String>::const_iterator unsaved = mUnsavedFiles.find(path);
+        it = mFileContents.insert(std::make_pair(fileId, unsaved != mUnsavedFiles.end() ? unsaved->second : path.readAll())).first;
+    }
+    return it->second;
+}
+
 void IndexerJob::execute()
 {
     {
         MutexLocker lock(&mutex());
         mStarted = true;
     }
-    mTimer.restart();
     mData = createIndexData();
     assert(mData);
 
+    const uint64_t memory = mThrottled ? MemoryMonitor::usage() : 0;
+    mTimer.restart();
     index();
+    if (mThrottled) {
+        Server::instance()->concurrencyController().release(memory, mPeakMemory);
+        Server::instance()->dispatchIndexerJobs();
+    }
     if (mType != Dump) {
+        if (!isAborted() && mData->hashes.isEmpty()) // rdm --worker jobs come hashed
+            hashVisitedFiles();
         shared_ptr<Project> p = project();
         if (p)
             p->onJobFinished(static_pointer_cast<IndexerJob>(shared_from_this()));
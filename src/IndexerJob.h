@@ -26,16 +26,35 @@ public:
     UsrMap usrMap;
     FixItMap fixIts;
     Map<uint32_t, int> errors;
+    Map<uint32_t, uint64_t> hashes; // content hash of visited files, 0 if unknown
+    SignatureMap signatures; // only for visited headers
+    UsedNameMap usedNames; // for all visited files
     const int type;
 };
 
+// Only the generic parts, this is what rdm --worker processes send back
+template <> inline Serializer &operator<<(Serializer &s, const IndexData &data)
+{
+    s << data.references << data.symbols << data.symbolNames << data.dependencies << data.message
+      << data.usrMap << data.fixIts << data.errors << data.hashes << data.signatures << data.usedNames;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, IndexData &data)
+{
+    s >> data.references >> data.symbols >> data.symbolNames >> data.dependencies >> data.message
+      >> data.usrMap >> data.fixIts >> data.errors >> data.hashes >> data.signatures >> data.usedNames;
+    return s;
+}
+
 class IndexerJob : public Job
 {
 public:
     enum Type {
         Makefile,
         Dirty,
-        Dump
+        Dump,
+        Declarations // function bodies skipped, see Server::DeclarationsFirst
     };
     IndexerJob(const shared_ptr<Project> &project, Type type, const SourceInformation &sourceInformation);
     IndexerJob(const QueryMessage &msg, const shared_ptr<Project> &project, const SourceInformation &sourceInformation);
@@ -48,10 +67,16 @@ public:
     time_t parseTime() const { return mParseTime; }
     const Set<uint32_t> &visitedFiles() const { return mVisitedFiles; }
     Type type() const { return mType; }
+    // Contents to parse instead of what's on disk, remote workers get these from rdm
+    void setUnsavedFiles(const Map<Path, String> &files) { mUnsavedFiles = files; }
+    // Let in by the ConcurrencyController, released when the job is done
+    void setThrottled(bool throttled) { mThrottled = throttled; }
 protected:
     virtual void index() = 0;
     virtual void execute();
     virtual shared_ptr<IndexData> createIndexData() { return shared_ptr<IndexData>(new IndexData); }
+    void hashVisitedFiles();
+    const String &fileContents(uint32_t fileId);
 
     Location createLocation(uint32_t fileId, uint32_t offset, bool *blocked);
     Location createLocation(const Path &file, uint32_t offset, bool *blocked);
@@ -60,6 +85,8 @@ protected:
     Set<uint32_t> mVisitedFiles, mBlockedFiles;
 
     Map<String, uint32_t> mFileIds;
+    Map<uint32_t, String> mFileContents;
+    Map<Path, String> mUnsavedFiles;
 
     SourceInformation mSourceInformation;
     const uint32_t mFileId;
@@ -68,7 +95,8 @@ protected:
     shared_ptr<IndexData> mData;
 
     time_t mParseTime;
-    bool mStarted;
+    uint64_t mPeakMemory; // set by jobs that know, see ConcurrencyController
+    bool mThrottled, mStarted;
 };
 
 #endif
@@ -1,9 +1,13 @@
 #include "IndexerJobClang.h"
+#include "HelperThreads.h"
 #include "Project.h"
 #include "Server.h"
 
 #include "RTagsPlugin.h"
+#include <algorithm>
 
+// rtagsclangindex builds this file too
+#ifndef RTAGS_CLANG_INDEX_API
 class ClangPlugin : public RTagsPlugin
 {
 public:
@@ -11,7 +15,7 @@ public:
                                              IndexerJob::Type type,
                                              const SourceInformation &sourceInformation)
     {
-        if (!sourceInformation.isJS())
+        if (!sourceInformation.isJS() && !(Server::instance()->options().options & Server::ClangIndexApi))
             return shared_ptr<IndexerJob>(new IndexerJobClang(project, type, sourceInformation));
         return shared_ptr<IndexerJob>();
     }
@@ -19,7 +23,7 @@ public:
                                              const shared_ptr<Project> &project,
                                              const SourceInformation &sourceInformation)
     {
-        if (!sourceInformation.isJS())
+        if (!sourceInformation.isJS() && !(Server::instance()->options().options & Server::ClangIndexApi))
             return shared_ptr<IndexerJob>(new IndexerJobClang(msg, project, sourceInformation));
         return shared_ptr<IndexerJob>();
     }
@@ -31,6 +35,7 @@ RTagsPlugin *createInstance()
     return new ClangPlugin;
 }
 };
+#endif
 
 
 static const CXSourceLocation nullLocation = clang_getNullLocation();
@@ -55,13 +60,15 @@ struct VerboseVisitorUserData {
 
 IndexerJobClang::IndexerJobClang(const shared_ptr<Project> &project, Type type,
                                  const SourceInformation &sourceInformation)
-    : IndexerJob(project, type, sourceInformation), mLastCursor(nullCursor)
+    : IndexerJob(project, type, sourceInformation), mLastCursor(nullCursor), mPreambleHits(0),
+      mLastFile(0), mLastFileId(0), mRealpathsAvoided(0)
 {
 }
 
 IndexerJobClang::IndexerJobClang(const QueryMessage &msg, const shared_ptr<Project> &project,
                                  const SourceInformation &sourceInformation)
-    : IndexerJob(msg, project, sourceInformation), mLastCursor(nullCursor)
+    : IndexerJob(msg, project, sourceInformation), mLastCursor(nullCursor), mPreambleHits(0),
+      mLastFile(0), mLastFileId(0), mRealpathsAvoided(0)
 {
 }
 
@@ -71,7 +78,9 @@ void IndexerJobClang::inclusionVisitor(CXFile includedFile,
                                        CXClientData userData)
 {
     IndexerJobClang *job = static_cast<IndexerJobClang*>(userData);
-    const Location l(includedFile, 0);
+    const Location l = job->createLocation(includedFile, 0);
+    if (job->mPreambleFileIds.contains(l.fileId()))
+        return;
 
     const Path path = l.path();
     job->mData->symbolNames[path].insert(l);
@@ -85,64 +94,108 @@ void IndexerJobClang::inclusionVisitor(CXFile includedFile,
         for (unsigned i=0; i<includeLen; ++i) {
             CXFile originatingFile;
             clang_getSpellingLocation(includeStack[i], &originatingFile, 0, 0, 0);
-            Location loc(originatingFile, 0);
-            const uint32_t f = loc.fileId();
+            uint32_t f = job->resolveFile(originatingFile, true);
+            if (job->mPreambleFileIds.contains(f))
+                f = job->mFileId;
             if (f)
                 job->mData->dependencies[fileId].insert(f);
         }
     }
 }
 
+static inline bool isClassLike(CXCursorKind kind, bool namespaces)
+{
+    switch (kind) {
+    case CXCursor_ClassDecl:
+    case CXCursor_ClassTemplate:
+    case CXCursor_StructDecl:
+        return true;
+    case CXCursor_Namespace:
+        // namespaces can include all namespaces in their symbolname
+        return namespaces;
+    default:
+        break;
+    }
+    return false;
+}
+
+const IndexerJobClang::QualifiedName *IndexerJobClang::qualifiedName(const CXCursor &cursor)
+{
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    if (!RTags::needsQualifiers(kind))
+        return 0;
+    const unsigned hash = clang_hashCursor(cursor);
+    {
+        const List<QualifiedName> &bucket = mQualifiedNames[hash];
+        for (int i=0; i<bucket.size(); ++i) {
+            if (clang_equalCursors(bucket.at(i).cursor, cursor))
+                return &bucket.at(i);
+        }
+    }
+
+    QualifiedName qualified;
+    qualified.cursor = cursor;
+    qualified.hasTemplates = (kind == CXCursor_ClassTemplate);
+    qualified.keep[0] = qualified.keep[1] = 0;
+    CXStringScope displayName(clang_getCursorDisplayName(cursor));
+    const char *name = displayName.data();
+    const int len = name ? strlen(name) : 0;
+    if (len) { // an empty name ends the chain
+        const QualifiedName *parent = qualifiedName(clang_getCursorSemanticParent(cursor));
+        if (parent && !parent->name.isEmpty()) {
+            qualified.name = parent->name;
+            qualified.name.append("::");
+            qualified.hasTemplates = qualified.hasTemplates || parent->hasTemplates;
+        }
+        qualified.name.append(name, len);
+        for (int i=0; i<2; ++i) {
+            if (isClassLike(kind, i)) {
+                const int parentKeep = parent ? parent->keep[i] : 0;
+                qualified.keep[i] = len + (parentKeep ? parentKeep + 2 : 0);
+            }
+        }
+    }
+    List<QualifiedName> &bucket = mQualifiedNames[hash];
+    bucket.append(qualified);
+    return &bucket.last();
+}
+
 String IndexerJobClang::addNamePermutations(const CXCursor &cursor, const Location &location)
 {
-    CXCursorKind kind = clang_getCursorKind(cursor);
-    const CXCursorKind originalKind = kind;
+    const CXCursorKind originalKind = clang_getCursorKind(cursor);
     char buf[32768];
     int pos = sizeof(buf) - 1;
     buf[pos] = '\0';
-    int cutoff = -1;
+    int cutoff = pos;
 
-    CXCursor c = cursor;
-    bool hasTemplates = false;
-    do {
-        CXStringScope displayName(clang_getCursorDisplayName(c));
+    bool hasTemplates = (originalKind == CXCursor_ClassTemplate);
+    {
+        CXStringScope displayName(clang_getCursorDisplayName(cursor));
         const char *name = displayName.data();
-        if (!name)
-            break;
-        const int len = strlen(name);
-        if (!len)
-            break;
-
-        if (kind == CXCursor_ClassTemplate)
-            hasTemplates = true;
-        if (pos != sizeof(buf) - 1 && (pos -= 2) >= 0) {
-            memset(buf + pos, ':', 2);
-        }
-        pos -= len;
-        if (pos < 0) {
-            error("SymbolName too long. Giving up");
-            return String();
-        }
-        memcpy(buf + pos, name, len);
-
-        c = clang_getCursorSemanticParent(c);
-        kind = clang_getCursorKind(c);
-        if (cutoff == -1) {
-            switch (kind) {
-            case CXCursor_ClassDecl:
-            case CXCursor_ClassTemplate:
-            case CXCursor_StructDecl:
-                break;
-            case CXCursor_Namespace:
-                // namespaces can include all namespaces in their symbolname
-                if (originalKind == CXCursor_Namespace)
-                    break;
-            default:
-                cutoff = pos;
-                break;
+        const int len = name ? strlen(name) : 0;
+        if (len) {
+            const QualifiedName *parent = qualifiedName(clang_getCursorSemanticParent(cursor));
+            const int parentSize = parent && !parent->name.isEmpty() ? parent->name.size() : 0;
+            if (len + parentSize + 2 >= pos) {
+                error("SymbolName too long. Giving up");
+                return String();
+            }
+            pos -= len;
+            memcpy(buf + pos, name, len);
+            cutoff = pos;
+            if (parentSize) {
+                pos -= 2;
+                memset(buf + pos, ':', 2);
+                pos -= parentSize;
+                memcpy(buf + pos, parent->name.constData(), parentSize);
+                // the symbol name includes the classes we're in but not namespaces
+                const int keep = parent->keep[originalKind == CXCursor_Namespace];
+                if (keep)
+                    cutoff -= keep + 2;
+                hasTemplates = hasTemplates || parent->hasTemplates;
             }
         }
-    } while (RTags::needsQualifiers(kind));
+    }
 
     String type;
     switch (originalKind) {
@@ -154,8 +207,6 @@ String IndexerJobClang::addNamePermutations(const CXCursor &cursor, const Locati
         type = typeName(cursor);
         break;
     }
-    if (cutoff == -1)
-        cutoff = pos;
     String ret;
     // i == 0 --> with templates, i == 1 without templates or without EnumConstantDecl part
     for (int i=0; i<2; ++i) {
@@ -163,7 +214,7 @@ String IndexerJobClang::addNamePermutations(const CXCursor &cursor, const Locati
             char *ch = buf + pos;
             while (true) {
                 const String name(ch, sizeof(buf) - (ch - buf) - 1);
-                mData->symbolNames[name].insert(location);
+                mSymbolNames.append(std::make_pair(name, location));
                 if (!type.isEmpty() && (originalKind != CXCursor_ParmDecl || !strchr(ch, '('))) {
                     // We only want to add the type to the final declaration for ParmDecls
                     // e.g.
@@ -175,7 +226,7 @@ String IndexerJobClang::addNamePermutations(const CXCursor &cursor, const Locati
                     // or
                     // void foo(int)::int bar
 
-                    mData->symbolNames[type + name].insert(location);
+                    mSymbolNames.append(std::make_pair(type + name, location));
                 }
 
                 ch = strstr(ch + 1, "::");
@@ -360,6 +411,24 @@ CXChildVisitResult IndexerJobClang::indexVisitor(CXCursor cursor, CXCursor paren
     return CXChildVisit_Recurse;
 }
 
+// Key for everything with the same unqualified name, "int Foo::bar(int) const"
+// => "bar". Overloads share a key so adding one invalidates all callers
+static uint32_t nameKey(const String &symbolName)
+{
+    const char *data = symbolName.constData();
+    int end = symbolName.indexOf('(');
+    if (end == -1)
+        end = symbolName.size();
+    int start = end;
+    while (start > 0 && RTags::isSymbol(data[start - 1]))
+        --start;
+    if (start == end) { // operators, templates
+        start = 0;
+        end = symbolName.size();
+    }
+    return static_cast<uint32_t>(RTags::hash(data + start, end - start));
+}
+
 static inline bool isImplicit(const CXCursor &cursor)
 {
     return clang_equalLocations(clang_getCursorLocation(cursor),
@@ -513,6 +582,8 @@ void IndexerJobClang::handleReference(const CXCursor &cursor, CXCursorKind kind,
         return;
 
     refInfo.references.insert(location);
+    if (reffedLoc.fileId() != location.fileId())
+        mUsedNames[location.fileId()].insert(nameKey(refInfo.symbolName));
 
     CursorInfo &info = mData->symbols[location];
     info.targets.insert(reffedLoc);
@@ -554,8 +625,7 @@ void IndexerJobClang::handleReference(const CXCursor &cursor, CXCursorKind kind,
         }
     }
 
-    Set<Location> &val = mData->references[location];
-    val.insert(reffedLoc);
+    mReferences.append(std::make_pair(location, reffedLoc));
 
 }
 
@@ -593,7 +663,7 @@ void IndexerJobClang::handleInclude(const CXCursor &cursor, CXCursorKind kind, c
     (void)kind;
     CXFile includedFile = clang_getIncludedFile(cursor);
     if (includedFile) {
-        const Location refLoc(includedFile, 0);
+        const Location refLoc = createLocation(includedFile, 0);
         if (!refLoc.isNull()) {
             {
                 String include = "#include ";
@@ -782,9 +852,11 @@ bool IndexerJobClang::handleCursor(const CXCursor &cursor, CXCursorKind kind, co
             info.definition = clang_isCursorDefinition(cursor);
         }
         info.kind = kind;
+        if (location.fileId() != mFileId && mVisitedFiles.contains(location.fileId()))
+            addSignature(cursor, kind, location, info);
         const String usr = RTags::eatString(clang_getCursorUSR(cursor));
         if (!usr.isEmpty())
-            mData->usrMap[usr].insert(location);
+            mUsrs.append(std::make_pair(usr, location));
 
         switch (info.kind) {
         case CXCursor_FunctionDecl: {
@@ -796,7 +868,7 @@ bool IndexerJobClang::handleCursor(const CXCursor &cursor, CXCursorKind kind, co
             if (!clang_equalCursors(canonical, cursor)) {
                 const String canonicalUsr = RTags::eatString(clang_getCursorUSR(canonical));
                 if (canonicalUsr != usr && !canonicalUsr.isEmpty()) {
-                    mData->usrMap[canonicalUsr].insert(location);
+                    mUsrs.append(std::make_pair(canonicalUsr, location));
                 }
             }
             break; }
@@ -824,6 +896,116 @@ bool IndexerJobClang::handleCursor(const CXCursor &cursor, CXCursorKind kind, co
     return true;
 }
 
+// Identifiers in #if, #ifdef, #ifndef and #elif. These depend on macros
+// without producing macro expansions
+static void addConditionalNames(const String &contents, Set<uint32_t> &names)
+{
+    const char *data = contents.constData();
+    const int size = contents.size();
+    int i = 0;
+    while (i < size) {
+        int lineEnd = i;
+        while (lineEnd < size && data[lineEnd] != '\n') {
+            if (data[lineEnd] == '\\' && lineEnd + 1 < size && data[lineEnd + 1] == '\n')
+                ++lineEnd;
+            ++lineEnd;
+        }
+        int j = i;
+        while (j < lineEnd && (data[j] == ' ' || data[j] == '\t'))
+            ++j;
+        if (j < lineEnd && data[j] == '#') {
+            ++j;
+            while (j < lineEnd && (data[j] == ' ' || data[j] == '\t'))
+                ++j;
+            if (!strncmp(data + j, "if", 2) || !strncmp(data + j, "elif", 4)) {
+                while (j < lineEnd && isalpha(data[j]))
+                    ++j;
+                while (j < lineEnd) {
+                    if (isdigit(data[j])) {
+                        while (j < lineEnd && RTags::isSymbol(data[j]))
+                            ++j;
+                    } else if (RTags::isSymbol(data[j])) {
+                        const int start = j;
+                        while (j < lineEnd && RTags::isSymbol(data[j]))
+                            ++j;
+                        if (j - start != 7 || strncmp(data + start, "defined", 7))
+                            names.insert(static_cast<uint32_t>(RTags::hash(data + start, j - start)));
+                    } else {
+                        ++j;
+                    }
+                }
+            }
+        }
+        i = lineEnd + 1;
+    }
+}
+
+void IndexerJobClang::addSignature(const CXCursor &cursor, CXCursorKind kind, const Location &location, const CursorInfo &info)
+{
+    // Anything that can change what a file using this symbol indexes to. The
+    // offsets are in there since the users' targets point at them
+    const int values[] = { kind, info.start, info.end, info.definition };
+    uint64_t signature = RTags::hash(reinterpret_cast<const char*>(values), sizeof(values),
+                                     RTags::hash(info.symbolName));
+    if (kind == CXCursor_MacroDefinition) {
+        const String &contents = fileContents(location.fileId());
+        if (info.start >= 0 && info.end <= contents.size() && info.start < info.end)
+            signature = RTags::hash(contents.constData() + info.start, info.end - info.start, signature);
+    } else {
+        signature = RTags::hash(typeName(cursor), signature);
+    }
+    // declaration and definition in the same file share a key
+    mSignatures[location.fileId()][nameKey(info.symbolName)] += static_cast<uint32_t>(signature);
+}
+
+// Most keys come in long runs of the same few values, sorting first means one
+// map lookup per distinct key and the sets get their locations in order
+template <typename Key>
+static void mergeSorted(List<std::pair<Key, Location> > &flat, Map<Key, Set<Location> > &map)
+{
+    std::sort(flat.begin(), flat.end());
+    typename Map<Key, Set<Location> >::iterator it = map.end();
+    for (int i=0; i<flat.size(); ++i) {
+        const std::pair<Key, Location> &entry = flat.at(i);
+        if (!i || entry.first != flat.at(i - 1).first)
+            it = map.insert(map.end(), std::make_pair(entry.first, Set<Location>()));
+        it->second.insert(it->second.end(), entry.second);
+    }
+    List<std::pair<Key, Location> >().swap(flat);
+}
+
+void IndexerJobClang::writeCollected()
+{
+    mergeSorted(mSymbolNames, mData->symbolNames);
+    mergeSorted(mUsrs, mData->usrMap);
+    mergeSorted(mReferences, mData->references);
+}
+
+void IndexerJobClang::writeSignatures()
+{
+    mFileContents[mFileId] = mContents;
+    for (Set<uint32_t>::const_iterator it = mVisitedFiles.begin(); it != mVisitedFiles.end(); ++it) {
+        const uint32_t fileId = *it;
+        if (fileId != mFileId) {
+            List<uint64_t> &signatures = mData->signatures[fileId];
+            const Map<uint32_t, Map<uint32_t, uint32_t> >::const_iterator sigs = mSignatures.find(fileId);
+            if (sigs != mSignatures.end()) {
+                signatures.reserve(sigs->second.size());
+                for (Map<uint32_t, uint32_t>::const_iterator s = sigs->second.begin(); s != sigs->second.end(); ++s)
+                    signatures.append((static_cast<uint64_t>(s->first) << 32) | s->second);
+            }
+        }
+        Set<uint32_t> &names = mUsedNames[fileId];
+        addConditionalNames(fileContents(fileId), names);
+        List<uint32_t> &used = mData->usedNames[fileId];
+        used.reserve(names.size());
+        for (Set<uint32_t>::const_iterator n = names.begin(); n != names.end(); ++n)
+            used.append(*n);
+    }
+    mSignatures.clear();
+    mUsedNames.clear();
+}
+
 bool IndexerJobClang::parse(int build)
 {
     UnitList &units = data()->units;
@@ -835,20 +1017,51 @@ bool IndexerJobClang::parse(int build)
         abort();
         return false;
     }
-    const List<String> args = mSourceInformation.builds.at(build).args;
+    const List<String> &args = mSourceInformation.builds.at(build).args.list();
     CXTranslationUnit &unit = units[build].second;
     assert(!unit);
 
-    mClangLines.append(String());
-    String &clangLine = mClangLines.last();
-    CXUnsavedFile unsaved = { mSourceInformation.sourceFile.constData(),
-                              mContents.constData(),
-                              static_cast<unsigned long>(mContents.size()) };
+    String &clangLine = mClangLines[build];
+    DependencyMap dependencies;
+    List<CXUnsavedFile> unsaved;
+    {
+        const CXUnsavedFile source = { mSourceInformation.sourceFile.constData(),
+                                       mContents.constData(),
+                                       static_cast<unsigned long>(mContents.size()) };
+        unsaved.append(source);
+        for (Map<Path, String>::const_iterator it = mUnsavedFiles.begin(); it != mUnsavedFiles.end(); ++it) {
+            if (it->first != mSourceInformation.sourceFile) {
+                const CXUnsavedFile file = { it->first.constData(), it->second.constData(),
+                                             static_cast<unsigned long>(it->second.size()) };
+                unsaved.append(file);
+            }
+        }
+    }
 
-    RTags::parseTranslationUnit(mSourceInformation.sourceFile, args,
-                                unit, index, clangLine,
-                                mFileId, &mData->dependencies, &unsaved, 1);
+    List<String> preambleArgs = args;
+    uint64_t preambleKey = 0;
+    const unsigned parseFlags = type() == Declarations ? RTags::SkipFunctionBodies : RTags::DefaultParseFlags;
+    if (type() != Dump && usePreamble(preambleArgs, &preambleKey)) {
+        RTags::parseTranslationUnit(mSourceInformation.sourceFile, preambleArgs,
+                                    unit, index, clangLine,
+                                    mFileId, &dependencies, unsaved.data(), unsaved.size(), parseFlags);
+        if (unit) {
+            MutexLocker lock(&mParseMutex);
+            ++mPreambleHits;
+        } else {
+            warning() << "Failed to use preamble" << clangLine;
+            Server::instance()->preambleCache().remove(preambleKey);
+        }
+    }
+    if (!unit) {
+        RTags::parseTranslationUnit(mSourceInformation.sourceFile, args,
+                                    unit, index, clangLine,
+                                    mFileId, &dependencies, unsaved.data(), unsaved.size(), parseFlags);
+    }
     warning() << "loading unit " << clangLine << " " << (unit != 0);
+    MutexLocker lock(&mParseMutex);
+    for (DependencyMap::const_iterator it = dependencies.begin(); it != dependencies.end(); ++it)
+        mData->dependencies[it->first].unite(it->second);
     if (unit) {
         return !isAborted();
     }
@@ -865,7 +1078,9 @@ bool IndexerJobClang::parse(int build)
                                     mFileId, &mData->dependencies, &preprocessorOnlyUnsaved, 1);
     }
     if (unit) {
+        resetFileCache();
         clang_getInclusions(unit, IndexerJobClang::inclusionVisitor, this);
+        resetFileCache();
         clang_disposeTranslationUnit(unit);
         unit = 0;
     } else if (type() != Dump) {
@@ -874,6 +1089,68 @@ bool IndexerJobClang::parse(int build)
     return !isAborted();
 }
 
+struct ParseBuildsData
+{
+    IndexerJobClang *job;
+    List<char> ok; // not List<bool>, each build writes its own
+};
+
+void IndexerJobClang::parseThread(void *userData, int build)
+{
+    ParseBuildsData *data = static_cast<ParseBuildsData*>(userData);
+    StopWatch watch;
+    data->ok[build] = data->job->parse(build);
+    data->job->mParseTimes[build] = watch.elapsed();
+}
+
+bool IndexerJobClang::parseBuilds()
+{
+    const int buildCount = mSourceInformation.builds.size();
+    ParseBuildsData data;
+    data.job = this;
+    data.ok.resize(buildCount, 0);
+    // same stack size as the indexer threads, clang needs a lot of it
+    HelperThreads::run(buildCount, &IndexerJobClang::parseThread, &data,
+                       Server::instance()->options().clangStackSize);
+    for (int i=0; i<buildCount; ++i) {
+        if (!data.ok.at(i))
+            return false;
+    }
+    return true;
+}
+
+bool IndexerJobClang::usePreamble(List<String> &args, uint64_t *key)
+{
+    PreambleCache &cache = Server::instance()->preambleCache();
+    PreambleCache::Preamble preamble;
+    if (!cache.isEnabled() || !cache.find(mSourceInformation.sourceFile, mContents, args, preamble))
+        return false;
+
+    // Cursors in the headers of the pch aren't visited so only use it when
+    // someone else has indexed them already
+    shared_ptr<Project> p = project();
+    if (!p)
+        return false;
+    for (Map<Path, Set<Path> >::const_iterator it = preamble.includes.begin(); it != preamble.includes.end(); ++it) {
+        if (!p->isIndexed(Location::fileId(it->first)))
+            return false;
+    }
+
+    MutexLocker lock(&mParseMutex);
+    const uint32_t preambleFileId = Location::insertFile(preamble.header);
+    mPreambleFileIds.insert(preambleFileId);
+    mBlockedFiles.insert(preambleFileId);
+    for (Map<Path, Set<Path> >::const_iterator it = preamble.includes.begin(); it != preamble.includes.end(); ++it) {
+        Set<uint32_t> &deps = mData->dependencies[Location::fileId(it->first)];
+        for (Set<Path>::const_iterator inc = it->second.begin(); inc != it->second.end(); ++inc) {
+            deps.insert(*inc == preamble.header ? mFileId : Location::insertFile(*inc));
+        }
+    }
+    args << "-include-pch" << preamble.pch;
+    *key = preamble.key;
+    return true;
+}
+
 struct XmlEntry
 {
     enum Type { None, Warning, Error, Fixit };
@@ -1027,7 +1304,7 @@ bool IndexerJobClang::diagnose(int build)
                 const CXStringScope stringScope = clang_getDiagnosticFixIt(diagnostic, f, &range);
                 clang_getSpellingLocation(clang_getRangeStart(range), &file, &line, &column, &startOffset);
 
-                const Location loc(file, startOffset);
+                const Location loc = createLocation(file, startOffset);
                 if (mVisitedFiles.contains(loc.fileId())) {
                     const char* string = clang_getCString(stringScope);
                     unsigned endOffset;
@@ -1110,37 +1387,43 @@ bool IndexerJobClang::visit(int build)
         abort();
         return false;
     }
+    resetFileCache();
     clang_getInclusions(units.at(build).second, IndexerJobClang::inclusionVisitor, this);
     if (isAborted())
         return false;
 
     clang_visitChildren(clang_getTranslationUnitCursor(units.at(build).second),
                         IndexerJobClang::indexVisitor, this);
-    if (isAborted())
-        return false;
-    if (testLog(VerboseDebug)) {
-        VerboseVisitorUserData u = { 0, "<VerboseVisitor " + mClangLines.at(build) + ">\n", this };
-        clang_visitChildren(clang_getTranslationUnitCursor(units.at(build).second),
-                            IndexerJobClang::verboseVisitor, &u);
-        u.out += "</VerboseVisitor " + mClangLines.at(build) + ">";
-        if (getenv("RTAGS_INDEXERJOB_DUMP_TO_FILE")) {
-            char buf[1024];
-            snprintf(buf, sizeof(buf), "/tmp/%s.log", mSourceInformation.sourceFile.fileName());
-            FILE *f = fopen(buf, "w");
-            assert(f);
-            fwrite(u.out.constData(), 1, u.out.size(), f);
-            fclose(f);
-        } else {
-            logDirect(VerboseDebug, u.out);
-        }
-    }
+    mQualifiedNames.clear();
     return !isAborted();
 }
 
+void IndexerJobClang::dumpVerbose(int build)
+{
+    UnitList &units = data()->units;
+    resetFileCache();
+    VerboseVisitorUserData u = { 0, "<VerboseVisitor " + mClangLines.at(build) + ">\n", this };
+    clang_visitChildren(clang_getTranslationUnitCursor(units.at(build).second),
+                        IndexerJobClang::verboseVisitor, &u);
+    u.out += "</VerboseVisitor " + mClangLines.at(build) + ">";
+    if (getenv("RTAGS_INDEXERJOB_DUMP_TO_FILE")) {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "/tmp/%s.log", mSourceInformation.sourceFile.fileName());
+        FILE *f = fopen(buf, "w");
+        assert(f);
+        fwrite(u.out.constData(), 1, u.out.size(), f);
+        fclose(f);
+    } else {
+        logDirect(VerboseDebug, u.out);
+    }
+}
+
 void IndexerJobClang::index()
 {
     UnitList &units = data()->units;
     units.resize(sourceInformation().builds.size());
+    mClangLines.resize(units.size());
+    mParseTimes.resize(units.size());
 
     if (type() == Dump) {
         assert(id() != -1);
@@ -1156,10 +1439,13 @@ void IndexerJobClang::index()
         int unitCount = 0;
         const int buildCount = mSourceInformation.builds.size();
         mParseTime = time(0);
-        mContents = mSourceInformation.sourceFile.readAll();
+        {
+            const Map<Path, String>::const_iterator unsaved = mUnsavedFiles.find(mSourceInformation.sourceFile);
+            mContents = (unsaved != mUnsavedFiles.end() ? unsaved->second : mSourceInformation.sourceFile.readAll());
+        }
+        if (!parseBuilds())
+            return;
         for (int i=0; i<buildCount; ++i) {
-            if (!parse(i))
-                return;
             if (units.at(i).second)
                 ++unitCount;
         }
@@ -1168,10 +1454,25 @@ void IndexerJobClang::index()
             if (!visit(i) || !diagnose(i))
                 return;
         }
+        writeCollected();
+        if (testLog(VerboseDebug)) {
+            for (int i=0; i<buildCount; ++i) {
+                if (units.at(i).second)
+                    dumpVerbose(i);
+            }
+        }
+        writeSignatures();
         {
             mData->message = mSourceInformation.sourceFile.toTilde();
-            if (buildCount > 1)
-                mData->message += String::format<16>(" (%d builds)", buildCount);
+            if (buildCount > 1) {
+                mData->message += String::format<16>(" (%d builds, parsed in ", buildCount);
+                for (int i=0; i<buildCount; ++i) {
+                    if (i)
+                        mData->message += '/';
+                    mData->message += String::number(mParseTimes.at(i));
+                }
+                mData->message += "ms)";
+            }
             if (!unitCount) {
                 mData->message += " error";
             } else if (unitCount != buildCount) {
@@ -1185,8 +1486,15 @@ void IndexerJobClang::index()
             } else if (mData->dependencies.size()) {
                 mData->message += String::format<16>("(%d deps)", mData->dependencies.size());
             }
-            if (type() == Dirty)
+            if (mPreambleHits)
+                mData->message += " (pch)";
+            if (mRealpathsAvoided)
+                mData->message += String::format<48>(" (%d realpath calls avoided)", mRealpathsAvoided);
+            if (type() == Dirty) {
                 mData->message += " (dirty)";
+            } else if (type() == Declarations) {
+                mData->message += " (declarations)";
+            }
         }
     }
 }
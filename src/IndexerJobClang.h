@@ -43,13 +43,48 @@ public:
 
     shared_ptr<IndexDataClang> data() const { return static_pointer_cast<IndexDataClang>(IndexerJob::data()); }
     String contents() const { return mContents; }
-private:
+protected:
     virtual void index();
 
     bool diagnose(int build);
-    bool visit(int build);
+    virtual bool visit(int build);
     bool parse(int build);
+    // Parses all builds, each one after the first on its own thread
+    bool parseBuilds();
+    static void parseThread(void *userData, int build);
+    bool usePreamble(List<String> &args, uint64_t *key);
 
+    // CXFile handles stay valid as long as the translation unit so each of
+    // them only needs to be resolved once. Addresses get reused once a unit is
+    // disposed so the cache only covers one unit at a time
+    inline void resetFileCache()
+    {
+        mFileIdsByFile.clear();
+        mLastFile = 0;
+        mLastFileId = 0;
+    }
+    inline uint32_t resolveFile(CXFile file, bool countHit)
+    {
+        if (!file)
+            return 0;
+        if (file != mLastFile) {
+            uint32_t &fileId = mFileIdsByFile[file];
+            if (!fileId) {
+                fileId = Location::insertFile(Path::resolved(RTags::eatString(clang_getFileName(file))));
+                countHit = false;
+            }
+            mLastFile = file;
+            mLastFileId = fileId;
+        }
+        if (countHit)
+            ++mRealpathsAvoided;
+        return mLastFileId;
+    }
+    inline Location createLocation(CXFile file, uint32_t offset)
+    {
+        const uint32_t fileId = resolveFile(file, true);
+        return fileId ? Location(fileId, offset) : Location();
+    }
     using IndexerJob::createLocation;
     inline Location createLocation(const CXSourceLocation &location, bool *blocked)
     {
@@ -59,16 +94,29 @@ private:
         CXFile file;
         unsigned start;
         clang_getSpellingLocation(location, &file, 0, 0, &start);
-        if (file) {
-            return createLocation(RTags::eatString(clang_getFileName(file)), start, blocked);
-        }
+        if (const uint32_t fileId = resolveFile(file, false))
+            return createLocation(fileId, start, blocked);
         return Location();
     }
     inline Location createLocation(const CXCursor &cursor, bool *blocked = 0)
     {
         return createLocation(clang_getCursorLocation(cursor), blocked);
     }
+    struct QualifiedName
+    {
+        CXCursor cursor;
+        String name; // outer::...::cursor
+        // length of the end of name that goes into the symbol names of
+        // children, [1] is for namespace children
+        int keep[2];
+        bool hasTemplates;
+    };
+    const QualifiedName *qualifiedName(const CXCursor &cursor);
     String addNamePermutations(const CXCursor &cursor, const Location &location);
+    // Sorts what was collected in flat lists during the visits into mData
+    void writeCollected();
+    // After writeCollected() so it can tell what each cursor was used for
+    void dumpVerbose(int build);
     static CXChildVisitResult indexVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
     static CXChildVisitResult verboseVisitor(CXCursor cursor, CXCursor, CXClientData userData);
     static CXChildVisitResult dumpVisitor(CXCursor cursor, CXCursor, CXClientData userData);
@@ -87,10 +135,27 @@ private:
                                                   const CXCursor &parent);
     void nestedClassConstructorCallUgleHack(const CXCursor &parent, CursorInfo &info,
                                             CXCursorKind refKind, const Location &refLoc);
+    void addSignature(const CXCursor &cursor, CXCursorKind kind, const Location &location, const CursorInfo &info);
+    void writeSignatures();
 
     List<String> mClangLines;
+    List<int> mParseTimes; // ms per build
+    // parse() runs on one thread per build, this protects mData and the
+    // members touched by parse() and usePreamble()
+    Mutex mParseMutex;
     CXCursor mLastCursor;
     String mContents;
+    Set<uint32_t> mPreambleFileIds;
+    int mPreambleHits;
+    Map<unsigned, List<QualifiedName> > mQualifiedNames; // clang_hashCursor
+    List<std::pair<String, Location> > mSymbolNames, mUsrs;
+    List<std::pair<Location, Location> > mReferences;
+    Map<CXFile, uint32_t> mFileIdsByFile;
+    CXFile mLastFile;
+    uint32_t mLastFileId;
+    int mRealpathsAvoided;
+    Map<uint32_t, Map<uint32_t, uint32_t> > mSignatures;
+    Map<uint32_t, Set<uint32_t> > mUsedNames;
 };
 
 #endif
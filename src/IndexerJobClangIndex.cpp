@@ -0,0 +1,166 @@
+#include "IndexerJobClangIndex.h"
+#include "Project.h"
+#include "Server.h"
+#include "RTagsPlugin.h"
+
+class ClangIndexPlugin : public RTagsPlugin
+{
+public:
+    virtual shared_ptr<IndexerJob> createJob(const shared_ptr<Project> &project,
+                                             IndexerJob::Type type,
+                                             const SourceInformation &sourceInformation)
+    {
+        if (!sourceInformation.isJS() && Server::instance()->options().options & Server::ClangIndexApi)
+            return shared_ptr<IndexerJob>(new IndexerJobClangIndex(project, type, sourceInformation));
+        return shared_ptr<IndexerJob>();
+    }
+    virtual shared_ptr<IndexerJob> createJob(const QueryMessage &msg,
+                                             const shared_ptr<Project> &project,
+                                             const SourceInformation &sourceInformation)
+    {
+        if (!sourceInformation.isJS() && Server::instance()->options().options & Server::ClangIndexApi)
+            return shared_ptr<IndexerJob>(new IndexerJobClangIndex(msg, project, sourceInformation));
+        return shared_ptr<IndexerJob>();
+    }
+};
+
+extern "C" {
+RTagsPlugin *createInstance()
+{
+    return new ClangIndexPlugin;
+}
+};
+
+IndexerJobClangIndex::IndexerJobClangIndex(const shared_ptr<Project> &project, Type type,
+                                           const SourceInformation &sourceInformation)
+    : IndexerJobClang(project, type, sourceInformation)
+{
+}
+
+IndexerJobClangIndex::IndexerJobClangIndex(const QueryMessage &msg, const shared_ptr<Project> &project,
+                                           const SourceInformation &sourceInformation)
+    : IndexerJobClang(msg, project, sourceInformation)
+{
+}
+
+void IndexerJobClangIndex::index()
+{
+    IndexerJobClang::index();
+    if (type() != Dump && !isAborted())
+        mData->message += " (index api)";
+}
+
+bool IndexerJobClangIndex::visit(int build)
+{
+    UnitList &units = data()->units;
+
+    CXTranslationUnit unit = units.at(build).second;
+    if (!unit) {
+        abort();
+        return false;
+    }
+    resetFileCache();
+    clang_getInclusions(unit, IndexerJobClang::inclusionVisitor, this);
+    if (isAborted())
+        return false;
+
+    // The indexing callbacks don't report includes and macros. They're all
+    // children of the translation unit so this doesn't need to recurse
+    clang_visitChildren(clang_getTranslationUnitCursor(unit), IndexerJobClangIndex::preprocessingVisitor, this);
+    if (isAborted())
+        return false;
+
+    // We index the unit that parse() made rather than calling
+    // clang_indexSourceFile so that cached units and preambles still work
+    IndexerCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.abortQuery = IndexerJobClangIndex::abortQuery;
+    callbacks.indexDeclaration = IndexerJobClangIndex::indexDeclaration;
+    callbacks.indexEntityReference = IndexerJobClangIndex::indexEntityReference;
+    CXIndexAction action = clang_IndexAction_create(units.at(build).first);
+    const int ret = clang_indexTranslationUnit(action, this, &callbacks, sizeof(callbacks),
+                                               CXIndexOpt_IndexFunctionLocalSymbols, unit);
+    clang_IndexAction_dispose(action);
+    mQualifiedNames.clear();
+    if (ret && !isAborted()) {
+        error() << "Failed to index" << mSourceInformation.sourceFile << ret;
+        abort();
+    }
+    return !isAborted();
+}
+
+CXChildVisitResult IndexerJobClangIndex::preprocessingVisitor(CXCursor cursor, CXCursor parent, CXClientData userData)
+{
+    IndexerJobClangIndex *job = static_cast<IndexerJobClangIndex*>(userData);
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    switch (kind) {
+    case CXCursor_InclusionDirective:
+    case CXCursor_MacroDefinition:
+    case CXCursor_MacroExpansion:
+        break;
+    default:
+        return CXChildVisit_Continue;
+    }
+
+    bool blocked = false;
+    const Location loc = job->createLocation(cursor, &blocked);
+    if (blocked || loc.isNull())
+        return CXChildVisit_Continue;
+    switch (RTags::cursorType(kind)) {
+    case RTags::Cursor:
+        job->handleCursor(cursor, kind, loc);
+        break;
+    case RTags::Include:
+        job->handleInclude(cursor, kind, loc);
+        break;
+    case RTags::Reference:
+        job->handleReference(cursor, kind, loc, clang_getCursorReferenced(cursor), parent);
+        break;
+    case RTags::Other:
+        break;
+    }
+    return CXChildVisit_Continue;
+}
+
+int IndexerJobClangIndex::abortQuery(CXClientData userData, void *)
+{
+    return static_cast<IndexerJobClangIndex*>(userData)->isAborted();
+}
+
+void IndexerJobClangIndex::indexDeclaration(CXClientData userData, const CXIdxDeclInfo *decl)
+{
+    if (decl->isImplicit)
+        return;
+    IndexerJobClangIndex *job = static_cast<IndexerJobClangIndex*>(userData);
+    const CXCursorKind kind = clang_getCursorKind(decl->cursor);
+    if (RTags::cursorType(kind) != RTags::Cursor)
+        return;
+    bool blocked = false;
+    const Location loc = job->createLocation(decl->cursor, &blocked);
+    if (!blocked && !loc.isNull())
+        job->handleCursor(decl->cursor, kind, loc);
+    job->mLastCursor = decl->cursor;
+}
+
+void IndexerJobClangIndex::indexEntityReference(CXClientData userData, const CXIdxEntityRefInfo *ref)
+{
+    if (ref->kind == CXIdxEntityRef_Implicit || !ref->referencedEntity)
+        return;
+    IndexerJobClangIndex *job = static_cast<IndexerJobClangIndex*>(userData);
+    const CXCursorKind kind = clang_getCursorKind(ref->cursor);
+    if (RTags::cursorType(kind) != RTags::Reference)
+        return;
+    bool blocked = false;
+    const Location loc = job->createLocation(ref->cursor, &blocked);
+    if (blocked || loc.isNull())
+        return;
+    const CXCursor parent = ref->container ? ref->container->cursor : clang_getNullCursor();
+    if (kind == CXCursor_OverloadedDeclRef) { // same as IndexerJobClang::indexVisitor
+        const int count = clang_getNumOverloadedDecls(ref->cursor);
+        for (int i=0; i<count; ++i)
+            job->handleReference(ref->cursor, kind, loc, clang_getOverloadedDecl(ref->cursor, i), parent);
+    } else {
+        job->handleReference(ref->cursor, kind, loc, ref->referencedEntity->cursor, parent);
+    }
+    job->mLastCursor = ref->cursor;
+}
@@ -0,0 +1,34 @@
+#ifndef IndexerJobClangIndex_h
+#define IndexerJobClangIndex_h
+
+#include "IndexerJobClang.h"
+
+// Same as IndexerJobClang but declarations and references come from
+// libclang's indexing callbacks instead of a visit of every cursor in the
+// translation unit. Only used with rdm --clang-index-api since the callbacks
+// don't see everything the visitor does:
+// - delete expressions don't reference the destructor
+// - the cursor before a reference is the previous reference rather than the
+//   previous cursor, nestedClassConstructorCallUgleHack() only fires when
+//   clang reports the TypeRef right before the constructor
+// - cursors in files another job is indexing are dropped one callback at a
+//   time, the visitor skips their whole subtree
+class IndexerJobClangIndex : public IndexerJobClang
+{
+public:
+    IndexerJobClangIndex(const shared_ptr<Project> &project, Type type,
+                         const SourceInformation &sourceInformation);
+    IndexerJobClangIndex(const QueryMessage &msg,
+                         const shared_ptr<Project> &project,
+                         const SourceInformation &sourceInformation);
+protected:
+    virtual void index();
+    virtual bool visit(int build);
+private:
+    static CXChildVisitResult preprocessingVisitor(CXCursor cursor, CXCursor parent, CXClientData userData);
+    static int abortQuery(CXClientData userData, void *);
+    static void indexDeclaration(CXClientData userData, const CXIdxDeclInfo *decl);
+    static void indexEntityReference(CXClientData userData, const CXIdxEntityRefInfo *ref);
+};
+
+#endif
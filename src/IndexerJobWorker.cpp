@@ -0,0 +1,119 @@
+#include "IndexerJobWorker.h"
+#include "Project.h"
+#include "Server.h"
+#include "WorkerPool.h"
+
+IndexerJobWorker::IndexerJobWorker(const shared_ptr<Project> &project, Type type,
+                                   const SourceInformation &sourceInformation)
+    : IndexerJob(project, type, sourceInformation)
+{}
+
+void IndexerJobWorker::index()
+{
+    shared_ptr<Project> project = this->project();
+    if (!project)
+        return;
+    WorkerPool &pool = Server::instance()->workerPool();
+    shared_ptr<WorkerPool::Worker> worker = pool.acquire();
+    if (!worker) {
+        error() << "No worker to index" << path();
+        abort();
+        return;
+    }
+
+    // Remote workers get everything the source includes from us
+    Set<Path> manifestPaths;
+    {
+        WorkerPool::Manifest manifest;
+        if (worker->remote)
+            manifest = pool.manifest(mSourceInformation);
+        String out;
+        Serializer serializer(out);
+        serializer << project->path() << static_cast<int>(mType) << mSourceInformation << manifest.size();
+        for (int i=0; i<manifest.size(); ++i) {
+            serializer << manifest.at(i).first << manifest.at(i).second;
+            manifestPaths.insert(manifest.at(i).first);
+        }
+        if (!worker->channel.send(WorkerChannel::Index, out)) {
+            pool.release(worker, false, 0);
+            error() << "Lost worker" << worker->pid << "before indexing" << path();
+            abort();
+            return;
+        }
+    }
+
+    bool finished = false, aborted = false, broken = false;
+    uint64_t memory = 0;
+    int type;
+    String payload;
+    while (!finished && !broken && !isAborted() && worker->channel.receive(type, payload)) {
+        Deserializer deserializer(payload.constData(), payload.size());
+        switch (type) {
+        case WorkerChannel::FileId: {
+            Path file;
+            deserializer >> file;
+            String reply;
+            Serializer serializer(reply);
+            serializer << Location::insertFile(worker->remote ? Path::resolved(file) : file);
+            worker->channel.send(WorkerChannel::FileId, reply);
+            break; }
+        case WorkerChannel::Fetch: {
+            List<Path> paths;
+            deserializer >> paths;
+            List<String> contents;
+            contents.reserve(paths.size());
+            for (int i=0; i<paths.size(); ++i) {
+                if (manifestPaths.contains(paths.at(i))) {
+                    contents.append(paths.at(i).readAll());
+                } else {
+                    error() << "Worker asked for" << paths.at(i) << "which isn't in the manifest";
+                    contents.append(String());
+                }
+            }
+            String reply;
+            Serializer serializer(reply);
+            serializer << contents;
+            worker->channel.send(WorkerChannel::Fetch, reply);
+            break; }
+        case WorkerChannel::VisitFile: {
+            uint32_t fileId;
+            deserializer >> fileId;
+            const bool visit = project->visitFile(fileId);
+            if (visit) {
+                mVisitedFiles.insert(fileId);
+            } else {
+                mBlockedFiles.insert(fileId);
+            }
+            String reply;
+            Serializer serializer(reply);
+            serializer << visit;
+            worker->channel.send(WorkerChannel::VisitFile, reply);
+            break; }
+        case WorkerChannel::Log: {
+            int level;
+            String message;
+            deserializer >> level >> message;
+            logDirect(level, message.constData());
+            break; }
+        case WorkerChannel::Finished:
+            deserializer >> aborted >> mParseTime >> *mData >> memory;
+            finished = true;
+            break;
+        default:
+            error("Unexpected message %d from worker %d", type, worker->pid);
+            broken = true;
+            break;
+        }
+    }
+
+    mPeakMemory = memory;
+    pool.release(worker, finished, memory);
+    if (!finished && !isAborted()) {
+        // Leave a trace so the file isn't reindexed over and over
+        error() << "Worker" << worker->pid << "crashed indexing" << path();
+        mData->message = path().toTilde() + " error (worker crashed)";
+        mData->dependencies[mFileId].insert(mFileId);
+    } else if (aborted) {
+        abort();
+    }
+}
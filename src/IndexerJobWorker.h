@@ -0,0 +1,16 @@
+#ifndef IndexerJobWorker_h
+#define IndexerJobWorker_h
+
+#include "IndexerJob.h"
+
+// Runs the job in an rdm --worker process. The worker asks us for file ids
+// and whether it gets to index a file and sends back the IndexData
+class IndexerJobWorker : public IndexerJob
+{
+public:
+    IndexerJobWorker(const shared_ptr<Project> &project, Type type, const SourceInformation &sourceInformation);
+protected:
+    virtual void index();
+};
+
+#endif
@@ -0,0 +1,368 @@
+#include "IndexerWorker.h"
+#include "IndexerJob.h"
+#include "Project.h"
+#include "Server.h"
+#include <rct/Log.h>
+#include <rct/MemoryMonitor.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+IndexerWorker *IndexerWorker::sInstance = 0;
+
+enum { HelloTimeout = 5 }; // seconds
+
+// Compilation errors go to whoever is listening in rdm
+class WorkerLogOutput : public LogOutput
+{
+public:
+    WorkerLogOutput(IndexerWorker *worker, int level)
+        : LogOutput(level), mWorker(worker)
+    {}
+
+    virtual void log(const char *msg, int len)
+    {
+        mWorker->log(logLevel(), msg, len);
+    }
+
+    virtual bool testLog(int level) const
+    {
+        return level == logLevel();
+    }
+private:
+    IndexerWorker *mWorker;
+};
+
+IndexerWorker::IndexerWorker(int fd, const Path &cacheDir)
+    : mChannel(fd), mCacheDir(cacheDir), mFetchMode(WorkerPool::NoFetch), mServed(false)
+{
+    assert(!sInstance);
+    sInstance = this;
+}
+
+IndexerWorker::~IndexerWorker()
+{
+    Location::setFileIdResolver(0);
+    mProjects.clear();
+    mServer.reset();
+    mChannel.close();
+    sInstance = 0;
+}
+
+// Arguments that make clang load a shared object, -Xclang -load and friends
+static bool loadsCode(const List<String> &args)
+{
+    for (int i=0; i<args.size(); ++i) {
+        const String &arg = args.at(i);
+        if (arg == "-load" || arg.startsWith("-plugin") || arg.startsWith("-fplugin") || arg.startsWith("-add-plugin"))
+            return true;
+    }
+    return false;
+}
+
+int IndexerWorker::exec(const String &verifiedHello)
+{
+    String hello = verifiedHello;
+    mServed = !hello.isEmpty();
+    int type;
+    if (!mServed && (!mChannel.receive(type, hello, WorkerChannel::MaxHelloSize) || type != WorkerChannel::Hello)) {
+        error("No options from rdm on fd %d", mChannel.fd());
+        return 1;
+    }
+    Server::Options options;
+    String secret;
+    Deserializer deserializer(hello.constData(), hello.size());
+    deserializer >> secret >> options.options >> options.clangStackSize >> options.defaultArguments
+                 >> options.excludeFilters >> options.ignoredCompilers >> options.dataDir >> mFetchMode;
+    if (mServed && loadsCode(options.defaultArguments)) {
+        error("Refusing default arguments that load plugins from rdm on fd %d", mChannel.fd());
+        return 1;
+    }
+    if (mFetchMode != WorkerPool::NoFetch && !Path::mkdir(mCacheDir)) {
+        error("Can't create directory [%s]", mCacheDir.constData());
+        return 1;
+    }
+
+    mServer.reset(new Server);
+    if (!mServer->initWorker(options))
+        return 1;
+    Location::setFileIdResolver(&IndexerWorker::resolveFileId);
+    WorkerLogOutput errors(this, RTags::CompilationError), xmlErrors(this, RTags::CompilationErrorXml);
+
+    // clang gets the same stack as in rdm's indexer threads
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (options.clangStackSize > 0)
+        pthread_attr_setstacksize(&attr, options.clangStackSize);
+    pthread_t thread;
+    const int ret = pthread_create(&thread, &attr, &IndexerWorker::threadFunc, this);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        error("Can't create worker thread %d", ret);
+        return 1;
+    }
+    pthread_join(thread, 0);
+    return 0;
+}
+
+void *IndexerWorker::threadFunc(void *userData)
+{
+    static_cast<IndexerWorker*>(userData)->run();
+    return 0;
+}
+
+void IndexerWorker::run()
+{
+    int type;
+    String payload;
+    while (mChannel.receive(type, payload)) {
+        if (type != WorkerChannel::Index) {
+            error("Unexpected message %d from rdm", type);
+            break;
+        }
+        Path projectPath;
+        int jobType, manifestSize;
+        SourceInformation source;
+        Deserializer deserializer(payload.constData(), payload.size());
+        deserializer >> projectPath >> jobType >> source >> manifestSize;
+        WorkerPool::Manifest manifest;
+        manifest.resize(manifestSize);
+        for (int i=0; i<manifestSize; ++i)
+            deserializer >> manifest[i].first >> manifest[i].second;
+        bool refused = false;
+        for (int i=0; mServed && !refused && i<source.builds.size(); ++i)
+            refused = loadsCode(source.builds.at(i).args.list());
+        if (refused) {
+            error() << "Refusing to index" << source.sourceFile << "with arguments that load plugins";
+            String out;
+            Serializer serializer(out);
+            serializer << true << static_cast<time_t>(0) << IndexData() << MemoryMonitor::usage();
+            if (!mChannel.send(WorkerChannel::Finished, out))
+                break;
+            continue;
+        }
+        Map<Path, String> files;
+        if (!manifest.isEmpty() && !fetch(manifest, files))
+            break;
+
+        shared_ptr<Project> &project = mProjects[projectPath];
+        if (!project) {
+            project.reset(new Project(projectPath));
+            project->setWorker(this);
+        }
+        shared_ptr<IndexerJob> job = mServer->factory().createJob(project, static_cast<IndexerJob::Type>(jobType),
+                                                                  source);
+        if (job) {
+            job->setUnsavedFiles(files);
+            job->run();
+        } else {
+            error() << "Failed to create job for" << source;
+            String out;
+            Serializer serializer(out);
+            serializer << true << static_cast<time_t>(0) << IndexData() << MemoryMonitor::usage();
+            if (!mChannel.send(WorkerChannel::Finished, out))
+                break;
+        }
+    }
+}
+
+// Constant time so the secret can't be guessed a byte at a time
+static bool sameSecret(const String &a, const String &b)
+{
+    if (a.size() != b.size())
+        return false;
+    unsigned char diff = 0;
+    for (int i=0; i<a.size(); ++i)
+        diff |= static_cast<unsigned char>(a.at(i) ^ b.at(i));
+    return !diff;
+}
+
+int IndexerWorker::serve(const String &address, const Path &cacheDir, const String &secret, bool allowPublic,
+                         String &hello)
+{
+    assert(!secret.isEmpty());
+    const int server = WorkerChannel::listen(address, allowPublic);
+    if (server == -1) {
+        error("Can't listen on %s %d %s", address.constData(), errno, strerror(errno));
+        return -1;
+    }
+    // The cache is only good for one run of rdm
+    if (Path::mkdir(cacheDir)) {
+        const List<Path> files = cacheDir.files(Path::File);
+        for (int i=0; i<files.size(); ++i)
+            Path::rm(files.at(i));
+    }
+    signal(SIGCHLD, SIG_IGN);
+    warning("Waiting for rdm on %s", address.constData());
+    while (true) {
+        int fd;
+        eintrwrap(fd, ::accept(server, 0, 0));
+        if (fd == -1) {
+            error("Can't accept connection on %s %d %s", address.constData(), errno, strerror(errno));
+            return -1;
+        }
+        // Nothing is forked for peers that don't know the secret. They get a
+        // few seconds to say hello
+        timeval timeout = { HelloTimeout, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        WorkerChannel channel(fd);
+        int type;
+        String payload, peerSecret;
+        if (channel.receive(type, payload, WorkerChannel::MaxHelloSize) && type == WorkerChannel::Hello) {
+            Deserializer deserializer(payload.constData(), payload.size());
+            deserializer >> peerSecret;
+        }
+        if (!sameSecret(peerSecret, secret)) {
+            error("Dropping connection on %s without the right secret", address.constData());
+            channel.close();
+            continue;
+        }
+        const pid_t pid = fork();
+        if (!pid) {
+            ::close(server);
+            signal(SIGCHLD, SIG_DFL);
+            timeout.tv_sec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            hello = payload;
+            return fd;
+        } else if (pid == -1) {
+            error("Can't fork worker %d %s", errno, strerror(errno));
+        }
+        channel.close();
+    }
+}
+
+Path IndexerWorker::cacheFile(uint64_t hash) const
+{
+    return mCacheDir + String::format<32>("%llx", static_cast<unsigned long long>(hash));
+}
+
+uint64_t IndexerWorker::localHash(const Path &path)
+{
+    const time_t modified = path.lastModified();
+    if (!modified)
+        return 0;
+    std::pair<time_t, uint64_t> &cached = mLocalHashes[path];
+    if (cached.first != modified)
+        cached = std::make_pair(modified, RTags::hash(path.readAll()));
+    return cached.second;
+}
+
+bool IndexerWorker::fetch(const WorkerPool::Manifest &manifest, Map<Path, String> &files)
+{
+    List<Path> missing;
+    for (int i=0; i<manifest.size(); ++i) {
+        const Path &path = manifest.at(i).first;
+        const uint64_t hash = manifest.at(i).second;
+        if (mFetchMode == WorkerPool::FetchChanged && localHash(path) == hash)
+            continue; // clang reads it from disk
+        const Path cached = cacheFile(hash);
+        if (cached.isFile()) {
+            files[path] = cached.readAll();
+        } else {
+            missing.append(path);
+        }
+    }
+    if (missing.isEmpty())
+        return true;
+
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << missing;
+    }
+    String reply;
+    if (!request(WorkerChannel::Fetch, out, reply))
+        return false;
+    List<String> contents;
+    Deserializer deserializer(reply.constData(), reply.size());
+    deserializer >> contents;
+    if (contents.size() != missing.size()) {
+        error("Got %d files from rdm, expected %d", contents.size(), missing.size());
+        return false;
+    }
+    for (int i=0; i<missing.size(); ++i) {
+        const String &data = contents.at(i);
+        files[missing.at(i)] = data;
+        // other workers on this machine might be writing the same file
+        const Path cached = cacheFile(RTags::hash(data));
+        const Path tmp = cached + String::format<16>(".%d", getpid());
+        if (FILE *f = fopen(tmp.constData(), "w")) {
+            const bool written = fwrite(data.constData(), data.size(), 1, f) == 1 || data.isEmpty();
+            fclose(f);
+            if (!written || rename(tmp.constData(), cached.constData())) {
+                error("Can't write %s", cached.constData());
+                Path::rm(tmp);
+            }
+        }
+    }
+    return true;
+}
+
+// A request and its reply
+bool IndexerWorker::request(int type, const String &out, String &reply)
+{
+    MutexLocker lock(&mChannelMutex);
+    int replyType;
+    return mChannel.send(type, out) && mChannel.receive(replyType, reply) && replyType == type;
+}
+
+uint32_t IndexerWorker::resolveFileId(const Path &path)
+{
+    assert(sInstance);
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << path;
+    }
+    String reply;
+    if (!sInstance->request(WorkerChannel::FileId, out, reply))
+        return 0;
+    uint32_t fileId;
+    Deserializer deserializer(reply.constData(), reply.size());
+    deserializer >> fileId;
+    return fileId;
+}
+
+bool IndexerWorker::visitFile(uint32_t fileId)
+{
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << fileId;
+    }
+    String reply;
+    if (!request(WorkerChannel::VisitFile, out, reply))
+        return false;
+    bool visit;
+    Deserializer deserializer(reply.constData(), reply.size());
+    deserializer >> visit;
+    return visit;
+}
+
+void IndexerWorker::onJobFinished(const shared_ptr<IndexerJob> &job)
+{
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << job->isAborted() << job->parseTime() << *job->data() << MemoryMonitor::usage();
+    }
+    MutexLocker lock(&mChannelMutex);
+    mChannel.send(WorkerChannel::Finished, out);
+}
+
+void IndexerWorker::log(int level, const char *msg, int len)
+{
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << level << String(msg, len);
+    }
+    MutexLocker lock(&mChannelMutex);
+    mChannel.send(WorkerChannel::Log, out);
+}
@@ -0,0 +1,54 @@
+#ifndef IndexerWorker_h
+#define IndexerWorker_h
+
+#include "WorkerPool.h"
+#include <rct/Map.h>
+#include <rct/Mutex.h>
+#include <rct/Path.h>
+
+class IndexerJob;
+class Project;
+class Server;
+
+// The main loop of an rdm --worker process. Indexes one source file at a time
+// for the rdm on the other end of the channel, see IndexerJobWorker
+class IndexerWorker
+{
+public:
+    // Files fetched from rdm are kept in cacheDir by content hash
+    IndexerWorker(int fd, const Path &cacheDir);
+    ~IndexerWorker();
+    // hello is the Hello serve() already read and checked, otherwise it's
+    // read from the channel
+    int exec(const String &hello = String());
+
+    // rdm --worker-server. Accepts connections from rdm and forks a worker for
+    // each of them that sends secret in its Hello. Only returns in the
+    // workers, with the connection and its Hello
+    static int serve(const String &address, const Path &cacheDir, const String &secret, bool allowPublic,
+                     String &hello);
+
+    bool visitFile(uint32_t fileId);
+    void onJobFinished(const shared_ptr<IndexerJob> &job);
+    void log(int level, const char *msg, int len);
+private:
+    static void *threadFunc(void *userData);
+    static uint32_t resolveFileId(const Path &path);
+    void run();
+    bool request(int type, const String &out, String &reply);
+    bool fetch(const WorkerPool::Manifest &manifest, Map<Path, String> &files);
+    uint64_t localHash(const Path &path);
+    Path cacheFile(uint64_t hash) const;
+
+    static IndexerWorker *sInstance;
+    WorkerChannel mChannel;
+    Mutex mChannelMutex; // the visitor threads share the channel
+    const Path mCacheDir;
+    int mFetchMode;
+    bool mServed; // the peer is another machine's rdm, don't let it load code
+    Map<Path, std::pair<time_t, uint64_t> > mLocalHashes;
+    shared_ptr<Server> mServer;
+    Map<Path, shared_ptr<Project> > mProjects;
+};
+
+#endif
@@ -6,6 +6,7 @@ Map<Path, uint32_t> Location::sPathsToIds;
 Map<uint32_t, Path> Location::sIdsToPaths;
 uint32_t Location::sLastId = 0;
 ReadWriteLock Location::sLock;
+Location::FileIdResolver Location::sFileIdResolver = 0;
 
 String Location::key(unsigned flags) const
 {
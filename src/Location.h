@@ -69,18 +69,30 @@ public:
 
     static inline uint32_t insertFile(const Path &path)
     {
-        uint32_t ret;
-        {
-            WriteLocker lock(&sLock);
-            uint32_t &id = sPathsToIds[path];
-            if (!id) {
-                id = ++sLastId;
+        if (sFileIdResolver) {
+            {
+                ReadLocker lock(&sLock);
+                const uint32_t id = sPathsToIds.value(path);
+                if (id)
+                    return id;
+            }
+            // a round trip to rdm, don't block the other threads meanwhile.
+            // rdm hands out one id per path so racing for it is harmless
+            const uint32_t id = sFileIdResolver(path);
+            if (id) {
+                WriteLocker lock(&sLock);
+                sPathsToIds[path] = id;
                 sIdsToPaths[id] = path;
             }
-            ret = id;
+            return id;
         }
-
-        return ret;
+        WriteLocker lock(&sLock);
+        uint32_t &id = sPathsToIds[path];
+        if (!id) {
+            id = ++sLastId;
+            sIdsToPaths[id] = path;
+        }
+        return id;
     }
 
     inline uint32_t fileId() const { return uint32_t(mData); }
@@ -239,7 +251,11 @@ public:
             sIdsToPaths[it->second] = it->first;
         }
     }
+    // rdm --worker processes get their file ids from the rdm they index for
+    typedef uint32_t (*FileIdResolver)(const Path &path);
+    static void setFileIdResolver(FileIdResolver resolver) { sFileIdResolver = resolver; }
 private:
+    static FileIdResolver sFileIdResolver;
     static Map<Path, uint32_t> sPathsToIds;
     static Map<uint32_t, Path> sIdsToPaths;
     static uint32_t sLastId;
@@ -0,0 +1,153 @@
+#include "PathIndex.h"
+#include <rct/MutexLocker.h>
+#include <algorithm>
+#include <iterator>
+#include <ctype.h>
+#include <string.h>
+
+PathIndex::PathIndex()
+    : mRemoved(0)
+{
+}
+
+inline uint32_t PathIndex::trigram(const char *data)
+{
+    return (static_cast<uint32_t>(tolower(static_cast<unsigned char>(data[0]))) << 16)
+        | (static_cast<uint32_t>(tolower(static_cast<unsigned char>(data[1]))) << 8)
+        | static_cast<uint32_t>(tolower(static_cast<unsigned char>(data[2])));
+}
+
+void PathIndex::add(int id)
+{
+    const String &path = mPaths.at(id);
+    const int size = path.size();
+    if (size < 3)
+        return;
+    List<uint32_t> trigrams(size - 2);
+    for (int i=0; i<size - 2; ++i)
+        trigrams[i] = trigram(path.constData() + i);
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    for (int i=0; i<trigrams.size(); ++i)
+        mPostings[trigrams.at(i)].append(id);
+}
+
+void PathIndex::insert(const String &path)
+{
+    MutexLocker lock(&mMutex);
+    int &id = mIds[path];
+    if (id)
+        return;
+    id = mPaths.size() + 1; // 0 means not there
+    mPaths.append(path);
+    add(id - 1);
+}
+
+void PathIndex::remove(const String &path)
+{
+    MutexLocker lock(&mMutex);
+    Map<String, int>::iterator it = mIds.find(path);
+    if (it == mIds.end())
+        return;
+    mPaths[it->second - 1].clear();
+    mIds.erase(it);
+    if (++mRemoved > 1024 && mRemoved > static_cast<int>(mIds.size()))
+        compact();
+}
+
+void PathIndex::compact()
+{
+    List<String> paths;
+    paths.reserve(mIds.size());
+    for (int i=0; i<mPaths.size(); ++i) {
+        if (!mPaths.at(i).isEmpty())
+            paths.append(mPaths.at(i));
+    }
+    std::swap(mPaths, paths);
+    mPostings.clear();
+    mRemoved = 0;
+    for (int i=0; i<mPaths.size(); ++i) {
+        mIds[mPaths.at(i)] = i + 1;
+        add(i);
+    }
+}
+
+void PathIndex::clear()
+{
+    MutexLocker lock(&mMutex);
+    mPaths.clear();
+    mIds.clear();
+    mPostings.clear();
+    mRemoved = 0;
+}
+
+int PathIndex::count() const
+{
+    MutexLocker lock(&mMutex);
+    return mIds.size();
+}
+
+static inline bool lessBySize(const List<int> *left, const List<int> *right)
+{
+    return left->size() < right->size();
+}
+
+static inline bool isExact(const String &path, const String &pattern, bool caseInsensitive)
+{
+    const int size = path.size();
+    const int patternSize = pattern.size();
+    if (size < patternSize || (size > patternSize && path.at(size - patternSize - 1) != '/'))
+        return false;
+    const char *tail = path.constData() + size - patternSize;
+    return !(caseInsensitive ? strncasecmp(tail, pattern.constData(), patternSize)
+             : strncmp(tail, pattern.constData(), patternSize));
+}
+
+bool PathIndex::find(const String &pattern, unsigned flags, List<String> &paths) const
+{
+    const int size = pattern.size();
+    if (size < 3)
+        return false;
+    const bool caseInsensitive = flags & CaseInsensitive;
+    const String::CaseSensitivity cs = caseInsensitive ? String::CaseInsensitive : String::CaseSensitive;
+
+    MutexLocker lock(&mMutex);
+    List<const List<int> *> postings;
+    for (int i=0; i<size - 2; ++i) {
+        const Map<uint32_t, List<int> >::const_iterator it = mPostings.find(trigram(pattern.constData() + i));
+        if (it == mPostings.end())
+            return true;
+        postings.append(&it->second);
+    }
+    // intersect the rarest trigrams first to keep the candidates few
+    std::sort(postings.begin(), postings.end(), lessBySize);
+    List<int> candidates = *postings.at(0);
+    List<int> intersection;
+    for (int i=1; i<postings.size() && !candidates.isEmpty(); ++i) {
+        if (postings.at(i) == postings.at(i - 1))
+            continue;
+        intersection.clear();
+        std::set_intersection(candidates.begin(), candidates.end(), postings.at(i)->begin(), postings.at(i)->end(),
+                              std::back_inserter(intersection));
+        std::swap(candidates, intersection);
+    }
+
+    bool foundExact = false;
+    const bool preferExact = flags & PreferExact;
+    for (int i=0; i<candidates.size(); ++i) {
+        const String &path = mPaths.at(candidates.at(i));
+        if (path.isEmpty() || !path.contains(pattern, cs))
+            continue;
+        if (preferExact && isExact(path, pattern, caseInsensitive)) {
+            if (!foundExact) {
+                paths.clear();
+                foundExact = true;
+            }
+        } else if (foundExact) {
+            continue;
+        }
+        paths.append(path);
+    }
+    std::sort(paths.begin(), paths.end());
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef PathIndex_h
+#define PathIndex_h
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Mutex.h>
+#include <rct/String.h>
+
+// Trigram index over the project's files, relative to the project root.
+// Every path has an id, each case folded trigram lists the ids of the paths
+// containing it. Removed paths leave their ids in the posting lists until
+// there are enough of them to compact
+class PathIndex
+{
+public:
+    PathIndex();
+
+    void insert(const String &path);
+    void remove(const String &path);
+    void clear();
+    int count() const;
+
+    enum Flag {
+        None = 0x0,
+        CaseInsensitive = 0x1,
+        // only return the paths whose file name is the pattern, if any
+        PreferExact = 0x2
+    };
+    // Sorted paths containing pattern. Returns false for patterns too short
+    // to have a trigram, those need a full walk
+    bool find(const String &pattern, unsigned flags, List<String> &paths) const;
+private:
+    static uint32_t trigram(const char *data);
+    void add(int id);
+    void compact();
+
+    List<String> mPaths; // by id, empty once removed
+    Map<String, int> mIds;
+    Map<uint32_t, List<int> > mPostings; // sorted since ids only grow
+    int mRemoved;
+    mutable Mutex mMutex;
+};
+
+#endif
@@ -0,0 +1,489 @@
+#include "PreambleCache.h"
+#include "RTags.h"
+#include "RTagsClang.h"
+#include <rct/Log.h>
+#include <rct/Rct.h>
+#include <rct/Serializer.h>
+#include <rct/StopWatch.h>
+#include <clang-c/Index.h>
+#include <algorithm>
+
+enum {
+    ValidateInterval = 1000,
+    RetryInterval = 60000, // a failed preamble may be missing headers that show up later
+    IndexVersion = 1
+};
+
+PreambleCache::PreambleCache()
+    : mMaxSize(0)
+{
+}
+
+PreambleCache::~PreambleCache()
+{
+    save();
+}
+
+void PreambleCache::init(const Path &dir, int64_t maxSize)
+{
+    MutexLocker lock(&mMutex);
+    mMaxSize = maxSize;
+    if (!mMaxSize)
+        return;
+    if (!Path::mkdir(dir)) {
+        error("Can't create directory [%s], disabling preamble cache", dir.constData());
+        mMaxSize = 0;
+        return;
+    }
+    mDir = dir.resolved();
+    if (!mDir.endsWith('/'))
+        mDir.append('/');
+
+    restore();
+    evict(0);
+
+    // leftovers from a previous run that didn't make it into the index
+    Set<Path> keep;
+    keep.insert(mDir + "index");
+    for (Map<uint64_t, Entry>::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+        keep.insert(it->second.preamble.header);
+        keep.insert(it->second.preamble.pch);
+    }
+    const List<Path> files = mDir.files(Path::File);
+    for (int i=0; i<files.size(); ++i) {
+        if (!keep.contains(files.at(i)))
+            Path::rm(files.at(i));
+    }
+}
+
+void PreambleCache::save()
+{
+    // whoever gets here last writes what the index looks like by then
+    MutexLocker saveLock(&mSaveMutex);
+    Path p;
+    List<Entry> entries;
+    {
+        MutexLocker lock(&mMutex);
+        if (!isEnabled())
+            return;
+        p = mDir + "index";
+        // least recently used first so that eviction order survives
+        List<std::pair<uint64_t, uint64_t> > order;
+        for (Map<uint64_t, Entry>::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+            if (it->second.usable)
+                order.append(std::make_pair(it->second.lastUsed, it->first));
+        }
+        std::sort(order.begin(), order.end());
+        entries.reserve(order.size());
+        for (int i=0; i<order.size(); ++i)
+            entries.append(mEntries.value(order.at(i).second));
+    }
+
+    FILE *f = fopen(p.constData(), "w");
+    if (!f) {
+        error("Can't open file %s", p.constData());
+        return;
+    }
+    Serializer out(f);
+    out << static_cast<int>(IndexVersion);
+    const int pos = ftell(f);
+    out << static_cast<int>(0) << RTags::eatString(clang_getClangVersion()) << static_cast<int>(entries.size());
+    for (int i=0; i<entries.size(); ++i) {
+        const Entry &entry = entries.at(i);
+        out << entry.preamble.key << entry.preamble.header << entry.preamble.pch << entry.preamble.includes
+            << entry.size << static_cast<int>(entry.files.size());
+        for (Map<Path, File>::const_iterator it = entry.files.begin(); it != entry.files.end(); ++it)
+            out << it->first << static_cast<int64_t>(it->second.modified) << it->second.hash;
+    }
+    const int size = ftell(f);
+    fseek(f, pos, SEEK_SET);
+    out << size;
+    fclose(f);
+}
+
+void PreambleCache::restore()
+{
+    const Path p = mDir + "index";
+    FILE *f = fopen(p.constData(), "r");
+    if (!f)
+        return;
+    Deserializer in(f);
+    int version;
+    in >> version;
+    if (version == IndexVersion) {
+        int size;
+        in >> size;
+        if (size != Rct::fileSize(f)) {
+            error("Refusing to load corrupted file %s", p.constData());
+            fclose(f);
+            return;
+        }
+        String clangVersion;
+        in >> clangVersion;
+        if (clangVersion != RTags::eatString(clang_getClangVersion())) {
+            warning() << "Discarding preambles built by" << clangVersion;
+        } else {
+            int count;
+            in >> count;
+            for (int i=0; i<count; ++i) {
+                Entry entry;
+                int fileCount;
+                in >> entry.preamble.key >> entry.preamble.header >> entry.preamble.pch >> entry.preamble.includes
+                   >> entry.size >> fileCount;
+                for (int j=0; j<fileCount; ++j) {
+                    Path path;
+                    int64_t modified;
+                    uint64_t hash;
+                    in >> path >> modified >> hash;
+                    File &file = entry.files[path];
+                    file.modified = static_cast<time_t>(modified);
+                    file.hash = hash;
+                }
+                entry.usable = entry.restored = true;
+                entry.lastUsed = i;
+                if (entry.preamble.pch.isFile()) {
+                    mStats.size += entry.size;
+                    mEntries[entry.preamble.key] = entry;
+                }
+            }
+            warning() << "Restored" << mEntries.size() << "preambles from" << mDir;
+        }
+    }
+    fclose(f);
+}
+
+int PreambleCache::preambleSize(const String &contents, bool *quotedIncludes)
+{
+    const char *data = contents.constData();
+    const int size = contents.size();
+    int depth = 0, end = 0, i = 0;
+    bool includes = false;
+    if (quotedIncludes)
+        *quotedIncludes = false;
+    while (i < size) {
+        const char ch = data[i];
+        if (isspace(ch)) {
+            ++i;
+        } else if (ch == '/' && i + 1 < size && data[i + 1] == '/') {
+            while (i < size && data[i] != '\n')
+                ++i;
+        } else if (ch == '/' && i + 1 < size && data[i + 1] == '*') {
+            const char *commentEnd = strstr(data + i + 2, "*/");
+            if (!commentEnd)
+                break;
+            i = commentEnd - data + 2;
+        } else if (ch == '#') {
+            int lineEnd = i;
+            while (lineEnd < size && data[lineEnd] != '\n') {
+                if (data[lineEnd] == '\\' && lineEnd + 1 < size && data[lineEnd + 1] == '\n') {
+                    lineEnd += 2;
+                } else {
+                    ++lineEnd;
+                }
+            }
+            int d = i + 1;
+            while (d < lineEnd && (data[d] == ' ' || data[d] == '\t'))
+                ++d;
+            const char *directive = data + d;
+            if (!strncmp(directive, "if", 2)) { // if, ifdef, ifndef
+                ++depth;
+            } else if (!strncmp(directive, "endif", 5)) {
+                if (!depth)
+                    break;
+                --depth;
+            } else if (!strncmp(directive, "include", 7) || !strncmp(directive, "import", 6)) {
+                includes = true;
+                if (quotedIncludes && memchr(directive, '"', lineEnd - d))
+                    *quotedIncludes = true;
+            }
+            i = lineEnd;
+            if (!depth)
+                end = std::min(size, lineEnd + 1);
+        } else {
+            break;
+        }
+    }
+    return includes ? end : 0;
+}
+
+static String headerLanguage(const Path &sourceFile, const List<String> &args)
+{
+    for (int i=args.size() - 2; i>=0; --i) {
+        if (args.at(i) == "-x")
+            return args.at(i + 1) + "-header";
+    }
+    if (const char *ext = sourceFile.extension()) {
+        if (!strcmp(ext, "c"))
+            return "c-header";
+        if (!strcmp(ext, "m"))
+            return "objective-c-header";
+        if (!strcmp(ext, "mm"))
+            return "objective-c++-header";
+    }
+    return "c++-header";
+}
+
+bool PreambleCache::find(const Path &sourceFile, const String &contents, const List<String> &args, Preamble &preamble)
+{
+    if (!isEnabled())
+        return false;
+    bool quoted;
+    const int size = preambleSize(contents, &quoted);
+    if (!size)
+        return false;
+    const String text = contents.left(size);
+    uint64_t key = RTags::hash(text, RTags::hash(args, RTags::hash(headerLanguage(sourceFile, args))));
+    if (quoted) // "foo.h" is looked up relative to the source file
+        key = RTags::hash(sourceFile.parentDir(), key);
+    if (!key)
+        key = 1;
+
+    const uint64_t now = Rct::monoMs();
+    Entry validated;
+    bool validate = false;
+    {
+        MutexLocker lock(&mMutex);
+        Map<uint64_t, Entry>::const_iterator it = mEntries.find(key);
+        if (it != mEntries.end() && (it->second.usable || now - it->second.failed < RetryInterval)
+            && now - it->second.lastValidated >= ValidateInterval) {
+            validated = it->second;
+            validate = true;
+        }
+    }
+    // stat and hash the headers without blocking other lookups
+    const bool headersValid = !validate || isValid(validated);
+
+    {
+        MutexLocker lock(&mMutex);
+        Map<uint64_t, Entry>::iterator it = mEntries.find(key);
+        if (it != mEntries.end()) {
+            Entry &entry = it->second;
+            bool valid = entry.usable || now - entry.failed < RetryInterval;
+            // only apply the result if nobody rebuilt or validated the entry in the meantime
+            if (valid && validate && entry.lastValidated == validated.lastValidated) {
+                valid = headersValid;
+                if (valid) {
+                    entry.lastValidated = now;
+                    entry.restored = false;
+                }
+            }
+            if (valid) {
+                if (!entry.usable)
+                    return false;
+                entry.lastUsed = now;
+                ++mStats.hits;
+                preamble = entry.preamble;
+                return true;
+            }
+            purge(entry);
+            if (entry.usable)
+                mStats.size -= entry.size;
+            mEntries.erase(it);
+        }
+        ++mStats.misses;
+        if (!mBuilding.insert(key))
+            return false;
+    }
+
+    Entry entry;
+    const bool ok = build(sourceFile, text, args, key, entry);
+
+    {
+        MutexLocker lock(&mMutex);
+        mBuilding.remove(key);
+        entry.usable = ok;
+        entry.lastUsed = entry.lastValidated = Rct::monoMs();
+        if (ok) {
+            ++mStats.builds;
+            mStats.size += entry.size;
+            preamble = entry.preamble;
+        } else {
+            ++mStats.failures;
+            entry.failed = entry.lastUsed;
+            purge(entry);
+        }
+        mEntries[key] = entry;
+        evict(key);
+    }
+    if (ok)
+        save();
+    return ok;
+}
+
+void PreambleCache::remove(uint64_t key)
+{
+    MutexLocker lock(&mMutex);
+    Map<uint64_t, Entry>::iterator it = mEntries.find(key);
+    if (it != mEntries.end() && it->second.usable) {
+        purge(it->second);
+        mStats.size -= it->second.size;
+        // keep it around so we don't rebuild it until one of the headers change
+        it->second.usable = false;
+        it->second.failed = Rct::monoMs();
+        ++mStats.failures;
+    }
+}
+
+struct InclusionUserData
+{
+    CXTranslationUnit unit;
+    PreambleCache::Preamble *preamble;
+    Map<Path, PreambleCache::File> *files;
+    bool guarded;
+};
+
+static void inclusionVisitor(CXFile includedFile, CXSourceLocation *includeStack,
+                             unsigned includeLen, CXClientData userData)
+{
+    if (!includeLen) // the preamble itself
+        return;
+    InclusionUserData *u = reinterpret_cast<InclusionUserData*>(userData);
+    const Path path = Path::resolved(RTags::eatString(clang_getFileName(includedFile)));
+    PreambleCache::File &file = (*u->files)[path];
+    file.modified = clang_getFileTime(includedFile);
+    file.hash = RTags::hash(path.readAll());
+    // The source file includes these headers again after the pch. System
+    // headers like assert.h are meant to be included many times
+    if (!path.isSystem() && !clang_isFileMultipleIncludeGuarded(u->unit, includedFile))
+        u->guarded = false;
+    Set<Path> &includers = u->preamble->includes[path];
+    for (unsigned i=0; i<includeLen; ++i) {
+        CXFile file;
+        clang_getSpellingLocation(includeStack[i], &file, 0, 0, 0);
+        if (file)
+            includers.insert(Path::resolved(RTags::eatString(clang_getFileName(file))));
+    }
+}
+
+bool PreambleCache::build(const Path &sourceFile, const String &text, const List<String> &args,
+                          uint64_t key, Entry &entry)
+{
+    StopWatch timer;
+    Preamble &preamble = entry.preamble;
+    preamble.key = key;
+    preamble.header = mDir + String::format<32>("%llx.h", static_cast<unsigned long long>(key));
+    preamble.pch = mDir + String::format<32>("%llx.pch", static_cast<unsigned long long>(key));
+
+    FILE *f = fopen(preamble.header.constData(), "w");
+    if (!f) {
+        error("Can't open %s for writing", preamble.header.constData());
+        return false;
+    }
+    const bool written = fwrite(text.constData(), text.size(), 1, f) == 1;
+    fclose(f);
+    if (!written) {
+        error("Can't write %s", preamble.header.constData());
+        return false;
+    }
+
+    List<String> pchArgs;
+    for (int i=0; i<args.size(); ++i) {
+        if (args.at(i) == "-x") {
+            ++i;
+        } else {
+            pchArgs.append(args.at(i));
+        }
+    }
+    pchArgs << "-iquote" << sourceFile.parentDir() << "-x" << headerLanguage(sourceFile, args);
+
+    CXIndex index = clang_createIndex(0, 0);
+    CXTranslationUnit unit = 0;
+    String clangLine;
+    RTags::parseTranslationUnit(preamble.header, pchArgs, unit, index, clangLine,
+                                0, 0, 0, 0, RTags::PrecompiledHeader);
+    bool ok = false;
+    if (unit) {
+        InclusionUserData userData = { unit, &preamble, &entry.files, true };
+        clang_getInclusions(unit, inclusionVisitor, &userData);
+        ok = userData.guarded;
+        const unsigned diagnosticCount = clang_getNumDiagnostics(unit);
+        for (unsigned i=0; ok && i<diagnosticCount; ++i) {
+            CXDiagnostic diagnostic = clang_getDiagnostic(unit, i);
+            if (clang_getDiagnosticSeverity(diagnostic) >= CXDiagnostic_Error)
+                ok = false;
+            clang_disposeDiagnostic(diagnostic);
+        }
+        if (ok && clang_saveTranslationUnit(unit, preamble.pch.constData(),
+                                            clang_defaultSaveOptions(unit)) != CXSaveError_None) {
+            error() << "Failed to save preamble" << preamble.pch << "for" << sourceFile;
+            ok = false;
+        }
+        clang_disposeTranslationUnit(unit);
+    } else {
+        error() << "Failed to parse preamble" << clangLine;
+    }
+    clang_disposeIndex(index);
+
+    if (ok) {
+        if (FILE *pch = fopen(preamble.pch.constData(), "r")) {
+            entry.size = Rct::fileSize(pch);
+            fclose(pch);
+        }
+        warning() << "Built preamble" << preamble.pch << "for" << sourceFile << "with"
+                  << entry.files.size() << "headers in" << timer.elapsed() << "ms";
+    }
+    return ok;
+}
+
+bool PreambleCache::isValid(const Entry &entry) // lock never held
+{
+    for (Map<Path, File>::const_iterator it = entry.files.begin(); it != entry.files.end(); ++it) {
+        // clang validates the pch against the mtimes of its inputs so a
+        // touched header invalidates it even if the contents are the same
+        if (it->first.lastModified() != it->second.modified)
+            return false;
+        // nothing was watching the headers while rdm was down
+        if (entry.restored && RTags::hash(it->first.readAll()) != it->second.hash)
+            return false;
+    }
+    return !entry.usable || entry.preamble.pch.isFile();
+}
+
+void PreambleCache::purge(const Entry &entry)
+{
+    if (!entry.preamble.header.isEmpty())
+        Path::rm(entry.preamble.header);
+    if (!entry.preamble.pch.isEmpty())
+        Path::rm(entry.preamble.pch);
+}
+
+void PreambleCache::evict(uint64_t keep) // lock always held
+{
+    while (mStats.size > mMaxSize) {
+        Map<uint64_t, Entry>::iterator oldest = mEntries.end();
+        for (Map<uint64_t, Entry>::iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+            if (it->second.usable && it->first != keep
+                && (oldest == mEntries.end() || it->second.lastUsed < oldest->second.lastUsed)) {
+                oldest = it;
+            }
+        }
+        if (oldest == mEntries.end())
+            break;
+        purge(oldest->second);
+        mStats.size -= oldest->second.size;
+        ++mStats.evictions;
+        mEntries.erase(oldest);
+    }
+}
+
+PreambleCache::Stats PreambleCache::stats() const
+{
+    MutexLocker lock(&mMutex);
+    Stats ret = mStats;
+    for (Map<uint64_t, Entry>::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+        if (it->second.usable)
+            ++ret.entries;
+    }
+    return ret;
+}
+
+List<std::pair<Path, int64_t> > PreambleCache::entries() const
+{
+    MutexLocker lock(&mMutex);
+    List<std::pair<Path, int64_t> > ret;
+    for (Map<uint64_t, Entry>::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+        if (it->second.usable)
+            ret.append(std::make_pair(it->second.preamble.pch, it->second.size));
+    }
+    return ret;
+}
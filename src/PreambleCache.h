@@ -0,0 +1,88 @@
+#ifndef PreambleCache_h
+#define PreambleCache_h
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Mutex.h>
+#include <rct/Path.h>
+#include <rct/Set.h>
+#include <rct/String.h>
+
+// Precompiled headers for the leading #include block of source files. Source
+// files with the same preamble and the same arguments share one pch which
+// clang loads with -include-pch instead of parsing the headers again. The
+// pchs are kept in dir across restarts along with an index of them.
+class PreambleCache
+{
+public:
+    PreambleCache();
+    ~PreambleCache();
+
+    void init(const Path &dir, int64_t maxSize);
+    bool isEnabled() const { return mMaxSize > 0; }
+
+    struct Preamble
+    {
+        Preamble() : key(0) {}
+        bool isNull() const { return !key; }
+
+        uint64_t key;
+        Path header, pch;
+        // header -> files that include it, the preamble itself shows up as header
+        Map<Path, Set<Path> > includes;
+    };
+
+    // Returns true if there's an up to date pch for sourceFile. If not the
+    // pch is built here unless someone else is already building it
+    bool find(const Path &sourceFile, const String &contents, const List<String> &args, Preamble &preamble);
+    void remove(uint64_t key);
+
+    struct Stats
+    {
+        Stats() : hits(0), misses(0), builds(0), failures(0), evictions(0), entries(0), size(0) {}
+        int hits, misses, builds, failures, evictions, entries;
+        int64_t size;
+    };
+    Stats stats() const;
+    List<std::pair<Path, int64_t> > entries() const;
+
+    // Size in bytes of the leading block of preprocessor directives and
+    // comments in contents, 0 if there are no includes in it
+    static int preambleSize(const String &contents, bool *quotedIncludes = 0);
+
+    struct File
+    {
+        File() : modified(0), hash(0) {}
+        time_t modified;
+        uint64_t hash; // of the contents
+    };
+private:
+    struct Entry
+    {
+        Entry() : size(0), lastUsed(0), lastValidated(0), failed(0), usable(false), restored(false) {}
+
+        Preamble preamble;
+        Map<Path, File> files;
+        int64_t size;
+        uint64_t lastUsed, lastValidated, failed;
+        bool usable;
+        bool restored; // from a previous run, the headers are checked by contents too
+    };
+
+    bool build(const Path &sourceFile, const String &text, const List<String> &args, uint64_t key, Entry &entry);
+    static bool isValid(const Entry &entry); // lock never held
+    void save(); // lock never held
+    void restore(); // lock always held
+    void purge(const Entry &entry);
+    void evict(uint64_t keep); // lock always held
+
+    Path mDir;
+    int64_t mMaxSize;
+    Map<uint64_t, Entry> mEntries;
+    Set<uint64_t> mBuilding;
+    Stats mStats;
+    mutable Mutex mMutex;
+    Mutex mSaveMutex; // only one writer of the index at a time
+};
+
+#endif
@@ -18,7 +18,7 @@ Preprocessor::~Preprocessor()
 
 void Preprocessor::preprocess()
 {
-    List<String> args = mArgs.builds.at(mBuildIndex).args;
+    List<String> args = mArgs.builds.at(mBuildIndex).args.list();
     args.append("-E");
     args.append(mArgs.sourceFile);
     List<String> environ;
@@ -29,7 +29,7 @@ void Preprocessor::preprocess()
 void Preprocessor::onProcessFinished(Process *)
 {
     mConnection->write<256>("// %s %s", mArgs.builds.at(mBuildIndex).compiler.constData(),
-                            String::join(mArgs.builds.at(mBuildIndex).args, ' ').constData());
+                            String::join(mArgs.builds.at(mBuildIndex).args.list(), ' ').constData());
     mConnection->write(mProc->readAllStdOut());
     const String err = mProc->readAllStdErr();
     if (!err.isEmpty()) {
@@ -1,4 +1,5 @@
 #include "Project.h"
+#include "CompletionJob.h"
 #include "FileManager.h"
 #include "IndexerJob.h"
 #include <rct/Rct.h>
@@ -12,9 +13,12 @@
 #include "Server.h"
 #include "ValidateDBJob.h"
 #include "IndexerJobClang.h"
+#include "IndexerJobWorker.h"
+#include "IndexerWorker.h"
 #include <rct/WriteLocker.h>
 #include "ReparseJob.h"
 #include <math.h>
+#include <algorithm>
 
 static void *ModifiedFiles = &ModifiedFiles;
 static void *Save = &Save;
@@ -27,7 +31,7 @@ enum {
 };
 
 Project::Project(const Path &path)
-    : mPath(path), mJobCounter(0)
+    : mPath(path), mJobCounter(0), mAvoidedJobs(0), mWorker(0)
 {
     mWatcher.modified().connect(this, &Project::onFileModified);
     mWatcher.removed().connect(this, &Project::onFileModified);
@@ -44,6 +48,53 @@ void Project::init()
     fileManager->init(static_pointer_cast<Project>(shared_from_this()));
 }
 
+// The database has each distinct argument list once, builds refer to them by
+// their key
+static void writeSources(Serializer &out, const SourceInformationMap &sources)
+{
+    Map<uint64_t, List<String> > arguments;
+    for (SourceInformationMap::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+        const List<SourceInformation::Build> &builds = it->second.builds;
+        for (int i=0; i<builds.size(); ++i) {
+            if (!builds.at(i).args.isEmpty() && !arguments.contains(builds.at(i).args.key()))
+                arguments[builds.at(i).args.key()] = builds.at(i).args.list();
+        }
+    }
+    out << arguments << sources.size();
+    for (SourceInformationMap::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+        const SourceInformation &source = it->second;
+        out << it->first << source.sourceFile << source.parsed << source.builds.size();
+        for (int i=0; i<source.builds.size(); ++i)
+            out << source.builds.at(i).compiler << source.builds.at(i).args.key();
+    }
+}
+
+static void readSources(Deserializer &in, SourceInformationMap &sources)
+{
+    Map<uint64_t, CompileArguments> arguments;
+    {
+        Map<uint64_t, List<String> > lists;
+        in >> lists;
+        for (Map<uint64_t, List<String> >::const_iterator it = lists.begin(); it != lists.end(); ++it)
+            arguments[it->first] = CompileArguments(it->second);
+    }
+    int count;
+    in >> count;
+    for (int i=0; i<count; ++i) {
+        uint32_t fileId;
+        in >> fileId;
+        SourceInformation &source = sources[fileId];
+        int builds;
+        in >> source.sourceFile >> source.parsed >> builds;
+        source.builds.resize(builds);
+        for (int b=0; b<builds; ++b) {
+            uint64_t key;
+            in >> source.builds[b].compiler >> key;
+            source.builds[b].args = arguments.value(key);
+        }
+    }
+}
+
 bool Project::restore()
 {
     StopWatch timer;
@@ -75,7 +126,14 @@ bool Project::restore()
     }
     {
 
-        in >> mSymbols >> mSymbolNames >> mUsr >> mDependencies >> mSources >> mVisitedFiles;
+        in >> mSymbols >> mSymbolNames >> mUsr >> mDependencies;
+        readSources(in, mSources);
+        in >> mVisitedFiles >> mFileHashes >> mSignatures >> mUsedNames >> mDeclarationFiles >> mSecondPass;
+
+        // the file manager only rescans the directories that changed since
+        DirectoryMap directories;
+        in >> mFiles >> directories;
+        fileManager->restore(directories);
 
         DependencyMap reversedDependencies;
         // these dependencies are in the form of:
@@ -113,7 +171,7 @@ bool Project::restore()
                     assert(mDependencies.contains(it->first));
                     const Set<uint32_t> &deps = reversedDependencies[it->first];
                     for (Set<uint32_t>::const_iterator d = deps.begin(); d != deps.end(); ++d) {
-                        if (!mModifiedFiles.contains(*d) && Location::path(*d).lastModified() > parsed) {
+                        if (!mModifiedFiles.contains(*d) && Location::path(*d).lastModified() > parsed && isModified(*d)) {
                             // error() << Location::path(*d).lastModified() << "is more than" << parsed;
                             mModifiedFiles.insert(*d);
                         }
@@ -124,6 +182,8 @@ bool Project::restore()
         }
         if (!mModifiedFiles.isEmpty())
             startDirtyJobs();
+        if (!mSecondPass.isEmpty())
+            startSecondPass();
     }
 end:
     // fileManager->jsFilesChanged().connect(this, &Project::onJSFilesAdded);
@@ -178,17 +238,43 @@ bool Project::match(const Match &p, bool *indexed) const
     return ret;
 }
 
+bool Project::visitFile(uint32_t fileId)
+{
+    if (mWorker)
+        return mWorker->visitFile(fileId);
+
+    MutexLocker lock(&mMutex);
+    if (mVisitedFiles.contains(fileId)) {
+        return false;
+    }
+
+    mVisitedFiles.insert(fileId);
+    return true;
+}
+
 void Project::onJobFinished(const shared_ptr<IndexerJob> &job)
 {
+    if (mWorker) {
+        mWorker->onJobFinished(job);
+        return;
+    }
     PendingJob pending;
     const Path currentFile = Server::instance()->currentFile();
     bool startPending = false;
+    List<SourceInformation> reindex;
+    bool secondPass = false;
     {
         MutexLocker lock(&mMutex);
 
         const uint32_t fileId = job->fileId();
+        if (mSecondPassJobs.contains(fileId)) {
+            mSecondPassJobs.remove(fileId);
+            secondPass = true;
+        }
         if (job->isAborted()) {
             mVisitedFiles -= job->visitedFiles();
+            if (secondPass) // its files were unvisited already, just try again
+                mSecondPass[fileId];
             --mJobCounter;
             pending = mPendingJobs.take(fileId, &startPending);
             if (mJobs.value(fileId) == job)
@@ -199,15 +285,22 @@ void Project::onJobFinished(const shared_ptr<IndexerJob> &job)
 
             shared_ptr<IndexData> data = job->data();
             mPendingData[fileId] = data;
+            if (!mProbes.isEmpty())
+                checkProbes(data, fileId, reindex);
+            if (job->type() == IndexerJob::Declarations) {
+                mDeclarationFiles += job->visitedFiles();
+                mSecondPass[fileId] = job->visitedFiles();
+            } else {
+                mDeclarationFiles -= job->visitedFiles();
+            }
             if (data->type == IndexData::ClangType) {
                 shared_ptr<IndexDataClang> clangData = static_pointer_cast<IndexDataClang>(data);
-                if (Server::instance()->options().completionCacheSize > 0)  {
+                // units without function bodies are no good for completion
+                if (Server::instance()->options().completionCacheSize > 0 && job->type() != IndexerJob::Declarations)  {
                     const SourceInformation sourceInfo = job->sourceInformation();
                     assert(sourceInfo.builds.size() == clangData->units.size());
                     for (int i=0; i<sourceInfo.builds.size(); ++i) {
-                        LinkedList<CachedUnit*>::iterator it = findCachedUnit(sourceInfo.sourceFile, sourceInfo.builds.at(i).args);
-                        if (it != mCachedUnits.end())
-                            mCachedUnits.erase(it);
+                        mUnitCache.remove(sourceInfo.sourceFile, sourceInfo.builds.at(i).args);
                         if (!i && currentFile == sourceInfo.sourceFile) {
                             shared_ptr<ReparseJob> rj(new ReparseJob(clangData->units.at(i).second,
                                                                      clangData->units.at(i).first,
@@ -240,14 +333,54 @@ void Project::onJobFinished(const shared_ptr<IndexerJob> &job)
                   String::formatTime(time(0), String::Time).constData(),
                   data->message.constData());
 
-            if (mJobs.isEmpty()) {
+            if (mJobs.isEmpty() && reindex.isEmpty()) {
                 mSyncTimer.start(shared_from_this(), job->type() == IndexerJob::Dirty ? 0 : SyncTimeout,
                                  SingleShot, Sync);
             }
         }
     }
+    // the unit for completions is replaced with the one from this job
+    if (!job->isAborted())
+        CompletionJob::clearCache(job->sourceInformation().sourceFile);
     if (startPending)
         index(pending.source, pending.type);
+    for (int i=0; i<reindex.size(); ++i)
+        index(reindex.at(i), IndexerJob::Dirty);
+    if (secondPass)
+        startSecondPass();
+}
+
+// The full pass only runs a few jobs at a time so that anything else that
+// needs indexing gets ahead of it in the thread pool
+void Project::startSecondPass()
+{
+    List<SourceInformation> sources;
+    {
+        MutexLocker lock(&mMutex);
+        const int max = std::max(1, Server::instance()->options().threadCount);
+        Map<uint32_t, Set<uint32_t> >::iterator it = mSecondPass.begin();
+        while (it != mSecondPass.end() && mSecondPassJobs.size() + sources.size() < max) {
+            if (mJobs.contains(it->first)) { // picked up again after the next sync
+                ++it;
+                continue;
+            }
+            const SourceInformationMap::const_iterator source = mSources.find(it->first);
+            if (source != mSources.end()) {
+                // what was visited without function bodies is visited again
+                // and replaces the declarations on the next sync. Headers
+                // are replaced in place so references to them from files
+                // that were already fully indexed survive
+                mVisitedFiles -= it->second;
+                mPendingDirtyFiles += it->second;
+                mInPlaceFiles += it->second;
+                mSecondPassJobs.insert(it->first);
+                sources.append(source->second);
+            }
+            mSecondPass.erase(it++);
+        }
+    }
+    for (int i=0; i<sources.size(); ++i)
+        index(sources.at(i), IndexerJob::Makefile);
 }
 
 bool Project::save()
@@ -266,11 +399,18 @@ bool Project::save()
         error("Can't open file %s", p.constData());
         return false;
     }
+    // second pass jobs that are running start over after a restart
+    Map<uint32_t, Set<uint32_t> > secondPass = mSecondPass;
+    for (Set<uint32_t>::const_iterator it = mSecondPassJobs.begin(); it != mSecondPassJobs.end(); ++it)
+        secondPass[*it];
+
     Serializer out(f);
     out << static_cast<int>(Server::DatabaseVersion);
     const int pos = ftell(f);
-    out << static_cast<int>(0) << mSymbols << mSymbolNames << mUsr
-        << mDependencies << mSources << mVisitedFiles;
+    out << static_cast<int>(0) << mSymbols << mSymbolNames << mUsr << mDependencies;
+    writeSources(out, mSources);
+    out << mVisitedFiles << mFileHashes << mSignatures << mUsedNames << mDeclarationFiles << secondPass;
+    out << mFiles << (fileManager ? fileManager->directories() : DirectoryMap());
 
     const int size = ftell(f);
     fseek(f, pos, SEEK_SET);
@@ -298,13 +438,21 @@ void Project::index(const SourceInformation &c, IndexerJob::Type type)
     }
     shared_ptr<Project> project = static_pointer_cast<Project>(shared_from_this());
 
+    if (type == IndexerJob::Makefile && !c.isJS() && !mSources.contains(fileId)
+        && Server::instance()->options().options & Server::DeclarationsFirst) {
+        type = IndexerJob::Declarations;
+    }
     mSources[fileId] = c;
     mPendingData.remove(fileId);
 
     if (!mJobCounter++)
         mTimer.start();
 
-    job = Server::instance()->factory().createJob(project, type, c);
+    if (Server::instance()->options().options & Server::IndexInWorkers && !c.isJS()) {
+        job.reset(new IndexerJobWorker(project, type, c));
+    } else {
+        job = Server::instance()->factory().createJob(project, type, c);
+    }
     if (!job) {
         error() << "Failed to create job for" << c;
         mJobs.erase(fileId);
@@ -313,7 +461,7 @@ void Project::index(const SourceInformation &c, IndexerJob::Type type)
     mSyncTimer.stop();
     mSaveTimer.stop();
 
-    Server::instance()->startIndexerJob(job);
+    Server::instance()->queueIndexerJob(job);
 }
 
 static inline Path resolveCompiler(const Path &compiler)
@@ -380,9 +528,18 @@ static inline Path resolveCompiler(const Path &compiler)
 
 bool Project::index(const Path &sourceFile, const Path &cc, const List<String> &args)
 {
-    const Path compiler = resolveCompiler(cc.canonicalized());
     SourceInformation sourceInformation = sourceInfo(Location::insertFile(sourceFile));
     const bool js = args.isEmpty() && sourceFile.endsWith(".js");
+    const CompileArguments arguments(args);
+    const uint64_t command = RTags::hash(cc, arguments.key());
+    // the same line as last time, no need to resolve the compiler
+    for (int j=0; j<sourceInformation.builds.size(); ++j) {
+        if (sourceInformation.builds.at(j).command == command) {
+            debug() << sourceFile << " is not dirty. ignoring";
+            return false;
+        }
+    }
+    const Path compiler = resolveCompiler(cc.canonicalized());
     bool added = false;
     if (sourceInformation.isNull()) {
         sourceInformation.sourceFile = sourceFile;
@@ -394,21 +551,29 @@ bool Project::index(const Path &sourceFile, const Path &cc, const List<String> &
         const bool allowMultiple = Server::instance()->options().options & Server::AllowMultipleBuilds;
         for (int j=0; j<builds.size(); ++j) {
             if (builds.at(j).compiler == compiler) {
-                if (builds.at(j).args == args) {
+                if (builds.at(j).args == arguments) {
                     debug() << sourceFile << " is not dirty. ignoring";
+                    // restored builds don't know their line yet
+                    MutexLocker lock(&mMutex);
+                    SourceInformationMap::iterator it = mSources.find(Location::fileId(sourceFile));
+                    if (it != mSources.end() && j < it->second.builds.size())
+                        it->second.builds[j].command = command;
                     return false;
                 }
             }
             if (!allowMultiple) {
                 builds[j].compiler = compiler;
-                builds[j].args = args;
+                builds[j].args = arguments;
+                builds[j].command = command;
                 added = true;
                 break;
             }
         }
     }
-    if (!added && !js)
-        sourceInformation.builds.append(SourceInformation::Build(compiler, args));
+    if (!added && !js) {
+        sourceInformation.builds.append(SourceInformation::Build(compiler, arguments));
+        sourceInformation.builds.last().command = command;
+    }
     index(sourceInformation, IndexerJob::Makefile);
     return true;
 }
@@ -417,9 +582,14 @@ void Project::onFileModified(const Path &file)
 {
     const uint32_t fileId = Location::fileId(file);
     debug() << file << "was modified" << fileId << mModifiedFiles.contains(fileId);
-    if (!fileId || !mModifiedFiles.insert(fileId)) {
+    if (!fileId || mModifiedFiles.contains(fileId)) {
         return;
     }
+    if (!isModified(fileId)) {
+        debug() << file << "was touched but its contents didn't change";
+        return;
+    }
+    mModifiedFiles.insert(fileId);
     if (mModifiedFiles.size() == 1 && file.isSource()) {
         startDirtyJobs();
     } else {
@@ -428,6 +598,19 @@ void Project::onFileModified(const Path &file)
     }
 }
 
+bool Project::isModified(uint32_t fileId) const
+{
+    uint64_t hash;
+    {
+        MutexLocker lock(&mMutex);
+        hash = mFileHashes.value(fileId);
+    }
+    if (!hash)
+        return true;
+    const Path path = Location::path(fileId);
+    return !path.isFile() || RTags::hash(path.readAll()) != hash;
+}
+
 SourceInformationMap Project::sourceInfos() const
 {
     MutexLocker lock(&mMutex);
@@ -494,6 +677,12 @@ int Project::reindex(const Match &match)
         if (dirty.isEmpty())
             return 0;
         mModifiedFiles += dirty;
+        // forget the hashes and signatures so startDirtyJobs doesn't skip
+        // them or their dependents
+        for (Set<uint32_t>::const_iterator it = dirty.begin(); it != dirty.end(); ++it) {
+            mFileHashes.remove(*it);
+            mSignatures.remove(*it);
+        }
     }
     startDirtyJobs();
     return dirty.size();
@@ -537,11 +726,64 @@ void Project::startDirtyJobs()
     {
         MutexLocker lock(&mMutex);
         std::swap(dirtyFiles, mModifiedFiles);
+    }
+    // touch storms and branch switches often put the old contents back
+    // before we get here
+    Set<uint32_t>::iterator modified = dirtyFiles.begin();
+    while (modified != dirtyFiles.end()) {
+        if (isModified(*modified)) {
+            ++modified;
+        } else {
+            debug() << Location::path(*modified) << "is unchanged, not reindexing";
+            dirtyFiles.erase(modified++);
+        }
+    }
+    // cached completions in anything that includes a modified file are stale
+    // even if probing spares it the reindex
+    Set<uint32_t> stale = dirtyFiles;
+    {
+        MutexLocker lock(&mMutex);
+        for (Set<uint32_t>::const_iterator it = dirtyFiles.begin(); it != dirtyFiles.end(); ++it)
+            stale += mDependencies.value(*it);
+    }
+    for (Set<uint32_t>::const_iterator it = stale.begin(); it != stale.end(); ++it)
+        CompletionJob::clearCache(Location::path(*it));
+    {
+        MutexLocker lock(&mMutex);
+        // Headers we have signatures for are reindexed in place by one of
+        // their dependents first. The rest of the dependents are only
+        // reindexed if they use something that changed, see checkProbes()
+        Map<uint32_t, uint32_t> probes;
+        if (!(Server::instance()->options().options & Server::ReindexAllDependents)) {
+            Set<uint32_t>::iterator it = dirtyFiles.begin();
+            while (it != dirtyFiles.end()) {
+                const uint32_t probe = (!mSources.contains(*it) && mSignatures.contains(*it)
+                                        ? probeSource(*it, dirtyFiles) : 0);
+                if (probe) {
+                    probes[*it] = probe;
+                    dirtyFiles.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+        }
         for (Set<uint32_t>::const_iterator it = dirtyFiles.begin(); it != dirtyFiles.end(); ++it) {
             const Set<uint32_t> deps = mDependencies.value(*it);
             dirtyFiles += deps;
             mVisitedFiles.remove(*it);
             mVisitedFiles -= deps;
+            mInPlaceFiles.remove(*it);
+            mInPlaceFiles -= deps;
+        }
+        for (Map<uint32_t, uint32_t>::const_iterator it = probes.begin(); it != probes.end(); ++it) {
+            if (dirtyFiles.contains(it->first)) // includes another modified file
+                continue;
+            mProbes[it->first] = it->second;
+            mInPlaceFiles.insert(it->first);
+            dirtyFiles.insert(it->first);
+            dirtyFiles.insert(it->second);
+            mVisitedFiles.remove(it->first);
+            mVisitedFiles.remove(it->second);
         }
         mPendingDirtyFiles.unite(dirtyFiles);
     }
@@ -554,11 +796,153 @@ void Project::startDirtyJobs()
         }
     }
     if (!indexed && !mPendingDirtyFiles.isEmpty()) {
+        ReferenceMap kept;
+        dirtySymbols(kept);
+    }
+}
+
+uint32_t Project::probeSource(uint32_t header, const Set<uint32_t> &preferred) const // lock always held
+{
+    uint32_t ret = 0;
+    const Set<uint32_t> deps = mDependencies.value(header);
+    for (Set<uint32_t>::const_iterator it = deps.begin(); it != deps.end(); ++it) {
+        if (mSources.contains(*it)) {
+            if (preferred.contains(*it))
+                return *it;
+            if (!ret)
+                ret = *it;
+        }
+    }
+    return ret;
+}
+
+// Names whose signature differs, both lists are sorted by name
+static List<uint32_t> changedNames(const List<uint64_t> &before, const List<uint64_t> &after)
+{
+    List<uint32_t> ret;
+    int i = 0, j = 0;
+    while (i < before.size() || j < after.size()) {
+        const uint32_t b = i < before.size() ? (before.at(i) >> 32) : 0;
+        const uint32_t a = j < after.size() ? (after.at(j) >> 32) : 0;
+        if (j == after.size() || (i < before.size() && b < a)) {
+            ret.append(b);
+            ++i;
+        } else if (i == before.size() || a < b) {
+            ret.append(a);
+            ++j;
+        } else {
+            if (before.at(i) != after.at(j))
+                ret.append(b);
+            ++i;
+            ++j;
+        }
+    }
+    return ret;
+}
+
+static bool intersects(const List<uint32_t> &a, const List<uint32_t> &b)
+{
+    int i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (a.at(i) < b.at(j)) {
+            ++i;
+        } else if (b.at(j) < a.at(i)) {
+            ++j;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Project::checkProbes(const shared_ptr<IndexData> &data, uint32_t fileId,
+                          List<SourceInformation> &reindex) // lock always held
+{
+    Set<uint32_t> sources, headers;
+    Map<uint32_t, uint32_t> probes;
+    Map<uint32_t, uint32_t>::iterator probe = mProbes.begin();
+    while (probe != mProbes.end()) {
+        const uint32_t header = probe->first;
+        const Set<uint32_t> dependents = mDependencies.value(header);
+        const SignatureMap::const_iterator signatures = data->signatures.find(header);
+        List<uint32_t> changed;
+        bool all = false;
+        if (signatures != data->signatures.end()) {
+            changed = changedNames(mSignatures.value(header), signatures->second);
+        } else if (probe->second == fileId && !mVisitedFiles.contains(header)) {
+            error() << "Couldn't reindex" << Location::path(header) << "in place";
+            mInPlaceFiles.remove(header);
+            all = true;
+        } else { // someone else is indexing it
+            ++probe;
+            continue;
+        }
+
+        int total = 0, avoided = 0;
+        for (Set<uint32_t>::const_iterator dep = dependents.begin(); dep != dependents.end(); ++dep) {
+            const bool source = mSources.contains(*dep);
+            if (source)
+                ++total;
+            if (*dep == header || mPendingDirtyFiles.contains(*dep) || sources.contains(*dep))
+                continue;
+            if (!all) {
+                const UsedNameMap::const_iterator used = mUsedNames.find(*dep);
+                if (used != mUsedNames.end() && !intersects(used->second, changed)) {
+                    if (source)
+                        ++avoided;
+                    continue;
+                }
+            }
+            if (source) {
+                sources.insert(*dep);
+            } else if (all) {
+                headers.insert(*dep);
+            } else if (!probes.contains(*dep) && !mProbes.contains(*dep)) {
+                // a header that uses something that changed, reindex it in
+                // place too and see what changes in it
+                if (const uint32_t s = probeSource(*dep, sources)) {
+                    probes[*dep] = s;
+                    sources.insert(s);
+                }
+            }
+        }
+        mAvoidedJobs += avoided;
+        if (!all)
+            error() << Location::path(header) << "changed" << changed.size() << "names,"
+                    << avoided << "of" << total << "dependents didn't need to be reindexed,"
+                    << mAvoidedJobs << "jobs avoided in total";
+        mProbes.erase(probe++);
+    }
+
+    for (Map<uint32_t, uint32_t>::const_iterator it = probes.begin(); it != probes.end(); ++it) {
+        mProbes[it->first] = it->second;
+        mInPlaceFiles.insert(it->first);
+        mPendingDirtyFiles.insert(it->first);
+        mVisitedFiles.remove(it->first);
+    }
+    for (Set<uint32_t>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        mInPlaceFiles.remove(*it);
+        mPendingDirtyFiles.insert(*it);
+        mVisitedFiles.remove(*it);
+    }
+    for (Set<uint32_t>::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+        mPendingDirtyFiles.insert(*it);
+        mVisitedFiles.remove(*it);
+        reindex.append(mSources.value(*it));
+    }
+}
+
+void Project::dirtySymbols(ReferenceMap &kept)
+{
+    if (mInPlaceFiles.isEmpty()) {
         RTags::dirtySymbols(mSymbols, mPendingDirtyFiles);
-        RTags::dirtySymbolNames(mSymbolNames, mPendingDirtyFiles);
-        RTags::dirtyUsr(mUsr, mPendingDirtyFiles);
-        mPendingDirtyFiles.clear();
+    } else {
+        RTags::dirtySymbols(mSymbols, mPendingDirtyFiles, mInPlaceFiles, kept);
+        mInPlaceFiles.clear();
     }
+    RTags::dirtySymbolNames(mSymbolNames, mPendingDirtyFiles);
+    RTags::dirtyUsr(mUsr, mPendingDirtyFiles);
+    mPendingDirtyFiles.clear();
 }
 
 static inline void writeSymbolNames(const SymbolNameMap &symbolNames, SymbolNameMap &current)
@@ -662,22 +1046,40 @@ int Project::syncDB()
     //     writeErrorSymbols(mSymbols, mErrorSymbols, it->second->errors);
     // }
 
-    if (!mPendingDirtyFiles.isEmpty()) {
-        RTags::dirtySymbols(mSymbols, mPendingDirtyFiles);
-        RTags::dirtySymbolNames(mSymbolNames, mPendingDirtyFiles);
-        RTags::dirtyUsr(mUsr, mPendingDirtyFiles);
-        mPendingDirtyFiles.clear();
-    }
+    ReferenceMap kept;
+    if (!mPendingDirtyFiles.isEmpty())
+        dirtySymbols(kept);
 
     Set<uint32_t> newFiles;
-    for (Map<uint32_t, shared_ptr<IndexData> >::iterator it = mPendingData.begin(); it != mPendingData.end(); ++it) {
-        const shared_ptr<IndexData> &data = it->second;
+    // Each job's data is dropped as soon as it's merged so we don't hold all
+    // of it and the merged database at the same time
+    while (!mPendingData.isEmpty()) {
+        const shared_ptr<IndexData> data = mPendingData.begin()->second;
+        mPendingData.erase(mPendingData.begin());
+        for (Map<uint32_t, uint64_t>::const_iterator h = data->hashes.begin(); h != data->hashes.end(); ++h) {
+            if (h->second) {
+                mFileHashes[h->first] = h->second;
+            } else {
+                mFileHashes.remove(h->first);
+            }
+        }
         addDependencies(data->dependencies, newFiles);
         addFixIts(data->dependencies, data->fixIts);
         writeSymbols(data->symbols, mSymbols);
         writeUsr(data->usrMap, mUsr, mSymbols);
         writeReferences(data->references, mSymbols);
         writeSymbolNames(data->symbolNames, mSymbolNames);
+        for (SignatureMap::const_iterator sig = data->signatures.begin(); sig != data->signatures.end(); ++sig)
+            mSignatures[sig->first] = sig->second;
+        for (UsedNameMap::const_iterator used = data->usedNames.begin(); used != data->usedNames.end(); ++used)
+            mUsedNames[used->first] = used->second;
+    }
+    // references from files that weren't reindexed to headers that were
+    // reindexed in place
+    for (ReferenceMap::const_iterator it = kept.begin(); it != kept.end(); ++it) {
+        SymbolMap::iterator sym = mSymbols.find(it->first);
+        if (sym != mSymbols.end())
+            sym->second.references.unite(it->second);
     }
     for (Set<uint32_t>::const_iterator it = newFiles.begin(); it != newFiles.end(); ++it) {
         const Path path = Location::path(*it);
@@ -688,7 +1090,6 @@ int Project::syncDB()
             mWatcher.watch(dir);
         }
     }
-    mPendingData.clear();
     if (Server::instance()->options().options & Server::Validate) {
         shared_ptr<ValidateDBJob> validate(new ValidateDBJob(static_pointer_cast<Project>(shared_from_this()), mPreviousErrors));
         Server::instance()->startQueryJob(validate);
@@ -702,6 +1103,12 @@ bool Project::isIndexed(uint32_t fileId) const
     return mVisitedFiles.contains(fileId) || mSources.contains(fileId);
 }
 
+bool Project::isDeclarationsOnly(uint32_t fileId) const
+{
+    MutexLocker lock(&mMutex);
+    return mDeclarationFiles.contains(fileId);
+}
+
 SourceInformationMap Project::sources() const
 {
     MutexLocker lock(&mMutex);
@@ -713,13 +1120,13 @@ DependencyMap Project::dependencies() const
     return mDependencies;
 }
 
-void Project::addCachedUnit(const Path &path, const List<String> &args, CXIndex index,
+void Project::addCachedUnit(const Path &path, const CompileArguments &args, CXIndex index,
                             CXTranslationUnit unit, int parseCount) // lock always held
 {
     assert(index);
     assert(unit);
-    const int maxCacheSize = Server::instance()->options().completionCacheSize;
-    if (!maxCacheSize) {
+    const Server::Options &options = Server::instance()->options();
+    if (!options.completionCacheSize) {
         clang_disposeTranslationUnit(unit);
         clang_disposeIndex(index);
         return;
@@ -730,37 +1137,22 @@ void Project::addCachedUnit(const Path &path, const List<String> &args, CXIndex
     cachedUnit->unit = unit;
     cachedUnit->arguments = args;
     cachedUnit->parseCount = parseCount;
-    mCachedUnits.push_back(cachedUnit);
-    while (mCachedUnits.size() > maxCacheSize) {
-        CachedUnit *unit = *mCachedUnits.begin();
-        delete unit;
-        mCachedUnits.erase(mCachedUnits.begin());
-    }
+    mUnitCache.insert(cachedUnit, options.completionCacheSize,
+                      static_cast<int64_t>(options.completionCacheMemory) * 1024 * 1024);
 }
 
-LinkedList<CachedUnit*>::iterator Project::findCachedUnit(const Path &path, const List<String> &args)
-{
-    for (LinkedList<CachedUnit*>::iterator it = mCachedUnits.begin(); it != mCachedUnits.end(); ++it) {
-        if ((*it)->path == path && (args.isEmpty() || args == (*it)->arguments))
-            return it;
-    }
-    return mCachedUnits.end();
-}
-
-bool Project::initJobFromCache(const Path &path, const List<String> &args,
+bool Project::initJobFromCache(const Path &path, const CompileArguments &args,
                                CXIndex &index, CXTranslationUnit &unit, List<String> *argsOut,
                                int *parseCount)
 {
-    LinkedList<CachedUnit*>::iterator it = findCachedUnit(path, args);
-    if (it != mCachedUnits.end()) {
-        CachedUnit *cachedUnit = *it;
+    CachedUnit *cachedUnit = mUnitCache.take(path, args);
+    if (cachedUnit) {
         index = cachedUnit->index;
         unit = cachedUnit->unit;
         cachedUnit->unit = 0;
         cachedUnit->index = 0;
         if (argsOut)
-            *argsOut = cachedUnit->arguments;
-        mCachedUnits.erase(it);
+            *argsOut = cachedUnit->arguments.list();
         if (parseCount)
             *parseCount = cachedUnit->parseCount;
         delete cachedUnit;
@@ -776,15 +1168,34 @@ bool Project::initJobFromCache(const Path &path, const List<String> &args,
 bool Project::fetchFromCache(const Path &path, List<String> &args, CXIndex &index, CXTranslationUnit &unit, int *parseCount)
 {
     MutexLocker lock(&mMutex);
-    return initJobFromCache(path, List<String>(), index, unit, &args, parseCount);
+    return initJobFromCache(path, CompileArguments(), index, unit, &args, parseCount);
 }
 
-void Project::addToCache(const Path &path, const List<String> &args, CXIndex index, CXTranslationUnit unit, int parseCount)
+void Project::addToCache(const Path &path, const CompileArguments &args, CXIndex index, CXTranslationUnit unit, int parseCount)
 {
     MutexLocker lock(&mMutex);
     addCachedUnit(path, args, index, unit, parseCount);
 }
 
+shared_ptr<ReparseJob> Project::createWarmUpJob(const Path &path, const String &unsaved)
+{
+    const uint32_t fileId = Location::fileId(path);
+    MutexLocker lock(&mMutex);
+    const SourceInformationMap::const_iterator it = mSources.find(fileId);
+    if (!fileId || it == mSources.end() || it->second.builds.isEmpty())
+        return shared_ptr<ReparseJob>();
+    const CompileArguments args = it->second.builds.first().args;
+    CXIndex index;
+    CXTranslationUnit unit;
+    int parseCount;
+    if (initJobFromCache(path, args, index, unit, 0, &parseCount) && parseCount >= 2) {
+        addCachedUnit(path, args, index, unit, parseCount);
+        return shared_ptr<ReparseJob>();
+    }
+    return shared_ptr<ReparseJob>(new ReparseJob(unit, index, path, args, unsaved,
+                                                 static_pointer_cast<Project>(shared_from_this())));
+}
+
 void Project::addFixIts(const DependencyMap &visited, const FixItMap &fixIts) // lock always held
 {
     for (DependencyMap::const_iterator it = visited.begin(); it != visited.end(); ++it) {
@@ -829,6 +1240,7 @@ void Project::timerEvent(TimerEvent *e)
                 << MemoryMonitor::usage() / (1024.0 * 1024.0) << "mb of memory";
         mSaveTimer.start(shared_from_this(), SaveTimeout, SingleShot, Save);
         mJobCounter = 0;
+        startSecondPass();
     } else if (e->userData() == ModifiedFiles) {
         startDirtyJobs();
     } else {
@@ -848,12 +1260,3 @@ void Project::reloadFileManager(const Path &)
 {
     fileManager->reload();
 }
-List<std::pair<Path, List<String> > > Project::cachedUnits() const
-{
-    MutexLocker lock(&mMutex);
-    List<std::pair<Path, List<String> > > ret;
-
-    for (LinkedList<CachedUnit*>::const_iterator it = mCachedUnits.begin(); it != mCachedUnits.end(); ++it)
-        ret.append(std::make_pair((*it)->path, (*it)->arguments));
-    return ret;
-}
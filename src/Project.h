@@ -11,39 +11,14 @@
 #include <rct/ReadWriteLock.h>
 #include <rct/FileSystemWatcher.h>
 #include "IndexerJob.h"
-
-struct CachedUnit
-{
-    CachedUnit()
-        : unit(0), index(0), parseCount(0)
-    {}
-    ~CachedUnit()
-    {
-        clear();
-    }
-    void clear()
-    {
-        if (unit) {
-            clang_disposeTranslationUnit(unit);
-            unit = 0;
-        }
-
-        if (index) {
-            clang_disposeIndex(index);
-            index = 0;
-        }
-    }
-    CXTranslationUnit unit;
-    CXIndex index;
-    Path path;
-    List<String> arguments;
-    int parseCount;
-};
+#include "UnitCache.h"
 
 class FileManager;
 class IndexerJob;
 class TimerEvent;
 class IndexData;
+class IndexerWorker;
+class ReparseJob;
 class Project : public EventReceiver
 {
 public:
@@ -76,6 +51,11 @@ public:
     UsrMap &usrs() { return mUsr; }
 
     bool isIndexed(uint32_t fileId) const;
+    // With Server::DeclarationsFirst new files are indexed without function
+    // bodies first and these files haven't been indexed fully yet
+    bool isDeclarationsOnly(uint32_t fileId) const;
+    Set<uint32_t> declarationFiles() const { MutexLocker lock(&mMutex); return mDeclarationFiles; }
+    int secondPassCount() const { MutexLocker lock(&mMutex); return mSecondPass.size() + mSecondPassJobs.size(); }
 
     void index(const SourceInformation &args, IndexerJob::Type type);
     bool index(const Path &sourceFile, const Path &compiler = Path(), const List<String> &args = List<String>());
@@ -95,22 +75,33 @@ public:
     DependencyMap dependencies() const;
     Set<Path> watchedPaths() const { return mWatchedPaths; }
     bool fetchFromCache(const Path &path, List<String> &args, CXIndex &index, CXTranslationUnit &unit, int *parseCount);
-    void addToCache(const Path &path, const List<String> &args, CXIndex index, CXTranslationUnit unit, int parseCount);
+    void addToCache(const Path &path, const CompileArguments &args, CXIndex index, CXTranslationUnit unit, int parseCount);
+    // A job that leaves a unit ready for completion in the cache, null if
+    // there already is one or path isn't a known source file
+    shared_ptr<ReparseJob> createWarmUpJob(const Path &path, const String &unsaved);
     void timerEvent(TimerEvent *event);
     bool isIndexing() const { MutexLocker lock(&mMutex); return !mJobs.isEmpty(); }
     void onJSFilesAdded();
-    List<std::pair<Path, List<String> > > cachedUnits() const;
+    List<UnitCache::Entry> cachedUnits() const { MutexLocker lock(&mMutex); return mUnitCache.entries(); }
+    UnitCache::Stats unitCacheStats() const { MutexLocker lock(&mMutex); return mUnitCache.stats(); }
+    // In rdm --worker processes the indexing rdm decides what gets visited
+    // and gets the results
+    void setWorker(IndexerWorker *worker) { mWorker = worker; }
 private:
     void reloadFileManager(const Path &);
-    bool initJobFromCache(const Path &path, const List<String> &args,
+    bool initJobFromCache(const Path &path, const CompileArguments &args,
                           CXIndex &index, CXTranslationUnit &unit, List<String> *argsOut, int *parseCount);
-    LinkedList<CachedUnit*>::iterator findCachedUnit(const Path &path, const List<String> &args);
     void onFileModified(const Path &);
+    bool isModified(uint32_t fileId) const;
     void addDependencies(const DependencyMap &hash, Set<uint32_t> &newFiles);
     void addFixIts(const DependencyMap &dependencies, const FixItMap &fixIts);
     int syncDB();
     void startDirtyJobs();
-    void addCachedUnit(const Path &path, const List<String> &args, CXIndex index, CXTranslationUnit unit, int parseCount);
+    void startSecondPass();
+    uint32_t probeSource(uint32_t header, const Set<uint32_t> &preferred) const;
+    void checkProbes(const shared_ptr<IndexData> &data, uint32_t fileId, List<SourceInformation> &reindex);
+    void dirtySymbols(ReferenceMap &kept);
+    void addCachedUnit(const Path &path, const CompileArguments &args, CXIndex index, CXTranslationUnit unit, int parseCount);
     bool save();
     void onValidateDBJobErrors(const Set<Location> &errors);
 
@@ -150,6 +141,18 @@ private:
     FileSystemWatcher mWatcher;
     DependencyMap mDependencies;
     SourceInformationMap mSources;
+    Map<uint32_t, uint64_t> mFileHashes;
+    SignatureMap mSignatures;
+    UsedNameMap mUsedNames;
+    // header reindexed in place -> source file reindexing it
+    Map<uint32_t, uint32_t> mProbes;
+    Set<uint32_t> mInPlaceFiles;
+    int mAvoidedJobs;
+
+    Set<uint32_t> mDeclarationFiles;
+    // source -> files its declarations job visited, waiting for the full pass
+    Map<uint32_t, Set<uint32_t> > mSecondPass;
+    Set<uint32_t> mSecondPassJobs;
 
     Set<Path> mWatchedPaths;
 
@@ -160,18 +163,9 @@ private:
     Map<uint32_t, shared_ptr<IndexData> > mPendingData;
     Set<uint32_t> mPendingDirtyFiles;
 
-    LinkedList<CachedUnit*> mCachedUnits;
-};
+    UnitCache mUnitCache;
 
-inline bool Project::visitFile(uint32_t fileId)
-{
-    MutexLocker lock(&mMutex);
-    if (mVisitedFiles.contains(fileId)) {
-        return false;
-    }
-
-    mVisitedFiles.insert(fileId);
-    return true;
-}
+    IndexerWorker *mWorker;
+};
 
 #endif
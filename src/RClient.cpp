@@ -14,6 +14,8 @@ enum OptionType {
     Clear,
     CodeComplete,
     CodeCompleteAt,
+    CompletionFilterPrefix,
+    CompletionOffset,
     Compile,
     ConnectTimeout,
     ContainingFunction,
@@ -45,6 +47,7 @@ enum OptionType {
     JobCount,
     LineNumbers,
     ListSymbols,
+    LoadCompilationDatabase,
     LogFile,
     Man,
     MatchCaseInsensitive,
@@ -72,6 +75,7 @@ enum OptionType {
     UnloadProject,
     UnsavedFile,
     Verbose,
+    WarmUpCompletion,
     WithProject,
     XmlDiagnostics
 };
@@ -117,7 +121,7 @@ struct Option opts[] = {
     { FindSymbols, "find-symbols", 'F', required_argument, "Find symbols matching arg." },
     { CursorInfo, "cursor-info", 'U', required_argument, "Get cursor info for this location." },
     { Status, "status", 's', optional_argument, "Dump status of rdm. Arg can be symbols or symbolNames." },
-    { IsIndexed, "is-indexed", 'T', required_argument, "Check if rtags knows about, and is ready to return information about, this source file." },
+    { IsIndexed, "is-indexed", 'T', required_argument, "Check if rtags knows about, and is ready to return information about, this source file. Prints 1 if indexed, 3 if only declarations are indexed yet and 2 if it only knows about it." },
     { IsIndexing, "is-indexing", 0, no_argument, "Check if rtags is currently indexing files." },
     { HasFileManager, "has-filemanager", 0, optional_argument, "Check if rtags has info about files in this directory." },
     { PreprocessFile, "preprocess", 'E', required_argument, "Preprocess file." },
@@ -127,8 +131,12 @@ struct Option opts[] = {
     { RdmLog, "rdm-log", 'g', no_argument, "Receive logs from rdm." },
     { CodeCompleteAt, "code-complete-at", 'x', required_argument, "Get code completion from location (must be specified with path:line:column)." },
     { CodeComplete, "code-complete", 0, no_argument, "Get code completion from stream written to stdin." },
+    { CompletionFilterPrefix, "completion-filter-prefix", 0, no_argument, "Only get completions that start with what's typed at the location. With --code-complete-at or --code-complete." },
+    { CompletionOffset, "completion-offset", 0, required_argument, "Skip this many of the best completions. With --max to fetch the rest of them later." },
+    { WarmUpCompletion, "warm-up-completion", 'b', required_argument, "Prepare code completion for this file in the background, e.g. when it's opened." },
     { FixIts, "fixits", 0, required_argument, "Get fixits for file." },
     { Compile, "compile", 'c', required_argument, "Pass compilation arguments to rdm." },
+    { LoadCompilationDatabase, "load-compilation-database", 'J', required_argument, "Index everything in this compile_commands.json or the one in this directory." },
     { RemoveFile, "remove", 'D', required_argument, "Remove file from project." },
     { FindProjectRoot, "find-project-root", 0, required_argument, "Use to check behavior of find-project-root." },
     { JSON, "json", 0, optional_argument, "Dump json about files matching arg or whole project if no argument." },
@@ -294,24 +302,29 @@ public:
 class CompletionCommand : public RCCommand
 {
 public:
-    CompletionCommand(const Path &p, int l, int c)
-        : path(p), line(l), column(c), stream(false), client(0)
+    CompletionCommand(const Path &p, int l, int c, unsigned f = CompletionMessage::None)
+        : path(p), line(l), column(c), flags(f), stream(false), max(-1), requestFlags(0), client(0)
     {}
     CompletionCommand()
-        : line(-1), column(-1), stream(true), client(0)
+        : line(-1), column(-1), flags(CompletionMessage::Stream), stream(true), max(-1), requestFlags(0), client(0)
     {
     }
 
     const Path path;
     const int line;
     const int column;
+    const unsigned flags;
     const bool stream;
+    int max;
+    unsigned requestFlags; // for each completion read from stdin
     Client *client;
     String data;
 
     virtual bool exec(RClient *rc, Client *cl)
     {
         client = cl;
+        max = rc->max();
+        requestFlags = rc->completionFlags();
         if (stream) {
             CompletionMessage msg(CompletionMessage::Stream);
             msg.init(rc->argc(), rc->argv());
@@ -319,7 +332,8 @@ public:
             EventLoop::instance()->addFileDescriptor(STDIN_FILENO, EventLoop::Read, stdinReady, this);
             return client->send(&msg, rc->timeout());
         } else {
-            CompletionMessage msg(CompletionMessage::None, path, line, column);
+            CompletionMessage msg(flags | requestFlags, path, line, column);
+            msg.setRange(rc->completionOffset(), rc->max());
             msg.init(rc->argc(), rc->argv());
             msg.setContents(rc->unsavedFiles().value(path));
             msg.setProjects(rc->projects());
@@ -385,7 +399,8 @@ public:
         // error() << path << line << column << contentsSize << pos << "\n" << contents.left(100)
         //         << contents.right(100);
 
-        CompletionMessage msg(CompletionMessage::None, path, line, column, pos);
+        CompletionMessage msg(requestFlags, path, line, column, pos);
+        msg.setRange(0, max);
         const String args = String::format<64>("%s:%d:%d:%d:%d", path.constData(), line, column, pos, contentsSize);
         const char *argv[] = { "completionStream", args.constData() };
         msg.init(2, argv);
@@ -438,7 +453,7 @@ public:
 };
 
 RClient::RClient()
-    : mQueryFlags(0), mMax(-1), mLogLevel(0), mTimeout(0),
+    : mQueryFlags(0), mCompletionFlags(0), mMax(-1), mCompletionOffset(0), mLogLevel(0), mTimeout(0),
       mMinOffset(-1), mMaxOffset(-1), mConnectTimeout(DEFAULT_CONNECT_TIMEOUT), mArgc(0), mArgv(0)
 {
 }
@@ -624,6 +639,14 @@ bool RClient::parse(int &argc, char **argv)
             // logFile = "/tmp/rc.log";
             mCommands.append(new CompletionCommand);
             break;
+        case WarmUpCompletion: {
+            const Path path = Path::resolved(optarg, Path::MakeAbsolute);
+            if (!path.isFile()) {
+                fprintf(stderr, "%s does not exist\n", optarg);
+                return false;
+            }
+            mCommands.append(new CompletionCommand(path, -1, -1, CompletionMessage::WarmUp));
+            break; }
         case Context:
             mContext = optarg;
             break;
@@ -721,6 +744,16 @@ bool RClient::parse(int &argc, char **argv)
                 return false;
             }
             break;
+        case CompletionFilterPrefix:
+            mCompletionFlags |= CompletionMessage::FilterPrefix;
+            break;
+        case CompletionOffset:
+            mCompletionOffset = atoi(optarg);
+            if (mCompletionOffset < 0) {
+                fprintf(stderr, "--completion-offset [arg] must be >= 0\n");
+                return false;
+            }
+            break;
         case Timeout:
             mTimeout = atoi(optarg);
             if (mTimeout <= 0) {
@@ -864,6 +897,19 @@ bool RClient::parse(int &argc, char **argv)
             }
             addCompile(Path::pwd(), args);
             break; }
+        case LoadCompilationDatabase: {
+            Path p = Path::resolved(optarg);
+            if (p.isDir()) {
+                if (!p.endsWith('/'))
+                    p.append('/');
+                p.append("compile_commands.json");
+            }
+            if (!p.isFile()) {
+                fprintf(stderr, "%s does not exist\n", p.constData());
+                return false;
+            }
+            addQuery(QueryMessage::LoadCompilationDatabase, p);
+            break; }
         case IsIndexing:
             addQuery(QueryMessage::IsIndexing);
             break;
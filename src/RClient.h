@@ -16,6 +16,8 @@ public:
     bool parse(int &argc, char **argv);
 
     int max() const { return mMax; }
+    int completionOffset() const { return mCompletionOffset; }
+    unsigned completionFlags() const { return mCompletionFlags; }
     int logLevel() const { return mLogLevel; }
     int timeout() const { return mTimeout; }
 
@@ -42,8 +44,8 @@ private:
     void addLog(int level);
     void addCompile(const Path &cwd, const String &args);
 
-    unsigned mQueryFlags;
-    int mMax, mLogLevel, mTimeout, mMinOffset, mMaxOffset, mConnectTimeout;
+    unsigned mQueryFlags, mCompletionFlags;
+    int mMax, mCompletionOffset, mLogLevel, mTimeout, mMinOffset, mMaxOffset, mConnectTimeout;
     String mContext;
     Set<String> mPathFilters;
     Map<Path, String> mUnsavedFiles;
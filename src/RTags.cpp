@@ -128,6 +128,28 @@ void dirtySymbols(SymbolMap &map, const Set<uint32_t> &dirty)
         }
     }
 }
+void dirtySymbols(SymbolMap &map, const Set<uint32_t> &dirty, const Set<uint32_t> &inPlace, ReferenceMap &kept)
+{
+    Set<uint32_t> moved = dirty;
+    moved -= inPlace;
+    SymbolMap::iterator it = map.begin();
+    while (it != map.end()) {
+        const uint32_t fileId = it->first.fileId();
+        if (dirty.contains(fileId)) {
+            if (inPlace.contains(fileId)) {
+                const Set<Location> &references = it->second.references;
+                for (Set<Location>::const_iterator ref = references.begin(); ref != references.end(); ++ref) {
+                    if (!dirty.contains(ref->fileId()))
+                        kept[it->first].insert(*ref);
+                }
+            }
+            map.erase(it++);
+        } else {
+            it->second.dirty(moved);
+            ++it;
+        }
+    }
+}
 void dirtyUsr(UsrMap &map, const Set<uint32_t> &dirty)
 {
     UsrMap::iterator it = map.begin();
@@ -48,12 +48,23 @@ typedef Map<String, Set<Location> > SymbolNameMap;
 typedef Map<uint32_t, Set<uint32_t> > DependencyMap;
 typedef Map<uint32_t, SourceInformation> SourceInformationMap;
 typedef Map<Path, Set<String> > FilesMap;
+// directory -> mtime when its entries were last read, 0 when unknown
+typedef Map<Path, time_t> DirectoryMap;
 typedef Map<uint32_t, Set<FixIt> > FixItMap;
 typedef Map<uint32_t, List<String> > DiagnosticsMap;
+// fileId -> sorted list of (name key << 32 | signature) for declarations and
+// macros in the file
+typedef Map<uint32_t, List<uint64_t> > SignatureMap;
+// fileId -> sorted name keys of things in other files used by the file
+typedef Map<uint32_t, List<uint32_t> > UsedNameMap;
 
 namespace RTags {
 void dirtySymbolNames(SymbolNameMap &map, const Set<uint32_t> &dirty);
 void dirtySymbols(SymbolMap &map, const Set<uint32_t> &dirty);
+// Like the above but the symbols in inPlace are being reindexed without moving.
+// Clean files keep their targets in them and their references to them are
+// returned in kept
+void dirtySymbols(SymbolMap &map, const Set<uint32_t> &dirty, const Set<uint32_t> &inPlace, ReferenceMap &kept);
 void dirtyUsr(UsrMap &map, const Set<uint32_t> &dirty);
 
 String backtrace(int maxFrames = -1);
@@ -148,6 +159,32 @@ inline void decodePath(Path &path)
     }
 }
 
+// 64-bit FNV-1a, pass the previous result as seed to chain
+static const uint64_t HashSeed = 14695981039346656037ULL;
+inline uint64_t hash(const char *data, int size, uint64_t hash = HashSeed)
+{
+    for (int i=0; i<size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline uint64_t hash(const String &string, uint64_t seed = HashSeed)
+{
+    return hash(string.constData(), string.size(), seed);
+}
+
+inline uint64_t hash(const List<String> &list, uint64_t seed = HashSeed)
+{
+    uint64_t ret = seed;
+    for (int i=0; i<list.size(); ++i) {
+        ret = hash(list.at(i), ret);
+        ret = hash("", 1, ret); // separator so that "ab", "c" != "a", "bc"
+    }
+    return ret;
+}
+
 inline int digits(int len)
 {
     int ret = 1;
@@ -176,7 +176,8 @@ SymbolMap::const_iterator findCursorInfo(const SymbolMap &map, const Location &l
 void parseTranslationUnit(const Path &sourceFile, const List<String> &args,
                           CXTranslationUnit &unit, CXIndex &index, String &clangLine,
                           uint32_t fileId, DependencyMap *dependencies,
-                          CXUnsavedFile *unsaved, int unsavedCount)
+                          CXUnsavedFile *unsaved, int unsavedCount,
+                          unsigned parseFlags)
 
 {
     clangLine = "clang ";
@@ -210,8 +211,13 @@ void parseTranslationUnit(const Path &sourceFile, const List<String> &args,
 
     StopWatch sw;
     unsigned int flags = CXTranslationUnit_DetailedPreprocessingRecord;
-    if (Server::instance()->options().completionCacheSize)
+    if (parseFlags & SkipFunctionBodies)
+        flags |= CXTranslationUnit_SkipFunctionBodies;
+    if (parseFlags & PrecompiledHeader) {
+        flags |= CXTranslationUnit_Incomplete;
+    } else if (Server::instance()->options().completionCacheSize) {
         flags |= CXTranslationUnit_PrecompiledPreamble|CXTranslationUnit_CacheCompletionResults;
+    }
 
     unit = clang_parseTranslationUnit(index, sourceFile.constData(),
                                       clangArgs.data(), idx, unsaved, unsavedCount, flags);
@@ -41,10 +41,16 @@ SymbolMap::const_iterator findCursorInfo(const SymbolMap &map, const Location &l
                                          const String &context = String(),
                                          const SymbolMap *errors = 0, bool *foundInErrors = 0);
 
+enum ParseFlag {
+    DefaultParseFlags = 0x0,
+    PrecompiledHeader = 0x1,
+    SkipFunctionBodies = 0x2
+};
 void parseTranslationUnit(const Path &sourceFile, const List<String> &args,
                           CXTranslationUnit &unit, CXIndex &index, String &clangLine,
                           uint32_t fileId, DependencyMap *dependencies,
-                          CXUnsavedFile *unsaved, int unsavedCount);
+                          CXUnsavedFile *unsaved, int unsavedCount,
+                          unsigned parseFlags = DefaultParseFlags);
 void reparseTranslationUnit(CXTranslationUnit &unit, CXUnsavedFile *unsaved, int unsavedCount);
 
 struct Filter
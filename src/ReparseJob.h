@@ -3,13 +3,15 @@
 
 #include <rct/ThreadPool.h>
 #include <rct/Path.h>
+#include <rct/SignalSlot.h>
 #include <clang-c/Index.h>
 #include <Project.h>
+#include "RTagsClang.h"
 
 class ReparseJob : public ThreadPool::Job
 {
 public:
-    ReparseJob(CXTranslationUnit unit, CXIndex index, const Path &path, const List<String> &args, const String &unsaved,
+    ReparseJob(CXTranslationUnit unit, CXIndex index, const Path &path, const CompileArguments &args, const String &unsaved,
                const shared_ptr<Project> &project)
         : mUnit(unit), mIndex(index), mPath(path), mArgs(args), mUnsaved(unsaved), mProject(project)
     {}
@@ -19,8 +21,17 @@ public:
         CXUnsavedFile unsaved = { mPath.constData(),
                                   mUnsaved.constData(),
                                   static_cast<unsigned long>(mUnsaved.size()) };
+        const int unsavedCount = mUnsaved.isEmpty() ? 0 : 1;
 
-        RTags::reparseTranslationUnit(mUnit, &unsaved, mUnsaved.isEmpty() ? 1 : 0);
+        if (!mUnit) { // completion warm-up for a file that isn't cached at all
+            assert(!mIndex);
+            mIndex = clang_createIndex(0, 1);
+            String clangLine;
+            RTags::parseTranslationUnit(mPath, mArgs.list(), mUnit, mIndex, clangLine,
+                                        0, 0, &unsaved, unsavedCount);
+        }
+        if (mUnit)
+            RTags::reparseTranslationUnit(mUnit, &unsaved, unsavedCount);
         if (mUnit) {
             shared_ptr<Project> project = mProject.lock();
             if (project) {
@@ -35,14 +46,17 @@ public:
             clang_disposeTranslationUnit(mUnit);
         if (mIndex)
             clang_disposeIndex(mIndex);
+        mFinished(mPath);
     }
+    signalslot::Signal1<Path> &finished() { return mFinished; }
 private:
     CXTranslationUnit mUnit;
     CXIndex mIndex;
     const Path mPath;
-    const List<String> mArgs;
+    const CompileArguments mArgs;
     const String mUnsaved;
     weak_ptr<Project> mProject;
+    signalslot::Signal1<Path> mFinished;
 };
 
 #endif
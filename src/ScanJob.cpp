@@ -1,10 +1,224 @@
 #include "ScanJob.h"
+#include "HelperThreads.h"
 #include "Server.h"
-#include "Filter.h"
-#include "Project.h"
+#include <rct/LinkedList.h>
+#include <rct/Mutex.h>
+#include <rct/MutexLocker.h>
+#include <rct/StopWatch.h>
+#include <rct/WaitCondition.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/stat.h>
 
-ScanJob::ScanJob(const Path &path)
-    : mPath(path), mFilters(Server::instance()->options().excludeFilters)
+enum { BatchSize = 1024 };
+
+struct ScanFilter
+{
+    String pattern;
+    bool wildcard; // otherwise a substring match is all fnmatch could add
+};
+
+struct ScanItem
+{
+    Path dir;
+    bool known; // only read it if its mtime changed
+};
+
+struct ScanState
+{
+    ScanJob *job;
+    const DirectoryMap *known;
+    time_t started;
+    List<ScanFilter> filters;
+
+    Mutex mutex;
+    WaitCondition condition;
+    // One stack of unread directories per thread. A thread takes the newest
+    // directory from its own stack and steals the oldest one, the one most
+    // likely to have a big subtree, from the others
+    List<LinkedList<ScanItem> > stacks;
+    int busy; // threads currently reading a directory
+    Set<Path> linkedDirs; // resolved targets of symlinked directories
+    int files, directories, unchanged;
+
+    Mutex batchMutex;
+
+    bool filtered(const Path &path) const
+    {
+        const int count = filters.size();
+        for (int i=0; i<count; ++i) {
+            const ScanFilter &filter = filters.at(i);
+            if ((filter.wildcard && !fnmatch(filter.pattern.constData(), path.constData(), 0))
+                || strstr(path.constData(), filter.pattern.constData())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void flush(ScanBatch &batch)
+    {
+        if (!batch.directories.isEmpty()) {
+            MutexLocker lock(&batchMutex);
+            job->batch()(batch);
+            batch.files.clear();
+            batch.directories.clear();
+        }
+    }
+};
+
+static bool takeDirectory(ScanState *state, int index, ScanItem &item)
+{
+    MutexLocker lock(&state->mutex);
+    while (true) {
+        LinkedList<ScanItem> &own = state->stacks[index];
+        if (!own.isEmpty()) {
+            item = own.back();
+            own.pop_back();
+            break;
+        }
+        const int count = state->stacks.size();
+        bool stolen = false;
+        for (int i=1; i<count && !stolen; ++i) {
+            LinkedList<ScanItem> &other = state->stacks[(index + i) % count];
+            if (!other.isEmpty()) {
+                item = other.front();
+                other.pop_front();
+                stolen = true;
+            }
+        }
+        if (stolen)
+            break;
+        if (!state->busy) // nothing queued and nobody left to queue more
+            return false;
+        state->condition.wait(&state->mutex, 100);
+    }
+    ++state->busy;
+    return true;
+}
+
+static void finishDirectory(ScanState *state, int index, List<Path> &dirs, int files, bool read)
+{
+    MutexLocker lock(&state->mutex);
+    --state->busy;
+    if (read) {
+        ++state->directories;
+        state->files += files;
+    } else {
+        ++state->unchanged;
+    }
+    LinkedList<ScanItem> &own = state->stacks[index];
+    for (int i=0; i<dirs.size(); ++i) {
+        const ScanItem item = { dirs.at(i), false };
+        own.push_back(item);
+    }
+    if (!dirs.isEmpty() || !state->busy)
+        state->condition.wakeAll();
+}
+
+// Reads one directory without stat'ing its entries unless the file system
+// doesn't tell us their type or they are symlinks. Subdirectories that are in
+// the snapshot are checked on their own and not returned in dirs
+static int readDirectory(ScanState *state, const Path &dir, List<Path> &dirs, ScanBatch &batch)
+{
+    DIR *d = opendir(dir.constData());
+    if (!d)
+        return 0;
+    struct stat st;
+    time_t modified = 0;
+    // a change later in the same second wouldn't move the mtime, so a
+    // directory modified after the scan started gets read again next time
+    if (!fstat(dirfd(d), &st) && st.st_mtime < state->started)
+        modified = st.st_mtime;
+    Set<String> files;
+    bool ignored = false;
+    while (dirent *entry = readdir(d)) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (!strcmp(name, ".rtags-ignore")) {
+            ignored = true;
+            break;
+        }
+        Path path = dir + name;
+        bool isDir;
+        switch (entry->d_type) {
+        case DT_DIR:
+            isDir = true;
+            break;
+        case DT_REG:
+            isDir = false;
+            break;
+        default:
+            isDir = path.isDir();
+            if (isDir && entry->d_type == DT_LNK) {
+                // don't loop through links pointing back up the tree
+                const Path resolved = Path::resolved(path);
+                MutexLocker lock(&state->mutex);
+                if (!state->linkedDirs.insert(resolved))
+                    continue;
+            }
+            break;
+        }
+        if (isDir)
+            path.append('/');
+        if (state->filtered(path))
+            continue;
+        if (isDir) {
+            if (!state->known->contains(path))
+                dirs.append(path);
+        } else {
+            files.insert(name);
+        }
+    }
+    closedir(d);
+    if (ignored) {
+        dirs.clear();
+        return 0;
+    }
+    const int count = files.size();
+    std::swap(batch.files[dir], files);
+    batch.directories[dir] = modified;
+    return count;
+}
+
+static void scanThread(void *userData, int index)
+{
+    ScanState *state = static_cast<ScanState*>(userData);
+    ScanBatch batch;
+    batch.root = state->job->path();
+    int batched = 0;
+    ScanItem item;
+    List<Path> dirs;
+    while (takeDirectory(state, index, item)) {
+        int files = 0;
+        bool read = true;
+        if (item.known) {
+            struct stat st;
+            const time_t modified = state->known->value(item.dir);
+            if (stat(item.dir.constData(), &st) || !S_ISDIR(st.st_mode)) {
+                read = false; // gone, dropped with the directories that weren't seen
+            } else if (modified && st.st_mtime == modified) {
+                batch.directories[item.dir] = modified;
+                read = false;
+            }
+        }
+        if (read)
+            files = readDirectory(state, item.dir, dirs, batch);
+        finishDirectory(state, index, dirs, files, read);
+        dirs.clear();
+        batched += files + 1;
+        if (batched >= BatchSize) {
+            state->flush(batch);
+            batched = 0;
+        }
+    }
+    state->flush(batch);
+}
+
+ScanJob::ScanJob(const Path &path, const DirectoryMap &known)
+    : mPath(path), mKnown(known), mFilters(Server::instance()->options().excludeFilters)
 {
     if (!mPath.endsWith('/'))
         mPath.append('/');
@@ -12,25 +226,37 @@ ScanJob::ScanJob(const Path &path)
 
 void ScanJob::run()
 {
-    mPath.visit(&ScanJob::visit, this);
-    mFinished(mPaths);
-}
+    StopWatch watch;
+    const int threadCount = std::max(1, Server::instance()->options().threadCount);
+    ScanState state;
+    state.job = this;
+    state.known = &mKnown;
+    state.started = time(0);
+    state.busy = 0;
+    state.files = state.directories = state.unchanged = 0;
+    for (int i=0; i<mFilters.size(); ++i) {
+        const String &pattern = mFilters.at(i);
+        if (pattern.isEmpty())
+            continue;
+        ScanFilter filter = { pattern, strpbrk(pattern.constData(), "*?[") != 0 };
+        state.filters.append(filter);
+    }
+    state.stacks.resize(threadCount);
+    if (mKnown.contains(mPath)) {
+        // every known directory is checked by itself, spread them out
+        int i = 0;
+        for (DirectoryMap::const_iterator it = mKnown.begin(); it != mKnown.end(); ++it) {
+            const ScanItem item = { it->first, true };
+            state.stacks[i++ % threadCount].push_back(item);
+        }
+    } else {
+        const ScanItem item = { mPath, false };
+        state.stacks[0].push_back(item);
+    }
+
+    const int threads = HelperThreads::run(threadCount, scanThread, &state);
 
-Path::VisitResult ScanJob::visit(const Path &path, void *userData)
-{
-    ScanJob *recurseJob = reinterpret_cast<ScanJob*>(userData);
-    const Filter::Result result = Filter::filter(path, recurseJob->mFilters);
-    switch (result) {
-    case Filter::Filtered:
-        return Path::Continue;
-    case Filter::Directory:
-        if (Path::exists(path + "/.rtags-ignore"))
-            return Path::Continue;
-        return Path::Recurse;
-    case Filter::File:
-    case Filter::Source:
-        recurseJob->mPaths.insert(path);
-        break;
-    }
-    return Path::Continue;
+    debug("Scanned %d files in %d directories under %s in %dms with %d threads, %d directories unchanged",
+          state.files, state.directories, mPath.constData(), watch.elapsed(), threads, state.unchanged);
+    mFinished(mPath);
 }
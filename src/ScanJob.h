@@ -4,19 +4,36 @@
 #include <rct/ThreadPool.h>
 #include <rct/Path.h>
 #include <rct/SignalSlot.h>
+#include "RTags.h"
+
+struct ScanBatch
+{
+    Path root;
+    // every directory that was read, possibly with no files left
+    FilesMap files;
+    // every directory that is still there, read or not
+    DirectoryMap directories;
+};
+
 class Project;
+// Walks a directory with several threads. Complete directories are handed out
+// in batches as they are read, finished() is emitted after the last batch.
+// With a snapshot of known directories only the ones whose mtime changed are
+// read again, plus whatever new directories they lead to
 class ScanJob : public ThreadPool::Job
 {
 public:
-    ScanJob(const Path &path);
+    ScanJob(const Path &path, const DirectoryMap &known = DirectoryMap());
     virtual void run();
-    signalslot::Signal1<Set<Path> > &finished() { return mFinished; }
+    const Path &path() const { return mPath; }
+    signalslot::Signal1<ScanBatch> &batch() { return mBatch; }
+    signalslot::Signal1<Path> &finished() { return mFinished; }
 private:
-    static Path::VisitResult visit(const Path &path, void *userData);
     Path mPath;
+    const DirectoryMap mKnown;
     const List<String> &mFilters;
-    Set<Path> mPaths;
-    signalslot::Signal1<Set<Path> > mFinished;
+    signalslot::Signal1<ScanBatch> mBatch;
+    signalslot::Signal1<Path> mFinished;
 };
 
 #endif
@@ -1,6 +1,7 @@
 #include "Server.h"
 
 #include "Client.h"
+#include "CompilationDatabaseJob.h"
 #include "CompileJob.h"
 #include "CompileMessage.h"
 #include "CompletionJob.h"
@@ -21,6 +22,7 @@
 #include "QueryMessage.h"
 #include "RTags.h"
 #include "ReferencesJob.h"
+#include "ReparseJob.h"
 #include "StatusJob.h"
 #include <clang-c/Index.h>
 #include <rct/Connection.h>
@@ -37,11 +39,15 @@
 #include <rct/RegExp.h>
 #include <rct/SHA256.h>
 #include <stdio.h>
+#include <algorithm>
 
 void *UnloadTimer = &UnloadTimer;
+void *MemoryTimer = &MemoryTimer;
+enum { MemoryTimerInterval = 500 };
 Server *Server::sInstance = 0;
 Server::Server()
     : mServer(0), mVerbose(false), mJobId(0), mIndexerThreadPool(0), mQueryThreadPool(2),
+      mCompletionSequence(0), mCompletionLatencyIndex(0), mCompletionsFinished(0), mCompletionsCancelled(0),
       mRestoreProjects(false)
 {
     assert(!sInstance);
@@ -70,19 +76,55 @@ void Server::clear()
     mProjects.clear();
 }
 
-bool Server::init(const Options &options)
+void Server::loadPlugins()
 {
-    {
-        List<Path> plugins = Rct::executablePath().parentDir().files(Path::File);
-        for (int i=0; i<plugins.size(); ++i) {
-            if (mPluginFactory.addPlugin(plugins.at(i))) {
-                error() << "Loaded plugin" << plugins.at(i);
-            }
+    List<Path> plugins = Rct::executablePath().parentDir().files(Path::File);
+    for (int i=0; i<plugins.size(); ++i) {
+        if (mPluginFactory.addPlugin(plugins.at(i))) {
+            error() << "Loaded plugin" << plugins.at(i);
         }
     }
+}
+
+bool Server::initWorker(const Options &options)
+{
+    loadPlugins();
+    mOptions = options;
+    return true;
+}
+
+// For the loopback worker server, which only lives as long as we do
+static String randomSecret()
+{
+    unsigned char bytes[16];
+    FILE *f = fopen("/dev/urandom", "r");
+    const bool ok = f && fread(bytes, sizeof(bytes), 1, f) == 1;
+    if (f)
+        fclose(f);
+    if (!ok) {
+        error("Can't read /dev/urandom");
+        return String();
+    }
+    String ret;
+    for (unsigned i=0; i<sizeof(bytes); ++i)
+        ret += String::format<4>("%02x", bytes[i]);
+    return ret;
+}
+
+static inline int indexerThreads(int threadCount)
+{
+    return std::max(threadCount, ThreadPool::idealThreadCount());
+}
+
+bool Server::init(const Options &options)
+{
+    loadPlugins();
     RTags::initMessages();
 
-    mIndexerThreadPool = new ThreadPool(options.threadCount, options.clangStackSize);
+    // With a memory budget the ConcurrencyController decides how many of
+    // these threads get to run indexer jobs
+    mIndexerThreadPool = new ThreadPool(options.memoryBudget ? indexerThreads(options.threadCount) : options.threadCount,
+                                        options.clangStackSize);
 
     mOptions = options;
     if (options.options & NoBuiltinIncludes) {
@@ -106,6 +148,35 @@ bool Server::init(const Options &options)
         clearProjects();
     }
 
+    mPreambleCache.init(mOptions.dataDir + "preambles/", static_cast<int64_t>(mOptions.preambleCacheSize) * 1024 * 1024);
+    if (mOptions.options & IndexInWorkers) {
+        String hello;
+        {
+            Serializer serializer(hello);
+            serializer << mOptions.options << mOptions.clangStackSize << mOptions.defaultArguments
+                       << mOptions.excludeFilters << mOptions.ignoredCompilers << mOptions.dataDir;
+        }
+        if (!mOptions.remoteWorkers.isEmpty() && mOptions.workerSecret.isEmpty()) {
+            error("--remote-worker needs a --worker-secret-file");
+            return false;
+        }
+        if (mOptions.workerSecret.isEmpty() && mOptions.options & LoopbackWorkers)
+            mOptions.workerSecret = randomSecret();
+        mWorkerPool.init(hello, mOptions.workerSecret, mOptions.workerMaxJobs,
+                         static_cast<int64_t>(mOptions.workerMaxMemory) * 1024 * 1024);
+        for (int i=0; i<mOptions.remoteWorkers.size(); ++i)
+            mWorkerPool.addRemote(mOptions.remoteWorkers.at(i), WorkerPool::FetchChanged);
+        if (mOptions.options & LoopbackWorkers && !mWorkerPool.startLoopback(mOptions.dataDir))
+            error("Can't start loopback workers, using local ones");
+    }
+
+    if (mOptions.memoryBudget) {
+        mConcurrencyController.init(mOptions.threadCount, indexerThreads(mOptions.threadCount),
+                                    static_cast<int64_t>(mOptions.memoryBudget) * 1024 * 1024,
+                                    mOptions.options & IndexInWorkers);
+        mMemoryTimer.start(shared_from_this(), MemoryTimerInterval, 0, MemoryTimer);
+    }
+
     for (int i=0; i<10; ++i) {
         mServer = new SocketServer;
         if (mServer->listenUnix(mOptions.socketFile)) {
@@ -228,6 +299,13 @@ void Server::onNewMessage(Message *message, Connection *connection)
     if (mOptions.unloadTimer)
         mUnloadTimer.start(shared_from_this(), mOptions.unloadTimer * 1000 * 60, SingleShot, UnloadTimer);
 
+    // nothing tells the file manager about new files without its watcher
+    if (mOptions.options & NoFileManagerWatch) {
+        shared_ptr<Project> project = currentProject();
+        if (project && project->fileManager && Rct::monoMs() - project->fileManager->lastReloadTime() > 60000)
+            project->fileManager->reload();
+    }
+
     ClientMessage *m = static_cast<ClientMessage*>(message);
     const String raw = m->raw();
     if (!raw.isEmpty()) {
@@ -265,9 +343,6 @@ void Server::onNewMessage(Message *message, Connection *connection)
         connection->finish();
         break;
     }
-    shared_ptr<Project> project = currentProject();
-    if (project && project->fileManager && (Rct::monoMs() - project->fileManager->lastReloadTime()) > 60000)
-        project->fileManager->reload();
 }
 
 void Server::handleCompileMessage(CompileMessage *message, Connection *conn)
@@ -401,6 +476,9 @@ void Server::handleQueryMessage(QueryMessage *message, Connection *conn)
     case QueryMessage::ReloadFileManager:
         reloadFileManager(*message, conn);
         break;
+    case QueryMessage::LoadCompilationDatabase:
+        loadCompilationDatabase(*message, conn);
+        break;
     }
 }
 
@@ -673,8 +751,12 @@ void Server::isIndexed(const QueryMessage &query, Connection *conn)
     shared_ptr<Project> project = updateProjectForLocation(match);
     if (project) {
         bool indexed = false;
-        if (project->match(match, &indexed))
+        if (project->match(match, &indexed)) {
             ret = indexed ? 1 : 2;
+            // 3 is indexed without function bodies, see DeclarationsFirst
+            if (indexed && project->isDeclarationsOnly(Location::fileId(Path::resolved(match.pattern()))))
+                ret = 3;
+        }
     }
 
     error("=> %d", ret);
@@ -682,13 +764,23 @@ void Server::isIndexed(const QueryMessage &query, Connection *conn)
     conn->finish();
 }
 
+void Server::loadCompilationDatabase(const QueryMessage &query, Connection *conn)
+{
+    const Path path = query.query();
+    conn->write<512>("Loading compile commands from %s", path.constData());
+    conn->finish();
+    shared_ptr<CompilationDatabaseJob> job(new CompilationDatabaseJob(path, query.projects()));
+    job->argsReady().connect(this, &Server::processSourceFiles);
+    mQueryThreadPool.start(job);
+}
+
 void Server::reloadFileManager(const QueryMessage &, Connection *conn)
 {
     shared_ptr<Project> project = currentProject();
     if (project) {
         conn->write<512>("Reloading files for %s", project->path().constData());
         conn->finish();
-        project->fileManager->reload();
+        project->fileManager->reload(FileManager::Full);
     } else {
         conn->write("No current project");
         conn->finish();
@@ -777,6 +869,42 @@ void Server::startIndexerJob(const shared_ptr<ThreadPool::Job> &job)
     mIndexerThreadPool->start(job);
 }
 
+void Server::queueIndexerJob(const shared_ptr<IndexerJob> &job)
+{
+    if (!mConcurrencyController.isEnabled()) {
+        mIndexerThreadPool->start(job);
+        return;
+    }
+    {
+        MutexLocker lock(&mThrottledJobsMutex);
+        mThrottledJobs.push_back(job);
+    }
+    dispatchIndexerJobs();
+}
+
+void Server::dispatchIndexerJobs()
+{
+    List<shared_ptr<IndexerJob> > start;
+    {
+        MutexLocker lock(&mThrottledJobsMutex);
+        while (!mThrottledJobs.empty()) {
+            const shared_ptr<IndexerJob> &job = mThrottledJobs.front();
+            if (job->isAborted()) {
+                // let it finish right away so its project hears about it
+                job->setThrottled(false);
+            } else if (mConcurrencyController.tryAcquire(mThrottledJobs.size())) {
+                job->setThrottled(true);
+            } else {
+                break;
+            }
+            start.append(job);
+            mThrottledJobs.pop_front();
+        }
+    }
+    for (int i=0; i<start.size(); ++i)
+        mIndexerThreadPool->start(start.at(i));
+}
+
 void Server::startQueryJob(const shared_ptr<Job> &job)
 {
     mQueryThreadPool.start(job);
@@ -784,47 +912,54 @@ void Server::startQueryJob(const shared_ptr<Job> &job)
 
 void Server::processSourceFile(const GccArguments &args, const List<String> &projects)
 {
-    if (args.lang() == GccArguments::NoLang || mOptions.ignoredCompilers.contains(args.compiler())) {
-        return;
-    }
-    Path srcRoot;
+    processSourceFiles(List<GccArguments>() << args, projects);
+}
+
+void Server::processSourceFiles(const List<GccArguments> &args, const List<String> &projects)
+{
+    Path currentRoot;
     if (updateProject(projects)) {
-        srcRoot = currentProject()->path();
+        currentRoot = currentProject()->path();
     } else if (!projects.isEmpty()) {
-        srcRoot = projects.first();
-    } else {
-        srcRoot = args.projectRoot();
-    }
-    List<Path> inputFiles = args.inputFiles();
-    if (srcRoot.isEmpty()) {
-        error("Can't find project root for %s", String::join(inputFiles, ", ").constData());
-        return;
+        currentRoot = projects.first();
     }
 
-    debug() << inputFiles << "in" << srcRoot;
-    const int count = inputFiles.size();
-    int filtered = 0;
-    if (!mOptions.excludeFilters.isEmpty()) {
-        for (int i=0; i<count; ++i) {
-            Path &p = inputFiles[i];
-            if (Filter::filter(p, mOptions.excludeFilters) == Filter::Filtered) {
+    // project root -> (source file, build) to index
+    Map<Path, List<std::pair<Path, int> > > sources;
+    for (int i=0; i<args.size(); ++i) {
+        const GccArguments &arg = args.at(i);
+        if (arg.lang() == GccArguments::NoLang || mOptions.ignoredCompilers.contains(arg.compiler()))
+            continue;
+        const Path srcRoot = currentRoot.isEmpty() ? arg.projectRoot() : currentRoot;
+        const List<Path> inputFiles = arg.inputFiles();
+        if (srcRoot.isEmpty()) {
+            error("Can't find project root for %s", String::join(inputFiles, ", ").constData());
+            continue;
+        }
+
+        debug() << inputFiles << "in" << srcRoot;
+        const int count = inputFiles.size();
+        int filtered = 0;
+        for (int j=0; j<count; ++j) {
+            const Path &p = inputFiles.at(j);
+            if (!mOptions.excludeFilters.isEmpty() && Filter::filter(p, mOptions.excludeFilters) == Filter::Filtered) {
                 warning() << "Filtered out" << p;
-                p.clear();
                 ++filtered;
+            } else {
+                sources[srcRoot].append(std::make_pair(p, i));
             }
         }
+        if (filtered == count)
+            warning("no input file?");
     }
-    if (filtered == count) {
-        warning("no input file?");
+    if (sources.isEmpty())
         return;
-    }
 
-    {
-        MutexLocker lock(&mMutex);
-
-        shared_ptr<Project> project = mProjects.value(srcRoot);
+    MutexLocker lock(&mMutex);
+    for (Map<Path, List<std::pair<Path, int> > >::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+        shared_ptr<Project> project = mProjects.value(it->first);
         if (!project) {
-            project = addProject(srcRoot);
+            project = addProject(it->first);
             assert(project);
         }
         loadProject(project);
@@ -832,10 +967,10 @@ void Server::processSourceFile(const GccArguments &args, const List<String> &pro
         if (!mCurrentProject.lock())
             mCurrentProject = project;
 
-        const List<String> arguments = args.clangArgs();
-
-        for (int i=0; i<count; ++i) {
-            project->index(inputFiles.at(i), args.compiler(), arguments);
+        const List<std::pair<Path, int> > &files = it->second;
+        for (int i=0; i<files.size(); ++i) {
+            const GccArguments &arg = args.at(files.at(i).second);
+            project->index(files.at(i).first, arg.compiler(), arg.clangArgs());
         }
     }
 }
@@ -883,6 +1018,7 @@ void Server::loadProject(const shared_ptr<Project> &project)
 
         if (mRestoreProjects)
             project->restore();
+        project->fileManager->reload();
     }
 }
 
@@ -1108,7 +1244,14 @@ void Server::jobCount(const QueryMessage &query, Connection *conn)
             conn->write<128>("Invalid job count %s (%d)", query.query().constData(), jobCount);
         } else {
             mOptions.threadCount = jobCount;
-            mIndexerThreadPool->setConcurrentJobs(jobCount);
+            if (mConcurrencyController.isEnabled()) {
+                const int threads = indexerThreads(jobCount);
+                mIndexerThreadPool->setConcurrentJobs(threads);
+                mConcurrencyController.setJobs(jobCount, threads);
+                dispatchIndexerJobs();
+            } else {
+                mIndexerThreadPool->setConcurrentJobs(jobCount);
+            }
             conn->write<128>("Changed jobs to %d", jobCount);
         }
     }
@@ -1163,26 +1306,52 @@ void Server::handleCompletionMessage(CompletionMessage *message, Connection *con
             conn->finish();
         return;
     }
-    if (mActiveCompletions.contains(path)) {
+    if (message->flags() & CompletionMessage::WarmUp) {
+        warmUpCompletion(project, path, message->contents());
+        if (!isCompletionStream(conn))
+            conn->finish();
+        return;
+    }
+    PendingCompletion request;
+    request.line = message->line();
+    request.column = message->column();
+    request.pos = message->pos();
+    request.offset = message->offset();
+    request.max = message->max();
+    request.flags = message->flags();
+    request.contents = message->contents();
+    request.connection = conn;
+    request.sequence = ++mCompletionSequence;
+    request.received = Rct::monoMs();
+    Map<Path, ActiveCompletion>::const_iterator active = mActiveCompletions.find(path);
+    if (active != mActiveCompletions.end()) {
+        debug() << "Completion" << request.sequence << "supersedes" << active->second.sequence << "for" << path;
+        active->second.job->abort();
         PendingCompletion &pending = mPendingCompletions[path];
-        pending.line = message->line();
-        pending.column = message->column();
-        pending.pos = message->pos();
-        pending.contents = message->contents();
-        pending.connection = conn;
+        if (pending.connection) { // never started, it gets no results
+            debug() << "Completion" << request.sequence << "supersedes" << pending.sequence << "for" << path;
+            {
+                MutexLocker lock(&mMutex);
+                ++mCompletionsCancelled;
+            }
+            if (!isCompletionStream(pending.connection))
+                pending.connection->finish();
+        }
+        pending = request;
     } else {
-        startCompletion(path, message->line(), message->column(), message->pos(), message->contents(), conn);
+        startCompletion(path, request);
     }
 }
 
-void Server::startCompletion(const Path &path, int line, int column, int pos, const String &contents, Connection *conn)
+void Server::startCompletion(const Path &path, const PendingCompletion &request)
 {
+    Connection *conn = request.connection;
     {
         MutexLocker lock(&mMutex);
         mCurrentFile = path;
     }
 
-    // error() << "starting completion" << path << line << column;
+    // error() << "starting completion" << path << request.line << request.column;
     if (!mOptions.completionCacheSize) {
         conn->finish();
         return;
@@ -1209,12 +1378,17 @@ void Server::startCompletion(const Path &path, int line, int column, int pos, co
             return;
         }
         assert(!info.builds.isEmpty());
-        args = info.builds.first().args;
+        args = info.builds.first().args.list();
     }
 
-    mActiveCompletions.insert(path);
     shared_ptr<CompletionJob> job(new CompletionJob(project, isCompletionStream(conn) ? CompletionJob::Stream : CompletionJob::Sync));
-    job->init(index, unit, path, args, line, column, pos, contents, parseCount);
+    ActiveCompletion &active = mActiveCompletions[path];
+    active.job = job;
+    active.sequence = request.sequence;
+    active.received = request.received;
+    job->init(index, unit, path, args, request.line, request.column, request.pos, request.contents, parseCount);
+    job->setRange(request.offset, request.max);
+    job->setFilterPrefix(request.flags & CompletionMessage::FilterPrefix);
     job->setId(nextId());
     job->finished().connectAsync(this, &Server::onCompletionJobFinished);
     mPendingLookups[job->id()] = conn;
@@ -1224,15 +1398,92 @@ void Server::startCompletion(const Path &path, int line, int column, int pos, co
 void Server::onCompletionJobFinished(Path path)
 {
     // error() << "Got finished for" << path;
+    const ActiveCompletion active = mActiveCompletions.take(path);
+    if (active.job) {
+        enum { LatencyCount = 1000 };
+        MutexLocker lock(&mMutex);
+        if (active.job->isAborted()) {
+            ++mCompletionsCancelled;
+        } else {
+            ++mCompletionsFinished;
+            const int latency = static_cast<int>(Rct::monoMs() - active.received);
+            if (mCompletionLatencies.size() < LatencyCount) {
+                mCompletionLatencies.append(latency);
+            } else {
+                mCompletionLatencies[mCompletionLatencyIndex] = latency;
+                mCompletionLatencyIndex = (mCompletionLatencyIndex + 1) % LatencyCount;
+            }
+        }
+    }
     PendingCompletion completion = mPendingCompletions.take(path);
     if (completion.line != -1) {
-        startCompletion(path, completion.line, completion.column, completion.pos, completion.contents, completion.connection);
+        startCompletion(path, completion);
         // ### could the connection be deleted by now?
-    } else {
-        mActiveCompletions.remove(path);
     }
 }
 
+Server::CompletionStats Server::completionStats() const
+{
+    MutexLocker lock(&mMutex);
+    CompletionStats stats;
+    stats.completed = mCompletionsFinished;
+    stats.cancelled = mCompletionsCancelled;
+    if (!mCompletionLatencies.isEmpty()) {
+        List<int> sorted = mCompletionLatencies;
+        std::sort(sorted.begin(), sorted.end());
+        stats.p50 = sorted.at(sorted.size() / 2);
+        stats.p99 = sorted.at(std::min<int>(sorted.size() - 1, (sorted.size() * 99) / 100));
+    }
+    return stats;
+}
+
+void Server::warmUpCompletion(const shared_ptr<Project> &project, const Path &path, const String &contents)
+{
+    if (!mOptions.completionCacheSize)
+        return;
+    for (LinkedList<PendingWarmUp>::iterator it = mPendingWarmUps.begin(); it != mPendingWarmUps.end(); ++it) {
+        if (it->path == path) {
+            mPendingWarmUps.erase(it);
+            break;
+        }
+    }
+    PendingWarmUp warmUp;
+    warmUp.path = path;
+    warmUp.contents = contents;
+    warmUp.project = project;
+    mPendingWarmUps.push_back(warmUp);
+    // no point in preparing more files than the cache holds
+    while (static_cast<int>(mPendingWarmUps.size()) > mOptions.completionCacheSize)
+        mPendingWarmUps.pop_front();
+    startWarmUp();
+}
+
+// Warm-ups run one at a time so they never take more than one indexer thread
+void Server::startWarmUp()
+{
+    while (mActiveWarmUp.isEmpty() && !mPendingWarmUps.empty()) {
+        const PendingWarmUp warmUp = mPendingWarmUps.back();
+        mPendingWarmUps.pop_back();
+        shared_ptr<Project> project = warmUp.project.lock();
+        // a running completion leaves its unit in the cache anyway
+        if (!project || mActiveCompletions.contains(warmUp.path))
+            continue;
+        shared_ptr<ReparseJob> job = project->createWarmUpJob(warmUp.path, warmUp.contents);
+        if (!job)
+            continue;
+        mActiveWarmUp = warmUp.path;
+        job->finished().connectAsync(this, &Server::onWarmUpFinished);
+        startIndexerJob(job);
+    }
+}
+
+void Server::onWarmUpFinished(Path path)
+{
+    assert(path == mActiveWarmUp);
+    mActiveWarmUp.clear();
+    startWarmUp();
+}
+
 bool Server::isCompletionStream(Connection* conn) const
 {
     SocketClient *client = conn->client();
@@ -1301,7 +1552,10 @@ bool Server::saveFileIds() const
 
 void Server::timerEvent(TimerEvent *e)
 {
-    if (e->userData() == UnloadTimer) {
+    if (e->userData() == MemoryTimer) {
+        mConcurrencyController.sample();
+        dispatchIndexerJobs();
+    } else if (e->userData() == UnloadTimer) {
         MutexLocker lock(&mMutex);
         shared_ptr<Project> cur = mCurrentProject.lock();
         for (ProjectsMap::const_iterator it = mProjects.begin(); it != mProjects.end(); ++it) {
@@ -5,14 +5,18 @@
 #include "CompileMessage.h"
 #include "CreateOutputMessage.h"
 #include "CompletionMessage.h"
+#include "ConcurrencyController.h"
 #include "FileManager.h"
 #include "QueryMessage.h"
+#include "PreambleCache.h"
 #include "RTags.h"
 #include "ScanJob.h"
+#include "WorkerPool.h"
 #include "RTagsPluginFactory.h"
 #include <rct/Connection.h>
 #include <rct/EventReceiver.h>
 #include <rct/FileSystemWatcher.h>
+#include <rct/LinkedList.h>
 #include <rct/List.h>
 #include <rct/Map.h>
 #include <rct/String.h>
@@ -29,10 +33,11 @@ class Job;
 class TimerEvent;
 class Project;
 class IndexerJob;
+class CompletionJob;
 class Server : public EventReceiver
 {
 public:
-    enum { DatabaseVersion = 23 };
+    enum { DatabaseVersion = 28 };
 
     Server();
     ~Server();
@@ -50,25 +55,51 @@ public:
         NoStartupCurrentProject = 0x100,
         WatchSystemPaths = 0x200,
         NoFileManagerWatch = 0x400,
-        NoEsprima = 0x800
+        NoEsprima = 0x800,
+        ReindexAllDependents = 0x1000,
+        ClangIndexApi = 0x2000,
+        IndexInWorkers = 0x4000,
+        LoopbackWorkers = 0x8000,
+        DeclarationsFirst = 0x10000
     };
     ThreadPool *threadPool() const { return mIndexerThreadPool; }
     void startQueryJob(const shared_ptr<Job> &job);
     void startIndexerJob(const shared_ptr<ThreadPool::Job> &job);
+    // Indexer jobs wait here, without a thread, until the ConcurrencyController lets them in
+    void queueIndexerJob(const shared_ptr<IndexerJob> &job);
+    void dispatchIndexerJobs();
     struct Options {
-        Options() : options(0), threadCount(0), completionCacheSize(0), unloadTimer(0), clangStackSize(0) {}
+        Options()
+            : options(0), threadCount(0), completionCacheSize(0), unloadTimer(0), clangStackSize(0), preambleCacheSize(0),
+              workerMaxJobs(0), workerMaxMemory(0), memoryBudget(0), completionCacheMemory(0)
+        {}
         Path socketFile, dataDir;
         unsigned options;
-        int threadCount, completionCacheSize, unloadTimer, clangStackSize;
-        List<String> defaultArguments, excludeFilters;
+        int threadCount, completionCacheSize, unloadTimer, clangStackSize, preambleCacheSize;
+        int workerMaxJobs, workerMaxMemory, memoryBudget, completionCacheMemory; // memory in megabytes
+        List<String> defaultArguments, excludeFilters, remoteWorkers;
+        String workerSecret;
         Set<Path> ignoredCompilers;
     };
     bool init(const Options &options);
+    // For rdm --worker processes, options come from the indexing rdm
+    bool initWorker(const Options &options);
     const Options &options() const { return mOptions; }
     Path currentFile() const { MutexLocker lock(&mMutex); return mCurrentFile; }
     bool saveFileIds() const;
     RTagsPluginFactory &factory() { return mPluginFactory; }
+    PreambleCache &preambleCache() { return mPreambleCache; }
+    WorkerPool &workerPool() { return mWorkerPool; }
+    ConcurrencyController &concurrencyController() { return mConcurrencyController; }
+    struct CompletionStats
+    {
+        CompletionStats() : completed(0), cancelled(0), p50(0), p99(0) {}
+        int completed, cancelled;
+        int p50, p99; // ms from request to results, over the latest completions
+    };
+    CompletionStats completionStats() const;
 private:
+    void loadPlugins();
     bool selectProject(const Match &match, Connection *conn);
     bool updateProject(const List<String> &projects);
 
@@ -84,6 +115,7 @@ private:
     shared_ptr<Project> setCurrentProject(const shared_ptr<Project> &project);
     void event(const Event *event);
     void processSourceFile(const GccArguments &args, const List<String> &projects);
+    void processSourceFiles(const List<GccArguments> &args, const List<String> &projects);
     void onNewMessage(Message *message, Connection *conn);
     void onConnectionDestroyed(Connection *o);
     void clearProjects();
@@ -109,6 +141,7 @@ private:
     void isIndexed(const QueryMessage &query, Connection *conn);
     void hasFileManager(const QueryMessage &query, Connection *conn);
     void reloadFileManager(const QueryMessage &query, Connection *conn);
+    void loadCompilationDatabase(const QueryMessage &query, Connection *conn);
     void preprocessFile(const QueryMessage &query, Connection *conn);
     void findFile(const QueryMessage &query, Connection *conn);
     void dumpFile(const QueryMessage &query, Connection *conn);
@@ -133,7 +166,9 @@ private:
     shared_ptr<Project> addProject(const Path &path);
     void loadProject(const shared_ptr<Project> &project);
     void onCompletionJobFinished(Path path);
-    void startCompletion(const Path &path, int line, int column, int pos, const String &contents, Connection *conn);
+    void warmUpCompletion(const shared_ptr<Project> &project, const Path &path, const String &contents);
+    void startWarmUp();
+    void onWarmUpFinished(Path path);
 
     typedef Map<Path, shared_ptr<Project> > ProjectsMap;
     ProjectsMap mProjects;
@@ -154,19 +189,51 @@ private:
     struct PendingCompletion
     {
         PendingCompletion()
-            : line(-1), column(-1), pos(-1), connection(0)
+            : line(-1), column(-1), pos(-1), offset(0), max(-1), flags(0), connection(0), sequence(0), received(0)
         {}
-        int line, column, pos;
+        int line, column, pos, offset, max;
+        unsigned flags;
         String contents;
         Connection *connection;
+        int sequence;
+        uint64_t received;
     };
+    void startCompletion(const Path &path, const PendingCompletion &request);
     Map<Path, PendingCompletion> mPendingCompletions;
-    Set<Path> mActiveCompletions;
+    struct ActiveCompletion
+    {
+        ActiveCompletion()
+            : sequence(0), received(0)
+        {}
+        shared_ptr<CompletionJob> job;
+        int sequence;
+        uint64_t received;
+    };
+    Map<Path, ActiveCompletion> mActiveCompletions;
+    // Requests are numbered as they come in, a newer one for a path makes
+    // the running job stale
+    int mCompletionSequence;
+    List<int> mCompletionLatencies; // ring buffer, protected by mMutex
+    int mCompletionLatencyIndex, mCompletionsFinished, mCompletionsCancelled;
+    struct PendingWarmUp
+    {
+        Path path;
+        String contents;
+        weak_ptr<Project> project;
+    };
+    LinkedList<PendingWarmUp> mPendingWarmUps; // most recent last
+    Path mActiveWarmUp;
 
     bool mRestoreProjects;
     Timer mUnloadTimer;
 
     RTagsPluginFactory mPluginFactory;
+    PreambleCache mPreambleCache;
+    WorkerPool mWorkerPool;
+    ConcurrencyController mConcurrencyController;
+    Timer mMemoryTimer;
+    LinkedList<shared_ptr<IndexerJob> > mThrottledJobs;
+    Mutex mThrottledJobsMutex;
 
     Path mCurrentFile;
 
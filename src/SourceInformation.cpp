@@ -0,0 +1,55 @@
+#include "SourceInformation.h"
+#include "RTags.h"
+#include <rct/Map.h>
+#include <rct/Mutex.h>
+
+static Mutex sMutex;
+static Map<uint64_t, weak_ptr<const List<String> > > sArguments;
+
+// Drops the table entry along with the last reference to a list
+struct ReleaseArguments
+{
+    ReleaseArguments(uint64_t k)
+        : key(k)
+    {}
+    void operator()(const List<String> *args) const
+    {
+        {
+            MutexLocker lock(&sMutex);
+            Map<uint64_t, weak_ptr<const List<String> > >::iterator it = sArguments.find(key);
+            if (it != sArguments.end() && it->second.expired())
+                sArguments.erase(it);
+        }
+        delete args;
+    }
+    uint64_t key;
+};
+
+CompileArguments::CompileArguments(const List<String> &args)
+    : mKey(0)
+{
+    if (args.isEmpty())
+        return;
+    mKey = RTags::hash(args);
+    if (!mKey)
+        mKey = 1;
+    // declared outside the lock, if it ends up holding the last reference
+    // its deleter takes sMutex
+    shared_ptr<const List<String> > existing;
+    MutexLocker lock(&sMutex);
+    weak_ptr<const List<String> > &entry = sArguments[mKey];
+    existing = entry.lock();
+    if (existing && *existing == args) {
+        mArgs = existing;
+    } else {
+        mArgs.reset(new List<String>(args), ReleaseArguments(mKey));
+        if (!existing)
+            entry = mArgs;
+    }
+}
+
+const List<String> &CompileArguments::list() const
+{
+    static const List<String> empty;
+    return mArgs ? *mArgs : empty;
+}
@@ -4,6 +4,48 @@
 #include <rct/List.h>
 #include <rct/String.h>
 #include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/Tr1.h>
+
+// Most sources in a project are compiled with one of a handful of argument
+// lists. Each distinct list is kept once, in a table shared by all projects,
+// and compared by its content hash. A list leaves the table when the last
+// CompileArguments using it goes away
+class CompileArguments
+{
+public:
+    CompileArguments()
+        : mKey(0)
+    {}
+    CompileArguments(const List<String> &args);
+
+    const List<String> &list() const;
+    uint64_t key() const { return mKey; }
+    bool isEmpty() const { return !mKey; }
+
+    bool operator==(const CompileArguments &other) const
+    {
+        return mKey == other.mKey && (mArgs == other.mArgs || list() == other.list());
+    }
+    bool operator!=(const CompileArguments &other) const { return !operator==(other); }
+private:
+    uint64_t mKey;
+    shared_ptr<const List<String> > mArgs;
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const CompileArguments &t)
+{
+    s << t.list();
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, CompileArguments &t)
+{
+    List<String> args;
+    s >> args;
+    t = CompileArguments(args);
+    return s;
+}
 
 class SourceInformation
 {
@@ -16,11 +58,14 @@ public:
 
     struct Build
     {
-        Build(const Path &c = Path(), const List<String> &a = List<String>())
-            : compiler(c), args(a)
+        Build(const Path &c = Path(), const CompileArguments &a = CompileArguments())
+            : compiler(c), args(a), command(0)
         {}
         Path compiler;
-        List<String> args;
+        CompileArguments args;
+        // hash of the unresolved compiler and the arguments this build came
+        // from, not serialized
+        uint64_t command;
     };
     List<Build> builds;
 
@@ -42,7 +87,7 @@ public:
                                         parsed ? ("Parsed: " +String::formatTime(parsed, String::DateTime)).constData() : "Not parsed");
         for (int i=0; i<builds.size(); ++i) {
             out += String::format<256>("  %s %s\n", builds.at(i).compiler.constData(),
-                                       String::join(builds.at(i).args, ' ').constData());
+                                       String::join(builds.at(i).args.list(), ' ').constData());
         }
         return out;
     }
@@ -1,4 +1,6 @@
 #include "StatusJob.h"
+#include <rct/MemoryMonitor.h>
+#include <rct/Rct.h>
 #include "CursorInfo.h"
 #include "RTags.h"
 #include "Server.h"
@@ -14,7 +16,7 @@ StatusJob::StatusJob(const QueryMessage &q, const shared_ptr<Project> &project)
 void StatusJob::execute()
 {
     bool matched = false;
-    const char *alternatives = "fileids|dependencies|fileinfos|symbols|symbolnames|errorsymbols|watchedpaths|compilers";
+    const char *alternatives = "fileids|dependencies|fileinfos|symbols|symbolnames|errorsymbols|watchedpaths|compilers|cachedunits|completions|preamblecache|workers|concurrency|tiers";
     if (!strcasecmp(query.constData(), "fileids")) {
         matched = true;
         write(delimiter);
@@ -27,6 +29,69 @@ void StatusJob::execute()
             return;
     }
 
+    // server wide, these work without a current project
+    if (query.isEmpty() || !strcasecmp(query.constData(), "completions")) {
+        matched = true;
+        write(delimiter);
+        write("completions");
+        write(delimiter);
+        const Server::CompletionStats stats = Server::instance()->completionStats();
+        write<256>("  %d completed, %d cancelled by newer requests", stats.completed, stats.cancelled);
+        write<128>("  latency p50 %dms, p99 %dms", stats.p50, stats.p99);
+    }
+
+    if (query.isEmpty() || !strcasecmp(query.constData(), "preamblecache")) {
+        matched = true;
+        write(delimiter);
+        write("preamblecache");
+        write(delimiter);
+        const PreambleCache &cache = Server::instance()->preambleCache();
+        const PreambleCache::Stats stats = cache.stats();
+        const int lookups = stats.hits + stats.misses;
+        write<256>("  %d hits, %d misses (%.1f%% hit ratio), %d built, %d failed, %d evicted",
+                   stats.hits, stats.misses, lookups ? (100.0 * stats.hits) / lookups : 0.0,
+                   stats.builds, stats.failures, stats.evictions);
+        write<128>("  %d preambles using %.1fmb", stats.entries, stats.size / (1024.0 * 1024.0));
+        const List<std::pair<Path, int64_t> > entries = cache.entries();
+        for (List<std::pair<Path, int64_t> >::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+            write<512>("  %s: %lldkb", it->first.constData(), static_cast<long long>(it->second / 1024));
+        }
+    }
+
+    if (query.isEmpty() || !strcasecmp(query.constData(), "workers")) {
+        matched = true;
+        write(delimiter);
+        write("workers");
+        write(delimiter);
+        const WorkerPool::Stats stats = Server::instance()->workerPool().stats();
+        write<256>("  %d started (%d remote), %d recycled, %d crashed, %d idle",
+                   stats.started, stats.remote, stats.recycled, stats.crashed, stats.idle);
+        write<128>("  rdm using %.1fmb", MemoryMonitor::usage() / (1024.0 * 1024.0));
+    }
+
+    if (query.isEmpty() || !strcasecmp(query.constData(), "concurrency")) {
+        matched = true;
+        write(delimiter);
+        write("concurrency");
+        write(delimiter);
+        const ConcurrencyController::Stats stats = Server::instance()->concurrencyController().stats();
+        if (!stats.budget) {
+            write("  No memory budget");
+        } else {
+            write<256>("  %d of %d jobs allowed, %d running, %d queued",
+                       stats.limit, stats.maxJobs, stats.running, stats.waiting);
+            write<256>("  %.1fmb of %.1fmb used, jobs use about %.1fmb",
+                       stats.memory / (1024.0 * 1024.0), stats.budget / (1024.0 * 1024.0),
+                       stats.jobEstimate / (1024.0 * 1024.0));
+            const uint64_t now = Rct::monoMs();
+            for (int i=stats.decisions.size() - 1; i>=0; --i) {
+                const ConcurrencyController::Decision &decision = stats.decisions.at(i);
+                write<256>("  %llus ago: %d jobs, %s", static_cast<unsigned long long>((now - decision.time) / 1000),
+                           decision.limit, decision.reason.constData());
+            }
+        }
+    }
+
     shared_ptr<Project> proj = project();
     if (!proj) {
         if (!matched) {
@@ -149,18 +214,37 @@ void StatusJob::execute()
         for (SourceInformationMap::const_iterator it = map.begin(); it != map.end(); ++it) {
             for (int i=0; i<it->second.builds.size(); ++i) {
                 write<512>("  %s: %s", Location::path(it->first).constData(), it->second.builds.at(i).compiler.constData(),
-                           String::join(it->second.builds.at(i).args, " ").constData());
+                           String::join(it->second.builds.at(i).args.list(), " ").constData());
             }
         }
     }
 
+    if (query.isEmpty() || !strcasecmp(query.constData(), "tiers")) {
+        matched = true;
+        write(delimiter);
+        write("tiers");
+        write(delimiter);
+        const Set<uint32_t> declarations = proj->declarationFiles();
+        write<128>("  %d files indexed without function bodies, %d sources waiting for the full pass",
+                   declarations.size(), proj->secondPassCount());
+        for (Set<uint32_t>::const_iterator it = declarations.begin(); it != declarations.end(); ++it)
+            write<256>("  %s: declarations", Location::path(*it).constData());
+    }
+
     if (query.isEmpty() || !strcasecmp(query.constData(), "cachedunits")) {
+        matched = true;
         write(delimiter);
         write("cachedUnits");
         write(delimiter);
-        const List<std::pair<Path, List<String> > > caches = proj->cachedUnits();
-        for (List<std::pair<Path, List<String> > >::const_iterator it = caches.begin(); it != caches.end(); ++it) {
-            write<512>("  %s: %s", it->first.constData(), String::join(it->second, " ").constData());
+        const UnitCache::Stats stats = proj->unitCacheStats();
+        const int lookups = stats.hits + stats.misses;
+        write<256>("  %d hits, %d misses (%.1f%% hit ratio), %d evicted",
+                   stats.hits, stats.misses, lookups ? (100.0 * stats.hits) / lookups : 0.0, stats.evictions);
+        write<128>("  %d units using %.1fmb", stats.count, stats.memory / (1024.0 * 1024.0));
+        const List<UnitCache::Entry> caches = proj->cachedUnits();
+        for (List<UnitCache::Entry>::const_iterator it = caches.begin(); it != caches.end(); ++it) {
+            write<512>("  %s (%.1fmb, parsed %d times): %s", it->path.constData(), it->memory / (1024.0 * 1024.0),
+                       it->parseCount, String::join(it->arguments, " ").constData());
         }
     }
 }
@@ -0,0 +1,165 @@
+#include "TokenIndex.h"
+#include "RTags.h"
+#include <algorithm>
+
+static inline bool symbolChar(char ch)
+{
+    switch (ch) {
+    case '_':
+    case '~':
+        return true;
+    default:
+        break;
+    }
+    return isalnum(ch);
+}
+
+TokenIndex::TokenIndex()
+    : mCount(0)
+{
+}
+
+void TokenIndex::clear()
+{
+    mEntries.clear();
+    mSlots.clear();
+    mCount = 0;
+}
+
+void TokenIndex::update(const String &contents)
+{
+    const char *data = contents.constData();
+    const char *old = mContents.constData();
+    const int size = contents.size();
+    const int oldSize = mContents.size();
+    const int max = std::min(size, oldSize);
+    int prefix = 0;
+    while (prefix < max && data[prefix] == old[prefix])
+        ++prefix;
+    if (prefix == size && prefix == oldSize && !mEntries.isEmpty())
+        return;
+    int suffix = 0;
+    while (suffix < max - prefix && data[size - suffix - 1] == old[oldSize - suffix - 1])
+        ++suffix;
+
+    // widen the edit to whole tokens, the text outside of it is the same in both
+    int start = prefix;
+    while (start > 0 && symbolChar(data[start - 1]))
+        --start;
+    int end = size - suffix, oldEnd = oldSize - suffix;
+    while (end < size && symbolChar(data[end])) {
+        ++end;
+        ++oldEnd;
+    }
+
+    if (mEntries.isEmpty() || (end - start) + (oldEnd - start) > size / 2) {
+        clear();
+        mContents = contents;
+        addTokens(mContents.constData(), 0, size);
+        return;
+    }
+
+    const int delta = end - oldEnd;
+    for (int i=0; i<mEntries.size(); ++i) {
+        List<int> &list = mEntries[i].positions;
+        List<int>::iterator from = std::lower_bound(list.begin(), list.end(), start);
+        List<int>::iterator to = std::lower_bound(from, list.end(), oldEnd);
+        mCount -= (to - from);
+        from = list.erase(from, to);
+        if (delta) {
+            while (from != list.end()) {
+                *from += delta;
+                ++from;
+            }
+        }
+    }
+    mContents = contents;
+    addTokens(mContents.constData(), start, end);
+}
+
+void TokenIndex::addTokens(const char *data, int from, int to)
+{
+    int tokenStart = -1;
+    for (int i=from; i<=to; ++i) {
+        if (i < to && symbolChar(data[i])) {
+            if (tokenStart == -1)
+                tokenStart = i;
+        } else if (tokenStart != -1) {
+            List<int> &list = positions(data + tokenStart, i - tokenStart);
+            list.insert(std::lower_bound(list.begin(), list.end(), tokenStart), tokenStart);
+            ++mCount;
+            tokenStart = -1;
+        }
+    }
+}
+
+int TokenIndex::find(const char *token, int length, uint64_t hash) const
+{
+    if (mSlots.isEmpty())
+        return -1;
+    const int mask = mSlots.size() - 1;
+    for (int slot = hash & mask; mSlots.at(slot); slot = (slot + 1) & mask) {
+        const Entry &entry = mEntries.at(mSlots.at(slot) - 1);
+        if (entry.hash == hash && entry.token.size() == length && !memcmp(entry.token.constData(), token, length))
+            return mSlots.at(slot) - 1;
+    }
+    return -1;
+}
+
+List<int> &TokenIndex::positions(const char *token, int length)
+{
+    const uint64_t hash = RTags::hash(token, length);
+    const int idx = find(token, length, hash);
+    if (idx != -1)
+        return mEntries[idx].positions;
+    if ((mEntries.size() + 1) * 2 > mSlots.size())
+        rehash(std::max<int>(64, mSlots.size() * 2));
+    Entry entry;
+    entry.hash = hash;
+    entry.token = String(token, length);
+    mEntries.append(entry);
+    const int mask = mSlots.size() - 1;
+    int slot = hash & mask;
+    while (mSlots.at(slot))
+        slot = (slot + 1) & mask;
+    mSlots[slot] = mEntries.size();
+    return mEntries.last().positions;
+}
+
+void TokenIndex::rehash(int slotCount)
+{
+    mSlots.clear();
+    mSlots.resize(slotCount, 0);
+    const int mask = slotCount - 1;
+    for (int i=0; i<mEntries.size(); ++i) {
+        int slot = mEntries.at(i).hash & mask;
+        while (mSlots.at(slot))
+            slot = (slot + 1) & mask;
+        mSlots[slot] = i + 1;
+    }
+}
+
+int TokenIndex::distance(const String &token, int pos, int skip) const
+{
+    const int idx = find(token.constData(), token.size(), RTags::hash(token));
+    if (idx == -1)
+        return -1;
+    const List<int> &list = mEntries.at(idx).positions;
+    List<int>::const_iterator it = std::lower_bound(list.begin(), list.end(), pos);
+    int ret = -1;
+    for (List<int>::const_iterator after = it; after != list.end(); ++after) {
+        if (*after != skip) {
+            ret = *after - pos;
+            break;
+        }
+    }
+    while (it != list.begin()) {
+        --it;
+        if (*it != skip) {
+            if (ret == -1 || pos - *it < ret)
+                ret = pos - *it;
+            break;
+        }
+    }
+    return ret;
+}
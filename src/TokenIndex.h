@@ -0,0 +1,39 @@
+#ifndef TokenIndex_h
+#define TokenIndex_h
+
+#include <rct/List.h>
+#include <rct/String.h>
+
+// Where each identifier occurs in a buffer, for ranking completions by how
+// close to the cursor they are used. update() only retokenizes the part of
+// the buffer that differs from the previous call
+class TokenIndex
+{
+public:
+    TokenIndex();
+
+    void update(const String &contents);
+    // Distance from pos to the closest occurrence of token, ignoring one that
+    // starts at skip. -1 if it doesn't occur
+    int distance(const String &token, int pos, int skip = -1) const;
+    int count() const { return mCount; }
+private:
+    void clear();
+    void addTokens(const char *data, int from, int to);
+    int find(const char *token, int length, uint64_t hash) const;
+    List<int> &positions(const char *token, int length);
+    void rehash(int slotCount);
+
+    struct Entry
+    {
+        uint64_t hash;
+        String token;
+        List<int> positions; // sorted
+    };
+    List<Entry> mEntries;
+    List<int> mSlots; // open addressing, index into mEntries + 1, 0 if free
+    String mContents;
+    int mCount;
+};
+
+#endif
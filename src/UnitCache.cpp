@@ -0,0 +1,89 @@
+#include "UnitCache.h"
+#include <rct/Log.h>
+
+UnitCache::UnitCache()
+{
+}
+
+UnitCache::~UnitCache()
+{
+    for (Iterator it = mUnits.begin(); it != mUnits.end(); ++it)
+        delete *it;
+}
+
+static int64_t unitMemory(CXTranslationUnit unit)
+{
+    CXTUResourceUsage usage = clang_getCXTUResourceUsage(unit);
+    int64_t ret = 0;
+    for (unsigned i=0; i<usage.numEntries; ++i)
+        ret += usage.entries[i].amount;
+    clang_disposeCXTUResourceUsage(usage);
+    return ret;
+}
+
+void UnitCache::insert(CachedUnit *unit, int maxCount, int64_t maxMemory)
+{
+    remove(unit->path, unit->arguments);
+    unit->memory = unitMemory(unit->unit);
+    mIndex[Key(unit->path, unit->arguments.key())] = mUnits.insert(mUnits.end(), unit);
+    ++mStats.count;
+    mStats.memory += unit->memory;
+
+    // the unit we just got stays even if it's over budget on its own
+    while (mStats.count > 1 && (mStats.count > maxCount || (maxMemory > 0 && mStats.memory > maxMemory))) {
+        CachedUnit *oldest = mUnits.front();
+        debug() << "Evicting cached unit for" << oldest->path << oldest->memory / (1024 * 1024) << "mb";
+        delete takeAt(mIndex.find(Key(oldest->path, oldest->arguments.key())));
+        ++mStats.evictions;
+    }
+}
+
+Map<UnitCache::Key, UnitCache::Iterator>::iterator UnitCache::find(const Path &path, const CompileArguments &arguments)
+{
+    if (!arguments.isEmpty())
+        return mIndex.find(Key(path, arguments.key()));
+    // keys for the same path are next to each other
+    Map<Key, Iterator>::iterator it = mIndex.lower_bound(Key(path, 0));
+    if (it != mIndex.end() && it->first.first == path)
+        return it;
+    return mIndex.end();
+}
+
+CachedUnit *UnitCache::takeAt(Map<Key, Iterator>::iterator it)
+{
+    CachedUnit *unit = *it->second;
+    mUnits.erase(it->second);
+    mIndex.erase(it);
+    --mStats.count;
+    mStats.memory -= unit->memory;
+    return unit;
+}
+
+CachedUnit *UnitCache::take(const Path &path, const CompileArguments &arguments)
+{
+    Map<Key, Iterator>::iterator it = find(path, arguments);
+    if (it == mIndex.end() || (!arguments.isEmpty() && (*it->second)->arguments != arguments)) {
+        ++mStats.misses;
+        return 0;
+    }
+    ++mStats.hits;
+    return takeAt(it);
+}
+
+void UnitCache::remove(const Path &path, const CompileArguments &arguments)
+{
+    Map<Key, Iterator>::iterator it = find(path, arguments);
+    if (it != mIndex.end())
+        delete takeAt(it);
+}
+
+List<UnitCache::Entry> UnitCache::entries() const
+{
+    List<Entry> ret;
+    ret.reserve(mStats.count);
+    for (LinkedList<CachedUnit*>::const_iterator it = mUnits.begin(); it != mUnits.end(); ++it) {
+        const Entry entry = { (*it)->path, (*it)->arguments.list(), (*it)->memory, (*it)->parseCount };
+        ret.append(entry);
+    }
+    return ret;
+}
@@ -0,0 +1,82 @@
+#ifndef UnitCache_h
+#define UnitCache_h
+
+#include "SourceInformation.h"
+#include <rct/LinkedList.h>
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Path.h>
+#include <clang-c/Index.h>
+
+struct CachedUnit
+{
+    CachedUnit()
+        : unit(0), index(0), parseCount(0), memory(0)
+    {}
+    ~CachedUnit()
+    {
+        clear();
+    }
+    void clear()
+    {
+        if (unit) {
+            clang_disposeTranslationUnit(unit);
+            unit = 0;
+        }
+
+        if (index) {
+            clang_disposeIndex(index);
+            index = 0;
+        }
+    }
+    CXTranslationUnit unit;
+    CXIndex index;
+    Path path;
+    CompileArguments arguments;
+    int parseCount;
+    int64_t memory; // clang_getCXTUResourceUsage when it was inserted
+};
+
+// Translation units kept around for completion, looked up by path and
+// argument key and evicted least recently used first when there are too many
+// of them or they use too much memory. Not thread safe, Project locks
+class UnitCache
+{
+public:
+    UnitCache();
+    ~UnitCache();
+
+    // Takes ownership. maxMemory is in bytes, 0 for no limit
+    void insert(CachedUnit *unit, int maxCount, int64_t maxMemory);
+    // The caller owns the returned unit. Empty arguments match any unit for path
+    CachedUnit *take(const Path &path, const CompileArguments &arguments);
+    void remove(const Path &path, const CompileArguments &arguments);
+
+    struct Entry
+    {
+        Path path;
+        List<String> arguments;
+        int64_t memory;
+        int parseCount;
+    };
+    List<Entry> entries() const;
+
+    struct Stats
+    {
+        Stats() : hits(0), misses(0), evictions(0), count(0), memory(0) {}
+        int hits, misses, evictions, count;
+        int64_t memory;
+    };
+    Stats stats() const { return mStats; }
+private:
+    typedef std::pair<Path, uint64_t> Key;
+    typedef LinkedList<CachedUnit*>::iterator Iterator;
+    Map<Key, Iterator>::iterator find(const Path &path, const CompileArguments &arguments);
+    CachedUnit *takeAt(Map<Key, Iterator>::iterator it);
+
+    LinkedList<CachedUnit*> mUnits; // least recently used first
+    Map<Key, Iterator> mIndex;
+    Stats mStats;
+};
+
+#endif
@@ -0,0 +1,568 @@
+#include "WorkerPool.h"
+#include "RTags.h"
+#include "Server.h"
+#include <rct/Log.h>
+#include <rct/Rct.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool writeAll(int fd, const char *data, int size)
+{
+    while (size) {
+        int w;
+        eintrwrap(w, ::write(fd, data, size));
+        if (w <= 0)
+            return false;
+        data += w;
+        size -= w;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *data, int size)
+{
+    while (size) {
+        int r;
+        eintrwrap(r, ::read(fd, data, size));
+        if (r <= 0)
+            return false;
+        data += r;
+        size -= r;
+    }
+    return true;
+}
+
+bool WorkerChannel::send(int type, const String &payload)
+{
+    if (mFd == -1)
+        return false;
+    const int header[] = { payload.size(), type };
+    return (writeAll(mFd, reinterpret_cast<const char*>(header), sizeof(header))
+            && writeAll(mFd, payload.constData(), payload.size()));
+}
+
+bool WorkerChannel::receive(int &type, String &payload, int maxSize)
+{
+    if (mFd == -1)
+        return false;
+    int header[2];
+    if (!readAll(mFd, reinterpret_cast<char*>(header), sizeof(header)) || header[0] < 0)
+        return false;
+    if (header[0] > maxSize) {
+        error("Refusing %d byte frame on fd %d", header[0], mFd);
+        return false;
+    }
+    type = header[1];
+    payload.resize(header[0]);
+    return readAll(mFd, payload.data(), header[0]);
+}
+
+void WorkerChannel::close()
+{
+    if (mFd != -1) {
+        int ret;
+        eintrwrap(ret, ::close(mFd));
+        mFd = -1;
+    }
+}
+
+static bool unixAddress(const String &address, sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= static_cast<int>(sizeof(addr.sun_path))) {
+        error("Socket path too long %s", address.constData());
+        return false;
+    }
+    memcpy(addr.sun_path, address.constData(), address.size() + 1);
+    return true;
+}
+
+static addrinfo *tcpAddress(const String &address, bool passive)
+{
+    // workers listen on the loopback interface unless told otherwise
+    String host = "127.0.0.1", port = address;
+    const int colon = address.lastIndexOf(':');
+    if (colon != -1) {
+        host = address.left(colon);
+        port = address.mid(colon + 1);
+    }
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+    addrinfo *ret = 0;
+    const int err = getaddrinfo(host.constData(), port.constData(), &hints, &ret);
+    if (err) {
+        error("Can't resolve %s %s", address.constData(), gai_strerror(err));
+        return 0;
+    }
+    return ret;
+}
+
+int WorkerChannel::connect(const String &address)
+{
+    int fd = -1;
+    if (address.contains('/')) {
+        sockaddr_un addr;
+        if (!unixAddress(address, addr))
+            return -1;
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    } else if (addrinfo *addresses = tcpAddress(address, false)) {
+        for (addrinfo *addr = addresses; addr && fd == -1; addr = addr->ai_next) {
+            fd = ::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd != -1 && ::connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (fd != -1) {
+            // lots of small requests and replies
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+    if (fd != -1)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static bool isLoopback(const sockaddr *addr)
+{
+    switch (addr->sa_family) {
+    case AF_INET:
+        return (ntohl(reinterpret_cast<const sockaddr_in*>(addr)->sin_addr.s_addr) >> 24) == 127;
+    case AF_INET6:
+        return IN6_IS_ADDR_LOOPBACK(&reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr);
+    }
+    return false;
+}
+
+int WorkerChannel::listen(const String &address, bool allowPublic)
+{
+    int fd = -1;
+    if (address.contains('/')) {
+        sockaddr_un addr;
+        if (!unixAddress(address, addr))
+            return -1;
+        Path::rm(address);
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+                         || ::listen(fd, SOMAXCONN) == -1)) {
+            ::close(fd);
+            fd = -1;
+        }
+    } else if (addrinfo *addresses = tcpAddress(address, true)) {
+        for (addrinfo *addr = addresses; addr && fd == -1; addr = addr->ai_next) {
+            if (!allowPublic && !isLoopback(addr->ai_addr)) {
+                error("Not listening on %s, it isn't a loopback address. Pass --worker-server-public to allow it",
+                      address.constData());
+                continue;
+            }
+            fd = ::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd == -1)
+                continue;
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (::bind(fd, addr->ai_addr, addr->ai_addrlen) == -1 || ::listen(fd, SOMAXCONN) == -1) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+    }
+    if (fd != -1)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+WorkerPool::WorkerPool()
+    : mNextRemote(0), mLoopbackPid(0), mMaxJobs(0), mMaxMemory(0)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    List<shared_ptr<Worker> > idle;
+    pid_t loopbackPid;
+    {
+        MutexLocker lock(&mMutex);
+        std::swap(idle, mIdle);
+        loopbackPid = mLoopbackPid;
+        mLoopbackPid = 0;
+    }
+    for (int i=0; i<idle.size(); ++i)
+        stop(idle.at(i), false);
+    if (loopbackPid) {
+        ::kill(loopbackPid, SIGTERM);
+        int ret;
+        eintrwrap(ret, waitpid(loopbackPid, 0, 0));
+    }
+}
+
+void WorkerPool::init(const String &hello, const String &secret, int maxJobs, int64_t maxMemory)
+{
+    MutexLocker lock(&mMutex);
+    mHello = hello;
+    mSecret = secret;
+    mMaxJobs = maxJobs;
+    mMaxMemory = maxMemory;
+}
+
+void WorkerPool::addRemote(const String &address, FetchMode mode)
+{
+    MutexLocker lock(&mMutex);
+    const Remote remote = { address, mode };
+    mRemotes.append(remote);
+}
+
+bool WorkerPool::startLoopback(const Path &dataDir)
+{
+    const Path socketFile = dataDir + "workers.sock";
+    Path::rm(socketFile);
+    // the worker server reads our secret from here, only we get to see it
+    const Path secretFile = dataDir + "workers.secret";
+    {
+        const int fd = open(secretFile.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        const bool written = fd != -1 && fchmod(fd, 0600) != -1 && writeAll(fd, mSecret.constData(), mSecret.size());
+        if (fd != -1)
+            ::close(fd);
+        if (!written) {
+            error("Can't write %s %d %s", secretFile.constData(), errno, strerror(errno));
+            return false;
+        }
+    }
+    const Path rdm = Rct::executablePath();
+    const int max = sysconf(_SC_OPEN_MAX);
+    const pid_t pid = fork();
+    if (pid == -1) {
+        error("Can't fork worker server %d %s", errno, strerror(errno));
+        return false;
+    } else if (!pid) {
+        for (int i=3; i<max; ++i)
+            ::close(i);
+        execl(rdm.constData(), rdm.constData(), "--worker-server", socketFile.constData(),
+              "--data-dir", dataDir.constData(), "--worker-secret-file", secretFile.constData(),
+              static_cast<char*>(0));
+        _exit(1);
+    }
+    {
+        MutexLocker lock(&mMutex);
+        mLoopbackPid = pid;
+    }
+    enum { Timeout = 5000, Interval = 10 };
+    for (int i=0; i<Timeout / Interval && !socketFile.exists(); ++i)
+        usleep(Interval * 1000);
+    if (!socketFile.exists()) {
+        error("Worker server didn't start on %s", socketFile.constData());
+        return false;
+    }
+    addRemote(socketFile, FetchAll);
+    return true;
+}
+
+shared_ptr<WorkerPool::Worker> WorkerPool::acquire()
+{
+    bool remote;
+    {
+        MutexLocker lock(&mMutex);
+        if (!mIdle.isEmpty()) {
+            shared_ptr<Worker> worker = mIdle.last();
+            mIdle.removeLast();
+            return worker;
+        }
+        remote = !mRemotes.isEmpty();
+    }
+    if (remote) {
+        if (shared_ptr<Worker> worker = connect())
+            return worker;
+    }
+    return spawn();
+}
+
+void WorkerPool::release(const shared_ptr<Worker> &worker, bool ok, uint64_t memory)
+{
+    {
+        MutexLocker lock(&mMutex);
+        if (!ok) {
+            ++mStats.crashed;
+        } else if (++worker->jobs >= mMaxJobs || (mMaxMemory && memory >= static_cast<uint64_t>(mMaxMemory))) {
+            debug("Recycling worker %d after %d jobs using %llu bytes", worker->pid, worker->jobs,
+                  static_cast<unsigned long long>(memory));
+            ++mStats.recycled;
+        } else {
+            mIdle.append(worker);
+            return;
+        }
+    }
+    // waiting for the worker to exit mustn't hold up acquire() in other threads
+    stop(worker, !ok);
+}
+
+shared_ptr<WorkerPool::Worker> WorkerPool::spawn()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        error("Can't create socketpair for worker %d %s", errno, strerror(errno));
+        return shared_ptr<Worker>();
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    // no allocations after fork
+    const Path rdm = Rct::executablePath();
+    const String fd = String::number(fds[1]);
+    const int max = sysconf(_SC_OPEN_MAX);
+    const pid_t pid = fork();
+    if (pid == -1) {
+        error("Can't fork worker %d %s", errno, strerror(errno));
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return shared_ptr<Worker>();
+    } else if (!pid) {
+        for (int i=3; i<max; ++i) {
+            if (i != fds[1])
+                ::close(i);
+        }
+        execl(rdm.constData(), rdm.constData(), "--worker", fd.constData(), static_cast<char*>(0));
+        _exit(1);
+    }
+    ::close(fds[1]);
+
+    shared_ptr<Worker> worker(new Worker);
+    worker->pid = pid;
+    worker->channel = WorkerChannel(fds[0]);
+    if (!hello(worker, NoFetch)) {
+        error("Can't start worker %s", rdm.constData());
+        stop(worker, true);
+        return shared_ptr<Worker>();
+    }
+    MutexLocker lock(&mMutex);
+    ++mStats.started;
+    return worker;
+}
+
+shared_ptr<WorkerPool::Worker> WorkerPool::connect()
+{
+    Remote remote;
+    {
+        MutexLocker lock(&mMutex);
+        remote = mRemotes.at(mNextRemote++ % mRemotes.size());
+    }
+    const int fd = WorkerChannel::connect(remote.address);
+    if (fd == -1) {
+        error("Can't connect to worker server %s %d %s", remote.address.constData(), errno, strerror(errno));
+        return shared_ptr<Worker>();
+    }
+    shared_ptr<Worker> worker(new Worker);
+    worker->remote = true;
+    worker->channel = WorkerChannel(fd);
+    if (!hello(worker, remote.mode)) {
+        error("Lost worker server %s", remote.address.constData());
+        stop(worker, false);
+        return shared_ptr<Worker>();
+    }
+    MutexLocker lock(&mMutex);
+    ++mStats.started;
+    ++mStats.remote;
+    return worker;
+}
+
+bool WorkerPool::hello(const shared_ptr<Worker> &worker, FetchMode fetchMode)
+{
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << mSecret;
+    }
+    String mode;
+    {
+        Serializer serializer(mode);
+        serializer << static_cast<int>(fetchMode);
+    }
+    return worker->channel.send(WorkerChannel::Hello, out + mHello + mode);
+}
+
+void WorkerPool::stop(const shared_ptr<Worker> &worker, bool kill)
+{
+    // workers exit when the channel closes
+    if (kill && worker->pid)
+        ::kill(worker->pid, SIGKILL);
+    worker->channel.close();
+    if (worker->pid) {
+        int ret;
+        eintrwrap(ret, waitpid(worker->pid, 0, 0));
+    }
+}
+
+static void scanIncludes(const String &contents, List<std::pair<String, bool> > &includes)
+{
+    const char *data = contents.constData();
+    const int size = contents.size();
+    int i = 0;
+    while (i < size) {
+        while (i < size && (data[i] == ' ' || data[i] == '\t'))
+            ++i;
+        if (i < size && data[i] == '#') {
+            ++i;
+            while (i < size && (data[i] == ' ' || data[i] == '\t'))
+                ++i;
+            int directive = 0;
+            if (!strncmp(data + i, "include_next", 12)) {
+                directive = 12;
+            } else if (!strncmp(data + i, "include", 7)) {
+                directive = 7;
+            } else if (!strncmp(data + i, "import", 6)) {
+                directive = 6;
+            }
+            if (directive) {
+                i += directive;
+                while (i < size && (data[i] == ' ' || data[i] == '\t'))
+                    ++i;
+                if (i < size && (data[i] == '"' || data[i] == '<')) {
+                    const char close = data[i] == '"' ? '"' : '>';
+                    const int start = ++i;
+                    while (i < size && data[i] != close && data[i] != '\n')
+                        ++i;
+                    if (i < size && data[i] == close && i > start)
+                        includes.append(std::make_pair(String(data + start, i - start), close == '"'));
+                }
+            }
+        }
+        while (i < size && data[i] != '\n')
+            ++i;
+        ++i;
+    }
+}
+
+WorkerPool::ScannedFile WorkerPool::scan(const Path &path)
+{
+    const time_t modified = path.lastModified();
+    {
+        MutexLocker lock(&mScanMutex);
+        const Map<Path, ScannedFile>::const_iterator it = mScannedFiles.find(path);
+        if (it != mScannedFiles.end() && it->second.modified == modified)
+            return it->second;
+    }
+    ScannedFile scanned;
+    scanned.modified = modified;
+    const String contents = path.readAll();
+    scanned.hash = RTags::hash(contents);
+    scanIncludes(contents, scanned.includes);
+
+    MutexLocker lock(&mScanMutex);
+    mScannedFiles[path] = scanned;
+    return scanned;
+}
+
+WorkerPool::Manifest WorkerPool::manifest(const SourceInformation &source)
+{
+    Map<Path, uint64_t> files;
+    const List<String> &defaultArguments = Server::instance()->options().defaultArguments;
+    for (int b=0; b<source.builds.size(); ++b) {
+        // searched in this order, quoted includes look in quotePaths first
+        List<Path> quotePaths, includePaths, systemPaths, afterPaths, queue;
+        queue.append(source.sourceFile);
+        const List<String> *lists[] = { &source.builds.at(b).args.list(), &defaultArguments };
+        for (int l=0; l<2; ++l) {
+            const List<String> &args = *lists[l];
+            for (int i=0; i<args.size(); ++i) {
+                const String &arg = args.at(i);
+                if (arg == "-include" && i + 1 < args.size()) {
+                    queue.append(args.at(++i));
+                    continue;
+                }
+                static const struct {
+                    const char *option;
+                    int length;
+                } options[] = { { "-iquote", 7 }, { "-isystem", 8 }, { "-idirafter", 10 }, { "-I", 2 } };
+                List<Path> *paths[] = { &quotePaths, &systemPaths, &afterPaths, &includePaths };
+                for (int o=0; o<4; ++o) {
+                    if (!arg.startsWith(options[o].option))
+                        continue;
+                    Path dir;
+                    if (arg.size() > options[o].length) {
+                        dir = arg.mid(options[o].length);
+                    } else if (i + 1 < args.size()) {
+                        dir = args.at(++i);
+                    }
+                    if (!dir.isEmpty()) {
+                        if (!dir.endsWith('/'))
+                            dir.append('/');
+                        paths[o]->append(dir);
+                    }
+                    break;
+                }
+            }
+        }
+        includePaths.insert(includePaths.end(), systemPaths.begin(), systemPaths.end());
+        includePaths.insert(includePaths.end(), afterPaths.begin(), afterPaths.end());
+
+        // Conditional includes are all followed, sending too much is harmless
+        Set<Path> seen;
+        for (int q=0; q<queue.size(); ++q) {
+            const Path file = queue.at(q);
+            if (!seen.insert(file))
+                continue;
+            const ScannedFile scanned = scan(file);
+            files[file] = scanned.hash;
+            Path dir = file.parentDir();
+            if (!dir.endsWith('/'))
+                dir.append('/');
+            for (int i=0; i<scanned.includes.size(); ++i) {
+                const String &name = scanned.includes.at(i).first;
+                Path found;
+                if (name.startsWith('/')) {
+                    if (Path(name).isFile())
+                        found = name;
+                } else {
+                    if (scanned.includes.at(i).second) {
+                        if (Path(dir + name).isFile())
+                            found = dir + name;
+                        for (int p=0; found.isEmpty() && p<quotePaths.size(); ++p) {
+                            const Path candidate = quotePaths.at(p) + name;
+                            if (candidate.isFile())
+                                found = candidate;
+                        }
+                    }
+                    for (int p=0; found.isEmpty() && p<includePaths.size(); ++p) {
+                        const Path candidate = includePaths.at(p) + name;
+                        if (candidate.isFile())
+                            found = candidate;
+                    }
+                }
+                if (!found.isEmpty() && !seen.contains(found))
+                    queue.append(found);
+            }
+        }
+    }
+
+    Manifest ret;
+    ret.reserve(files.size());
+    for (Map<Path, uint64_t>::const_iterator it = files.begin(); it != files.end(); ++it)
+        ret.append(*it);
+    return ret;
+}
+
+WorkerPool::Stats WorkerPool::stats() const
+{
+    MutexLocker lock(&mMutex);
+    Stats ret = mStats;
+    ret.idle = mIdle.size();
+    return ret;
+}
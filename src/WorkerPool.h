@@ -0,0 +1,136 @@
+#ifndef WorkerPool_h
+#define WorkerPool_h
+
+#include "SourceInformation.h"
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Mutex.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <rct/Tr1.h>
+#include <sys/types.h>
+
+// Blocking, framed messages between rdm and an rdm --worker process over a
+// socketpair, or a TCP or unix socket for workers from rdm --worker-server. A
+// frame is [size][type][payload] in host byte order
+class WorkerChannel
+{
+public:
+    enum {
+        MaxFrameSize = 256 * 1024 * 1024,
+        MaxHelloSize = 1024 * 1024
+    };
+    enum Type {
+        Hello = 1, // rdm -> worker, shared secret, options and fetch mode
+        Index, // rdm -> worker, project, job type, source and manifest
+        Fetch, // worker -> rdm, paths from the manifest. rdm replies with their contents
+        FileId, // worker -> rdm, path. rdm replies with the file id
+        VisitFile, // worker -> rdm, file id. rdm replies if the worker gets to index it
+        Log, // worker -> rdm, compilation errors for rdm's log outputs
+        Finished // worker -> rdm, aborted, parse time, IndexData and memory usage
+    };
+    WorkerChannel(int fd = -1)
+        : mFd(fd)
+    {}
+
+    int fd() const { return mFd; }
+    bool send(int type, const String &payload);
+    // Fails on frames bigger than maxSize
+    bool receive(int &type, String &payload, int maxSize = MaxFrameSize);
+    void close();
+
+    // address is a unix socket path if it contains a '/', otherwise [host:]port.
+    // Only loopback addresses are listened on unless allowPublic is set
+    static int connect(const String &address);
+    static int listen(const String &address, bool allowPublic);
+private:
+    int mFd;
+};
+
+// rdm --worker processes for Server::IndexInWorkers. Each indexer thread
+// borrows a worker for one job. Workers that have done maxJobs jobs or use
+// more than maxMemory bytes are stopped and replaced by fresh ones which keeps
+// clang's leaks and caches out of rdm
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    // secret is sent first in every Hello, worker servers drop connections
+    // that don't know it
+    void init(const String &hello, const String &secret, int maxJobs, int64_t maxMemory);
+    bool isEnabled() const { return !mHello.isEmpty(); }
+
+    // What workers do with the manifest that comes with each job
+    enum FetchMode {
+        NoFetch, // spawned workers share our file system
+        FetchChanged, // fetch files that differ from the worker's disk
+        FetchAll // loopback, use fetched contents for everything
+    };
+    // Jobs go to workers on these peers round robin instead of to spawned
+    // ones. The loopback worker server runs on this machine with FetchAll so
+    // the remote path can be used and tested without other machines
+    void addRemote(const String &address, FetchMode mode);
+    bool startLoopback(const Path &dataDir);
+
+    struct Worker
+    {
+        Worker() : pid(0), jobs(0), remote(false) {}
+        pid_t pid;
+        WorkerChannel channel;
+        int jobs;
+        bool remote;
+    };
+    shared_ptr<Worker> acquire();
+    // ok is false if the worker died or was interrupted in the middle of a job
+    void release(const shared_ptr<Worker> &worker, bool ok, uint64_t memory);
+
+    // path -> content hash of the source file, its -include files and
+    // everything they #include that resolves against the -I paths. Headers
+    // that don't resolve are expected to come with the worker's toolchain
+    typedef List<std::pair<Path, uint64_t> > Manifest;
+    Manifest manifest(const SourceInformation &source);
+
+    struct Stats
+    {
+        Stats() : started(0), recycled(0), crashed(0), idle(0), remote(0) {}
+        int started, recycled, crashed, idle, remote;
+    };
+    Stats stats() const;
+private:
+    shared_ptr<Worker> spawn();
+    shared_ptr<Worker> connect();
+    bool hello(const shared_ptr<Worker> &worker, FetchMode fetchMode);
+    static void stop(const shared_ptr<Worker> &worker, bool kill);
+
+    struct ScannedFile
+    {
+        ScannedFile() : modified(0), hash(0) {}
+        time_t modified;
+        uint64_t hash;
+        List<std::pair<String, bool> > includes; // name, quoted
+    };
+    ScannedFile scan(const Path &path);
+
+    struct Remote
+    {
+        String address;
+        FetchMode mode;
+    };
+    List<Remote> mRemotes;
+    int mNextRemote;
+    pid_t mLoopbackPid;
+
+    Map<Path, ScannedFile> mScannedFiles;
+    Mutex mScanMutex;
+
+    String mHello, mSecret;
+    int mMaxJobs;
+    int64_t mMaxMemory;
+    List<shared_ptr<Worker> > mIdle;
+    Stats mStats;
+    mutable Mutex mMutex;
+};
+
+#endif
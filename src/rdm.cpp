@@ -2,9 +2,11 @@
 #include <rct/Log.h>
 #include "RTags.h"
 #include "Server.h"
+#include "IndexerWorker.h"
 #include <rct/Rct.h>
 #include <rct/Thread.h>
 #include <rct/ThreadPool.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
@@ -36,6 +38,10 @@ void sigIntHandler(int)
 
 #define EXCLUDEFILTER_DEFAULT "*/CMakeFiles/*;*/cmake*/Modules/*;*/conftest.c*;/tmp/*"
 int defaultStackSize = -1;
+enum {
+    DefaultWorkerMaxJobs = 50,
+    DefaultWorkerMaxMemory = 1024
+};
 void usage(FILE *f)
 {
     fprintf(f,
@@ -65,10 +71,13 @@ void usage(FILE *f)
             "  --socket-file|-n [arg]            Use this file for the server socket (default ~/.rdm).\n"
             "  --setenv|-e [arg]                 Set this environment variable (--setenv \"foobar=1\").\n"
             "  --completion-cache-size|-a [arg]  Cache this many translation units (default 0, must have at least 1 to use completion).\n"
+            "  --completion-cache-memory|-k [arg] Evict cached translation units when a project's use more than this many megabytes (default 0, no limit).\n"
+            "  --preamble-cache-size|-H [arg]    Share precompiled preambles between translation units, using up to this many megabytes in the data dir (default 0, disabled).\n"
             "  --no-current-project|-o           Don't restore the last current project on startup.\n"
             "  --allow-multiple-builds|-m        Without this setting different builds will be merged for each source file.\n"
             "  --unload-timer|-u [arg]           Number of minutes to wait before unloading non-current projects (disabled by default).\n"
             "  --thread-count|-j [arg]           Spawn this many threads for thread pool.\n"
+            "  --memory-budget|-z [arg]          Run as many indexer jobs as fit in this many megabytes, starting at --thread-count and up to one per core (default 0, no limit).\n"
             "  --watch-system-paths|-w           Watch system paths for changes.\n"
 #ifdef OS_Darwin
             "  --filemanager-watch|-M            Use a file system watcher for filemanager.\n"
@@ -78,7 +87,22 @@ void usage(FILE *f)
             "  --ignore-compiler|-b [arg]        Alias this compiler (Might be practical to avoid duplicated builds for things like icecc).\n"
             "  --disable-plugin|-p [arg]         Don't load this plugin\n"
             "  --disable-esprima|-E              Don't use esprima\n"
-            "  --clang-stack-size|-t [arg]       Use this much stack for clang's threads (default %d).\n", defaultStackSize);
+            "  --reindex-all-dependents|-R       Reindex every file that includes a modified header, not just the ones using what changed.\n"
+            "  --clang-index-api|-X              Index with libclang's indexing callbacks instead of visiting the whole AST.\n"
+            "  --declarations-first|-g           Index new files without function bodies first and fill in references in a second pass.\n"
+            "  --index-in-workers|-Z             Index in separate rdm --worker processes.\n"
+            "  --worker-max-jobs|-J [arg]        Replace worker processes after this many jobs (default %d).\n"
+            "  --worker-max-memory|-K [arg]      Replace worker processes using more than this many megabytes (default %d).\n"
+            "  --remote-worker|-G [arg]          Index in workers from the rdm --worker-server on this [host:]port or unix socket path.\n"
+            "                                    Workers fetch the files they need from us. Can be passed multiple times.\n"
+            "  --loopback-workers|-O             Index in workers from a local rdm --worker-server that fetches every file.\n"
+            "  --worker-server|-T [arg]          Serve workers to remote rdms on this [host:]port (host defaults to 127.0.0.1)\n"
+            "                                    or unix socket path.\n"
+            "  --worker-server-public|-P         Let --worker-server listen on addresses other than the loopback interface.\n"
+            "  --worker-secret-file|-Q [arg]     Shared secret for --worker-server and --remote-worker, peers without it are refused.\n"
+            "  --worker|-Y [arg]                 Internal, index for the rdm on the other end of this file descriptor.\n"
+            "  --clang-stack-size|-t [arg]       Use this much stack for clang's threads (default %d).\n",
+            DefaultWorkerMaxJobs, DefaultWorkerMaxMemory, defaultStackSize);
 }
 
 int main(int argc, char** argv)
@@ -105,6 +129,7 @@ int main(int argc, char** argv)
         { "append", no_argument, 0, 'A' },
         { "verbose", no_argument, 0, 'v' },
         { "thread-count", required_argument, 0, 'j' },
+        { "memory-budget", required_argument, 0, 'z' },
         { "clean-slate", no_argument, 0, 'C' },
         { "enable-sighandler", no_argument, 0, 's' },
         { "silent", no_argument, 0, 'S' },
@@ -117,6 +142,8 @@ int main(int argc, char** argv)
         { "ignore-printf-fixits", no_argument, 0, 'F' },
         { "unlimited-errors", no_argument, 0, 'f' },
         { "completion-cache-size", required_argument, 0, 'a' },
+        { "completion-cache-memory", required_argument, 0, 'k' },
+        { "preamble-cache-size", required_argument, 0, 'H' },
         { "no-spell-checking", no_argument, 0, 'l' },
         { "large-by-value-copy", required_argument, 0, 'r' },
         { "allow-multiple-builds", no_argument, 0, 'm' },
@@ -127,6 +154,18 @@ int main(int argc, char** argv)
         { "disable-plugin", required_argument, 0, 'p' },
         { "watch-system-paths", no_argument, 0, 'w' },
         { "disable-esprima", no_argument, 0, 'E' },
+        { "reindex-all-dependents", no_argument, 0, 'R' },
+        { "clang-index-api", no_argument, 0, 'X' },
+        { "declarations-first", no_argument, 0, 'g' },
+        { "index-in-workers", no_argument, 0, 'Z' },
+        { "worker-max-jobs", required_argument, 0, 'J' },
+        { "worker-max-memory", required_argument, 0, 'K' },
+        { "worker", required_argument, 0, 'Y' },
+        { "remote-worker", required_argument, 0, 'G' },
+        { "loopback-workers", no_argument, 0, 'O' },
+        { "worker-server", required_argument, 0, 'T' },
+        { "worker-server-public", no_argument, 0, 'P' },
+        { "worker-secret-file", required_argument, 0, 'Q' },
 #ifdef OS_Darwin
         { "filemanager-watch", no_argument, 0, 'M' },
 #else
@@ -169,6 +208,8 @@ int main(int argc, char** argv)
                 break;
             switch (c) {
             case 'N':
+            case 'Y': // workers get everything from rdm
+            case 'T':
                 norc = true;
                 break;
             case 'c':
@@ -221,6 +262,11 @@ int main(int argc, char** argv)
     serverOpts.dataDir = String::format<128>("%s.rtags", Path::home().constData());
     serverOpts.unloadTimer = 0;
     serverOpts.clangStackSize = defaultStackSize;
+    serverOpts.workerMaxJobs = DefaultWorkerMaxJobs;
+    serverOpts.workerMaxMemory = DefaultWorkerMaxMemory;
+    int workerFd = -1;
+    String workerServer;
+    bool workerServerPublic = false;
 
     const char *logFile = 0;
     unsigned logFlags = 0;
@@ -265,6 +311,63 @@ int main(int argc, char** argv)
         case 'E':
             serverOpts.options |= Server::NoEsprima;
             break;
+        case 'R':
+            serverOpts.options |= Server::ReindexAllDependents;
+            break;
+        case 'X':
+            serverOpts.options |= Server::ClangIndexApi;
+            break;
+        case 'g':
+            serverOpts.options |= Server::DeclarationsFirst;
+            break;
+        case 'Z':
+            serverOpts.options |= Server::IndexInWorkers;
+            break;
+        case 'J':
+            serverOpts.workerMaxJobs = atoi(optarg);
+            if (serverOpts.workerMaxJobs <= 0) {
+                fprintf(stderr, "Invalid argument to -J %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'K':
+            serverOpts.workerMaxMemory = atoi(optarg);
+            if (serverOpts.workerMaxMemory <= 0) {
+                fprintf(stderr, "Invalid argument to -K %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'G':
+            serverOpts.remoteWorkers.append(optarg);
+            serverOpts.options |= Server::IndexInWorkers;
+            break;
+        case 'O':
+            serverOpts.options |= Server::IndexInWorkers|Server::LoopbackWorkers;
+            break;
+        case 'T':
+            workerServer = optarg;
+            break;
+        case 'P':
+            workerServerPublic = true;
+            break;
+        case 'Q':
+            serverOpts.workerSecret = Path(optarg).readAll();
+            while (!serverOpts.workerSecret.isEmpty()
+                   && isspace(static_cast<unsigned char>(serverOpts.workerSecret.at(serverOpts.workerSecret.size() - 1)))) {
+                serverOpts.workerSecret.chop(1);
+            }
+            if (serverOpts.workerSecret.isEmpty()) {
+                fprintf(stderr, "No secret in %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'Y':
+            workerFd = atoi(optarg);
+            if (workerFd <= 2) {
+                fprintf(stderr, "Invalid argument to --worker %s\n", optarg);
+                return 1;
+            }
+            break;
         case 'm':
             serverOpts.options |= Server::AllowMultipleBuilds;
             break;
@@ -323,6 +426,27 @@ int main(int argc, char** argv)
                 return 1;
             }
             break;
+        case 'k':
+            serverOpts.completionCacheMemory = atoi(optarg);
+            if (serverOpts.completionCacheMemory < 1) {
+                fprintf(stderr, "Invalid argument to -k %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H':
+            serverOpts.preambleCacheSize = atoi(optarg);
+            if (serverOpts.preambleCacheSize < 1) {
+                fprintf(stderr, "Invalid argument to -H %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            serverOpts.memoryBudget = atoi(optarg);
+            if (serverOpts.memoryBudget <= 0) {
+                fprintf(stderr, "Invalid argument to -z %s\n", optarg);
+                return 1;
+            }
+            break;
         case 'j':
             serverOpts.threadCount = atoi(optarg);
             if (serverOpts.threadCount <= 0) {
@@ -377,8 +501,33 @@ int main(int argc, char** argv)
     }
     warning("Running with %d jobs", serverOpts.threadCount);
 
+    Path workerCacheDir = serverOpts.dataDir;
+    if (!workerCacheDir.endsWith('/'))
+        workerCacheDir.append('/');
+    workerCacheDir += "worker-files/";
+    String workerHello;
+    if (!workerServer.isEmpty()) {
+        if (serverOpts.workerSecret.isEmpty()) {
+            error("--worker-server needs a --worker-secret-file");
+            cleanupLogging();
+            return 1;
+        }
+        workerFd = IndexerWorker::serve(workerServer, workerCacheDir, serverOpts.workerSecret,
+                                        workerServerPublic, workerHello);
+        if (workerFd == -1) {
+            cleanupLogging();
+            return 1;
+        }
+    }
+
     EventLoop loop;
 
+    if (workerFd != -1) {
+        const int ret = IndexerWorker(workerFd, workerCacheDir).exec(workerHello);
+        cleanupLogging();
+        return ret;
+    }
+
     shared_ptr<Server> server(new Server);
     ::socketFile = serverOpts.socketFile;
     if (!serverOpts.dataDir.endsWith('/'))
@@ -1460,6 +1460,20 @@ References to references will be treated as references to the referenced symbol"
     (add-hook 'post-command-hook (function rtags-restart-completion-cache-timer))
   (remove-hook 'post-command-hook (function rtags-restart-completion-cache-timer)))
 
+(defun rtags-warm-up-completion ()
+  (interactive)
+  (when (and (buffer-file-name)
+             (or (eq major-mode 'c++-mode)
+                 (eq major-mode 'c-mode)))
+    (let ((path (buffer-file-name)))
+      (with-temp-buffer
+        (rtags-call-rc :path path :noerror t "--warm-up-completion" path))))
+  t)
+
+(if rtags-completion-enabled
+    (add-hook 'find-file-hook 'rtags-warm-up-completion)
+  (remove-hook 'find-file-hook 'rtags-warm-up-completion))
+
 (defvar rtags-last-update-current-project-buffer nil)
 (defun rtags-update-current-project ()
   (interactive)
@@ -1610,6 +1624,7 @@ References to references will be treated as references to the referenced symbol"
       (rtags-call-rc :path path "-T" path :noerror t)
       (goto-char (point-min))
       (cond ((looking-at "1") 'rtags-indexed)
+            ((looking-at "3") 'rtags-indexed) ;; declarations only so far
             ((looking-at "2") 'rtags-file-managed)
             (t nil))))
   )